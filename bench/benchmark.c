@@ -0,0 +1,1634 @@
+//
+// Benchmarks for the max-tree builders and the disparity pipeline.
+//
+
+#include "maxtree3b.h"
+#include "calculatedisp.h"
+#include "maxtreetiled.h"
+#include "maxtree16.h"
+#include "maxtreeattr.h"
+#include "rowmatch.h"
+#include "dispsgm.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct BenchStruct BenchStruct;
+struct BenchStruct {
+    char *Name;
+    char *Args;
+    int (*Run)(int argc, char *argv[]);
+};
+
+double time_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (ts.tv_sec*1e3 + ts.tv_nsec/1e6);
+}
+
+ulong count_nodes(const MaxTree *mt) {
+    ulong num_nodes = 0;
+    for (int l = 0; l < NUMLEVELS; ++l) {
+        num_nodes += mt->NumNodesAtLevel[l];
+    }
+    return (num_nodes);
+}
+
+ImageGray *read_bench_image(char *fname) {
+    ImageGray *img = ImagePGMRead(fname);
+    if (img==NULL || img->Pixmap==NULL) {
+        fprintf(stderr, "Can't read image '%s'\n", fname);
+        return (NULL);
+    }
+    printf("Image '%s': Width=%lu Height=%lu\n", fname, img->Width, img->Height);
+    return (img);
+}
+
+// Builds the tree of one image with every entry of Builders and reports the mean build and delete times
+int bench_builders(int argc, char *argv[]) {
+    ImageGray *img, *template;
+    MaxTree *mt;
+    int attrib = (argc>1) ? atoi(argv[1]) : 0;
+    int repeats = (argc>2) ? atoi(argv[2]) : 10;
+
+    img = read_bench_image(argv[0]);
+    if (img==NULL) {
+        return (-1);
+    }
+    template = GetTemplate(NULL, img);
+    printf("Attribute: %s, %d runs\n", Attribs[attrib].Name, repeats);
+    for (int b = 0; b < NUMBUILDERS; ++b) {
+        double build = 0.0, delete = 0.0, t;
+        ulong num_nodes = 0;
+        for (int r = 0; r < repeats; ++r) {
+            t = time_ms();
+            mt = Builders[b].Create(img, template, Attribs[attrib].NewAuxData, Attribs[attrib].AddToAuxData,
+                                    Attribs[attrib].MergeAuxData, Attribs[attrib].DeleteAuxData);
+            build += time_ms() - t;
+            if (mt==NULL) {
+                fprintf(stderr, "Can't create Max-tree with builder '%s'\n", Builders[b].Name);
+                ImageGrayDelete(template);
+                ImageGrayDelete(img);
+                return (-1);
+            }
+            num_nodes = count_nodes(mt);
+            t = time_ms();
+            MaxTreeDelete(mt);
+            delete += time_ms() - t;
+        }
+        printf("%-16s build %9.3f ms  delete %9.3f ms  nodes %lu\n", Builders[b].Name, build/repeats,
+               delete/repeats, num_nodes);
+    }
+    ImageGrayDelete(template);
+    ImageGrayDelete(img);
+    return (0);
+}
+
+// Compares two trees of img pixel by pixel on the level, area and attribute of the node and of its parent
+bool same_tree(const MaxTree *mt_a, const MaxTree *mt_b, const ImageGray *img, double (*attribute)(void *)) {
+    ulong imgsize = img->Width*img->Height;
+    for (ulong p = 0; p < imgsize; ++p) {
+        ulong idx_a = MaxTreeNodeOf(mt_a, img, p);
+        ulong idx_b = MaxTreeNodeOf(mt_b, img, p);
+        const MaxNode *node_a = &(mt_a->Nodes[idx_a]);
+        const MaxNode *node_b = &(mt_b->Nodes[idx_b]);
+        const MaxNode *par_a = &(mt_a->Nodes[node_a->Parent]);
+        const MaxNode *par_b = &(mt_b->Nodes[node_b->Parent]);
+        if (node_a->Area!=node_b->Area || par_a->Area!=par_b->Area || par_a->Level!=par_b->Level ||
+            (*attribute)(mt_a->Attributes[idx_a])!=(*attribute)(mt_b->Attributes[idx_b])) {
+            return (false);
+        }
+    }
+    return (true);
+}
+
+// Builds the tree of one image with the strip builder at 1 to 16 threads and reports the speedup
+int bench_threads(int argc, char *argv[]) {
+    int thread_counts[] = {1, 2, 4, 8, 16};
+    ImageGray *img, *template;
+    MaxTree *mt, *mt_ref;
+    int attrib = (argc>1) ? atoi(argv[1]) : 0;
+    int repeats = (argc>2) ? atoi(argv[2]) : 10;
+    double single = 0.0;
+
+    img = read_bench_image(argv[0]);
+    if (img==NULL) {
+        return (-1);
+    }
+    template = GetTemplate(NULL, img);
+    printf("Attribute: %s, %d runs, %ld processors online\n", Attribs[attrib].Name, repeats,
+           sysconf(_SC_NPROCESSORS_ONLN));
+    mt_ref = MaxTreeCreate(img, template, Attribs[attrib].NewAuxData, Attribs[attrib].AddToAuxData,
+                           Attribs[attrib].MergeAuxData, Attribs[attrib].DeleteAuxData);
+    if (mt_ref==NULL) {
+        fprintf(stderr, "Can't create Max-tree\n");
+        ImageGrayDelete(template);
+        ImageGrayDelete(img);
+        return (-1);
+    }
+    for (ulong i = 0; i < sizeof(thread_counts)/sizeof(thread_counts[0]); ++i) {
+        double build = 0.0, t;
+        bool same = true;
+        for (int r = 0; r < repeats; ++r) {
+            t = time_ms();
+            mt = MaxTreeCreateParallel(img, template, Attribs[attrib].NewAuxData, Attribs[attrib].AddToAuxData,
+                                       Attribs[attrib].MergeAuxData, Attribs[attrib].DeleteAuxData, thread_counts[i]);
+            build += time_ms() - t;
+            if (mt==NULL) {
+                fprintf(stderr, "Can't create Max-tree with %d threads\n", thread_counts[i]);
+                MaxTreeDelete(mt_ref);
+                ImageGrayDelete(template);
+                ImageGrayDelete(img);
+                return (-1);
+            }
+            if (r==0) {
+                same = same_tree(mt_ref, mt, img, Attribs[attrib].Attribute);
+            }
+            MaxTreeDelete(mt);
+        }
+        build /= repeats;
+        if (i==0) {
+            single = build;
+        }
+        printf("%2d threads  build %9.3f ms  speedup %5.2f  %s\n", thread_counts[i], build, single/build,
+               same ? "same as flooding" : "DIFFERS from flooding");
+    }
+    MaxTreeDelete(mt_ref);
+    ImageGrayDelete(template);
+    ImageGrayDelete(img);
+    return (0);
+}
+
+// Filters one image out-of-core within a memory budget and compares the result with the in-core filter
+int bench_tiled(int argc, char *argv[]) {
+    ImageGray *img, *template, *out, *tiled;
+    MaxTree *mt;
+    char *tiledfname = "tiled.pgm";
+    int attrib = (argc>1) ? atoi(argv[1]) : 0;
+    double lambda = (argc>2) ? atof(argv[2]) : 100.0;
+    int decision = (argc>3) ? atoi(argv[3]) : DECISION_DIRECT;
+    ulong budget = ((argc>4) ? strtoul(argv[4], NULL, 10) : 64)*1024*1024;
+    ulong num_bands, num_boundary, peak, num_diff = 0;
+    double t, t_incore, t_tiled;
+
+    img = read_bench_image(argv[0]);
+    if (img==NULL) {
+        return (-1);
+    }
+    template = GetTemplate(NULL, img);
+    out = ImageGrayCreate(img->Width, img->Height);
+    printf("Attribute: %s, lambda %g, decision %s, budget %lu MB\n", Attribs[attrib].Name, lambda,
+           Decisions[decision].Name, budget/(1024*1024));
+    t = time_ms();
+    mt = MaxTreeCreate(img, template, Attribs[attrib].NewAuxData, Attribs[attrib].AddToAuxData,
+                       Attribs[attrib].MergeAuxData, Attribs[attrib].DeleteAuxData);
+    if (mt==NULL) {
+        fprintf(stderr, "Can't create Max-tree\n");
+        ImageGrayDelete(out);
+        ImageGrayDelete(template);
+        ImageGrayDelete(img);
+        return (-1);
+    }
+    Decisions[decision].Filter(mt, img, template, out, Attribs[attrib].Attribute, lambda);
+    t_incore = time_ms() - t;
+    MaxTreeDelete(mt);
+
+    t = time_ms();
+    if (MaxTreeTiledFilter(argv[0], tiledfname, &(Attribs[attrib]), decision, lambda, budget, &num_bands,
+                           &num_boundary, &peak)) {
+        fprintf(stderr, "Can't filter '%s' out-of-core\n", argv[0]);
+        ImageGrayDelete(out);
+        ImageGrayDelete(template);
+        ImageGrayDelete(img);
+        return (-1);
+    }
+    t_tiled = time_ms() - t;
+    tiled = ImagePGMRead(tiledfname);
+    for (ulong p = 0; tiled && p < img->Width*img->Height; ++p) {
+        if (tiled->Pixmap[p]!=out->Pixmap[p]) {
+            num_diff++;
+        }
+    }
+    printf("in-core     %9.3f ms\n", t_incore);
+    printf("out-of-core %9.3f ms  bands %lu  boundary nodes %lu  peak %.1f MB  differing pixels %lu\n", t_tiled,
+           num_bands, num_boundary, peak/(1024.0*1024.0), tiled ? num_diff : img->Width*img->Height);
+    if (tiled) {
+        ImageGrayDelete(tiled);
+    }
+    ImageGrayDelete(out);
+    ImageGrayDelete(template);
+    ImageGrayDelete(img);
+    return (0);
+}
+
+// Builds the tree of a high bit-depth image and of the same image quantized to 8 bits
+int bench_highbit(int argc, char *argv[]) {
+    ImageGray16 *img;
+    ImageGray *quantized, *template;
+    MaxTree16 *mt;
+    MaxTree *mt8;
+    int attrib = (argc>1) ? atoi(argv[1]) : 0;
+    int repeats = (argc>2) ? atoi(argv[2]) : 10;
+    double build = 0.0, build8 = 0.0, t;
+    ulong imgsize, num_nodes = 0, num_nodes8 = 0;
+    int shift = 0;
+    ushort maxlevel = 0;
+
+    img = ImageGray16Read(argv[0]);
+    if (img==NULL) {
+        fprintf(stderr, "Can't read image '%s'\n", argv[0]);
+        return (-1);
+    }
+    if (!MaxTree16SupportsAttrib(&(Attribs[attrib]))) {
+        fprintf(stderr, "Attribute '%s' needs 8-bit gray levels\n", Attribs[attrib].Name);
+        ImageGray16Delete(img);
+        return (-1);
+    }
+    imgsize = img->Width*img->Height;
+    for (ulong p = 0; p < imgsize; ++p) {
+        if (img->Pixmap[p]>maxlevel) {
+            maxlevel = img->Pixmap[p];
+        }
+    }
+    while ((maxlevel >> shift) >= NUMLEVELS) {
+        shift++;
+    }
+    quantized = ImageGrayCreate(img->Width, img->Height);
+    template = GetTemplate(NULL, quantized);
+    for (ulong p = 0; p < imgsize; ++p) {
+        quantized->Pixmap[p] = img->Pixmap[p] >> shift;
+    }
+    printf("Image '%s': Width=%lu Height=%lu max. level %u\n", argv[0], img->Width, img->Height, maxlevel);
+    printf("Attribute: %s, %d runs\n", Attribs[attrib].Name, repeats);
+    for (int r = 0; r < repeats; ++r) {
+        t = time_ms();
+        mt = MaxTree16Create(img, template, Attribs[attrib].NewAuxData, Attribs[attrib].AddToAuxData,
+                             Attribs[attrib].MergeAuxData, Attribs[attrib].DeleteAuxData);
+        build += time_ms() - t;
+        if (mt==NULL) {
+            fprintf(stderr, "Can't create Max-tree\n");
+            break;
+        }
+        num_nodes = mt->NumNodes;
+        MaxTree16Delete(mt);
+        t = time_ms();
+        mt8 = MaxTreeCreate(quantized, template, Attribs[attrib].NewAuxData, Attribs[attrib].AddToAuxData,
+                            Attribs[attrib].MergeAuxData, Attribs[attrib].DeleteAuxData);
+        build8 += time_ms() - t;
+        if (mt8==NULL) {
+            fprintf(stderr, "Can't create Max-tree\n");
+            break;
+        }
+        num_nodes8 = count_nodes(mt8);
+        MaxTreeDelete(mt8);
+    }
+    printf("full depth      build %9.3f ms  nodes %lu\n", build/repeats, num_nodes);
+    printf("quantized 8-bit build %9.3f ms  nodes %lu\n", build8/repeats, num_nodes8);
+    ImageGrayDelete(template);
+    ImageGrayDelete(quantized);
+    ImageGray16Delete(img);
+    return (0);
+}
+
+// Builds and deletes the tree of one image with every builder, with and without the attribute arena
+int bench_arena(int argc, char *argv[]) {
+    ImageGray *img, *template;
+    MaxTree *mt;
+    int attrib = (argc>1) ? atoi(argv[1]) : 0;
+    int repeats = (argc>2) ? atoi(argv[2]) : 10;
+
+    img = read_bench_image(argv[0]);
+    if (img==NULL) {
+        return (-1);
+    }
+    template = GetTemplate(NULL, img);
+    printf("Attribute: %s, %d runs\n", Attribs[attrib].Name, repeats);
+    for (int b = 0; b < NUMBUILDERS; ++b) {
+        for (int arena = 0; arena < 2; ++arena) {
+            double build = 0.0, delete = 0.0, t;
+            ulong num_allocs = 0, num_nodes = 0;
+            MaxTreeUseArena = arena;
+            for (int r = 0; r < repeats; ++r) {
+                num_allocs = AuxDataMallocCount();
+                t = time_ms();
+                mt = Builders[b].Create(img, template, Attribs[attrib].NewAuxData, Attribs[attrib].AddToAuxData,
+                                        Attribs[attrib].MergeAuxData, Attribs[attrib].DeleteAuxData);
+                build += time_ms() - t;
+                num_allocs = AuxDataMallocCount() - num_allocs;
+                if (mt==NULL) {
+                    fprintf(stderr, "Can't create Max-tree with builder '%s'\n", Builders[b].Name);
+                    MaxTreeUseArena = true;
+                    ImageGrayDelete(template);
+                    ImageGrayDelete(img);
+                    return (-1);
+                }
+                num_nodes = count_nodes(mt);
+                t = time_ms();
+                MaxTreeDelete(mt);
+                delete += time_ms() - t;
+            }
+            printf("%-16s %-8s build %9.3f ms  delete %9.3f ms  mallocs %8lu  nodes %lu\n", Builders[b].Name,
+                   arena ? "arena" : "malloc", build/repeats, delete/repeats, num_allocs, num_nodes);
+        }
+    }
+    MaxTreeUseArena = true;
+    ImageGrayDelete(template);
+    ImageGrayDelete(img);
+    return (0);
+}
+
+// Times the filters and the disparity of a stereo pair on trees with and without the pixel to node map
+int bench_nodemap(int argc, char *argv[]) {
+    ImageGray *img_l, *img_r, *template, *out;
+    MaxTree *mt_l, *mt_r;
+    int attrib = (argc>2) ? atoi(argv[2]) : 0;
+    int repeats = (argc>3) ? atoi(argv[3]) : 10;
+
+    img_l = read_bench_image(argv[0]);
+    img_r = (argc>1) ? read_bench_image(argv[1]) : NULL;
+    if (img_l==NULL || img_r==NULL || img_l->Width!=img_r->Width || img_l->Height!=img_r->Height) {
+        if (img_l) ImageGrayDelete(img_l);
+        if (img_r) ImageGrayDelete(img_r);
+        return (-1);
+    }
+    template = GetTemplate(NULL, img_l);
+    out = ImageGrayCreate(img_l->Width, img_l->Height);
+    printf("Attribute: %s, %d runs\n", Attribs[attrib].Name, repeats);
+    for (int map = 0; map < 2; ++map) {
+        double filter = 0.0, disp = 0.0, t;
+        MaxTreeUseNodeMap = map;
+        mt_l = MaxTreeCreate(img_l, template, Attribs[attrib].NewAuxData, Attribs[attrib].AddToAuxData,
+                             Attribs[attrib].MergeAuxData, Attribs[attrib].DeleteAuxData);
+        mt_r = MaxTreeCreate(img_r, template, Attribs[attrib].NewAuxData, Attribs[attrib].AddToAuxData,
+                             Attribs[attrib].MergeAuxData, Attribs[attrib].DeleteAuxData);
+        if (mt_l==NULL || mt_r==NULL) {
+            fprintf(stderr, "Can't create Max-trees\n");
+            if (mt_l) MaxTreeDelete(mt_l);
+            if (mt_r) MaxTreeDelete(mt_r);
+            break;
+        }
+        for (int r = 0; r < repeats; ++r) {
+            t = time_ms();
+            for (int d = 0; d < NUMDECISIONS; ++d) {
+                Decisions[d].Filter(mt_l, img_l, template, out, Attribs[attrib].Attribute, 100.0);
+            }
+            filter += time_ms() - t;
+            t = time_ms();
+            calc_disp(mt_l, mt_r, img_l, img_r, out, Attribs[attrib].Attribute, MeanXAttribute, 0, img_l->Width);
+            disp += time_ms() - t;
+        }
+        printf("%-8s filters %9.3f ms  disparity %9.3f ms\n", map ? "nodemap" : "status",
+               filter/repeats, disp/repeats);
+        MaxTreeDelete(mt_l);
+        MaxTreeDelete(mt_r);
+    }
+    MaxTreeUseNodeMap = true;
+    ImageGrayDelete(out);
+    ImageGrayDelete(template);
+    ImageGrayDelete(img_r);
+    ImageGrayDelete(img_l);
+    return (0);
+}
+
+// Reports the size of the row runs of a stereo pair against the pixel to node map, and times the filters and the
+// disparity with the runs attached to the trees and without them
+int bench_runs(int argc, char *argv[]) {
+    ImageGray *img_l, *img_r, *template, *out[2], *disp[2];
+    MaxTree *mt_l, *mt_r;
+    int attrib = (argc>2) ? atoi(argv[2]) : 12;
+    int repeats = (argc>3) ? atoi(argv[3]) : 10;
+    double filter[2] = {0.0, 0.0}, match[2] = {0.0, 0.0}, build = 0.0, t;
+    int st = 0;
+
+    img_l = read_bench_image(argv[0]);
+    img_r = (argc>1) ? read_bench_image(argv[1]) : NULL;
+    if (img_l==NULL || img_r==NULL || img_l->Width!=img_r->Width || img_l->Height!=img_r->Height) {
+        if (img_l) ImageGrayDelete(img_l);
+        if (img_r) ImageGrayDelete(img_r);
+        return (-1);
+    }
+    template = GetTemplate(NULL, img_l);
+    mt_l = MaxTreeCreate(img_l, template, Attribs[attrib].NewAuxData, Attribs[attrib].AddToAuxData,
+                         Attribs[attrib].MergeAuxData, Attribs[attrib].DeleteAuxData);
+    mt_r = MaxTreeCreate(img_r, template, Attribs[attrib].NewAuxData, Attribs[attrib].AddToAuxData,
+                         Attribs[attrib].MergeAuxData, Attribs[attrib].DeleteAuxData);
+    if (mt_l==NULL || mt_r==NULL) {
+        fprintf(stderr, "Can't create Max-trees\n");
+        if (mt_l) MaxTreeDelete(mt_l);
+        if (mt_r) MaxTreeDelete(mt_r);
+        ImageGrayDelete(template);
+        ImageGrayDelete(img_r);
+        ImageGrayDelete(img_l);
+        return (-1);
+    }
+    ulong imgsize = img_l->Width*img_l->Height;
+    for (int i = 0; i < 2; ++i) {
+        out[i] = ImageGrayCreate(img_l->Width, img_l->Height);
+        disp[i] = ImageGrayCreate(img_l->Width, img_l->Height);
+    }
+    printf("Attribute: %s, %d runs\n", Attribs[attrib].Name, repeats);
+    for (int use_runs = 0; use_runs < 2; ++use_runs) {
+        if (use_runs) {
+            t = time_ms();
+            MaxTreeBuildRuns(mt_l, img_l);
+            MaxTreeBuildRuns(mt_r, img_r);
+            build = time_ms() - t;
+        }
+        for (int r = 0; r < repeats; ++r) {
+            t = time_ms();
+            for (int d = 0; d < NUMDECISIONS; ++d) {
+                Decisions[d].Filter(mt_l, img_l, template, out[use_runs], Attribs[attrib].Attribute, 100.0);
+            }
+            filter[use_runs] += time_ms() - t;
+            t = time_ms();
+            calc_disp(mt_l, mt_r, img_l, img_r, disp[use_runs], Attribs[attrib].Attribute, MeanXAttribute, 0,
+                      img_l->Width);
+            match[use_runs] += time_ms() - t;
+        }
+    }
+    if (mt_l->Runs && mt_r->Runs) {
+        ulong num_runs = mt_l->Runs->NumRuns + mt_r->Runs->NumRuns;
+        size_t map_bytes = 2*imgsize*sizeof(uint);
+        size_t run_bytes = num_runs*sizeof(MaxTreeRun) + 2*(img_l->Height+1)*sizeof(ulong);
+        printf("%lu runs, %.1f pixels per run, %.1f KiB against %.1f KiB of node map (%.1f%%), built in %.3f ms\n",
+               num_runs, 2.0*imgsize/num_runs, run_bytes/1024.0, map_bytes/1024.0, 100.0*run_bytes/map_bytes, build);
+        printf("no runs  filters %9.3f ms  disparity %9.3f ms\n", filter[0]/repeats, match[0]/repeats);
+        printf("runs     filters %9.3f ms  disparity %9.3f ms\n", filter[1]/repeats, match[1]/repeats);
+        if (memcmp(out[0]->Pixmap, out[1]->Pixmap, imgsize)!=0 || memcmp(disp[0]->Pixmap, disp[1]->Pixmap, imgsize)!=0) {
+            fprintf(stderr, "Output with and without runs differs\n");
+            st = -1;
+        }
+    }
+    for (int i = 0; i < 2; ++i) {
+        ImageGrayDelete(out[i]);
+        ImageGrayDelete(disp[i]);
+    }
+    MaxTreeDelete(mt_l);
+    MaxTreeDelete(mt_r);
+    ImageGrayDelete(template);
+    ImageGrayDelete(img_r);
+    ImageGrayDelete(img_l);
+    return (st);
+}
+
+// Builds one tree per attribute of the Attribs table and one tree holding all of them, and checks that every
+// attribute of the combined tree agrees with its own tree
+int bench_multiattr(int argc, char *argv[]) {
+    ImageGray *img, *template;
+    MaxTree *mt, *mt_multi;
+    ulong mask = (1UL << NUMATTR) - 1;
+    int builder = (argc>1) ? atoi(argv[1]) : 0;
+    int repeats = (argc>2) ? atoi(argv[2]) : 3;
+    double separate = 0.0, combined = 0.0, t;
+    int st = 0;
+
+    img = read_bench_image(argv[0]);
+    if (img==NULL) {
+        return (-1);
+    }
+    template = GetTemplate(NULL, img);
+    MultiAttribSelect(Attribs, mask);
+    printf("Builder: %s, %d attributes, %d runs\n", Builders[builder].Name, NUMATTR, repeats);
+    for (int r = 0; r < repeats && st==0; ++r) {
+        t = time_ms();
+        mt_multi = Builders[builder].Create(img, template, NewMultiData, AddToMultiData, MergeMultiData,
+                                            DeleteMultiData);
+        combined += time_ms() - t;
+        if (mt_multi==NULL) {
+            fprintf(stderr, "Can't create combined Max-tree\n");
+            st = -1;
+            break;
+        }
+        for (int a = 0; a < NUMATTR; ++a) {
+            t = time_ms();
+            mt = Builders[builder].Create(img, template, Attribs[a].NewAuxData, Attribs[a].AddToAuxData,
+                                          Attribs[a].MergeAuxData, Attribs[a].DeleteAuxData);
+            separate += time_ms() - t;
+            if (mt==NULL) {
+                fprintf(stderr, "Can't create Max-tree of '%s'\n", Attribs[a].Name);
+                st = -1;
+                break;
+            }
+            double (*multi_attribute)(void *) = MultiAttribFor(&Attribs[a]);
+            for (ulong i = 0; r==0 && i < mt->NumNodes; ++i) {
+                double v = (*Attribs[a].Attribute)(mt->Attributes[i]);
+                double v_multi = multi_attribute(mt_multi->Attributes[i]);
+                if (v!=v_multi && !(isnan(v) && isnan(v_multi))) {
+                    fprintf(stderr, "'%s' differs at node %lu: %g vs %g\n", Attribs[a].Name, i, v, v_multi);
+                    st = -1;
+                    break;
+                }
+            }
+            MaxTreeDelete(mt);
+        }
+        MaxTreeDelete(mt_multi);
+    }
+    if (st==0) {
+        printf("%d separate builds %9.3f ms\n", NUMATTR, separate/repeats);
+        printf("one combined build %9.3f ms  speedup %.2f  same attributes\n", combined/repeats, separate/combined);
+    }
+    ImageGrayDelete(template);
+    ImageGrayDelete(img);
+    return (st);
+}
+
+// Computes every attribute with an array form after a single area build, and checks the values against a build
+// with the attribute's own callbacks
+int bench_attrarrays(int argc, char *argv[]) {
+    ImageGray *img, *template;
+    MaxTree *mt, *mt_attr;
+    AttribArrays *aa;
+    double *values;
+    int repeats = (argc>1) ? atoi(argv[1]) : 10;
+    double create = 0.0, t;
+    int st = 0;
+
+    img = read_bench_image(argv[0]);
+    if (img==NULL) {
+        return (-1);
+    }
+    template = GetTemplate(NULL, img);
+    mt = MaxTreeCreate(img, template, NewAreaData, AddToAreaData, MergeAreaData, DeleteAreaData);
+    values = mt ? malloc(mt->NumNodes*sizeof(double)) : NULL;
+    if (values==NULL) {
+        fprintf(stderr, "Can't create Max-tree\n");
+        if (mt) MaxTreeDelete(mt);
+        ImageGrayDelete(template);
+        ImageGrayDelete(img);
+        return (-1);
+    }
+    for (int r = 0; r < repeats; ++r) {
+        t = time_ms();
+        aa = AttribArraysCreate(mt, img, template, ATTRFAM_ALL);
+        create += time_ms() - t;
+        AttribArraysDelete(aa);
+    }
+    printf("%lu nodes, all families in %.3f ms\n", mt->NumNodes, create/repeats);
+    aa = AttribArraysCreate(mt, img, template, ATTRFAM_ALL);
+    for (int a = 0; a < NUMATTR && st==0; ++a) {
+        double kernel = 0.0, build;
+        if (AttribArraysFamiliesOf(Attribs[a].Attribute)<0) {
+            continue;
+        }
+        for (int r = 0; r < repeats; ++r) {
+            t = time_ms();
+            AttribArraysCompute(aa, Attribs[a].Attribute, values);
+            kernel += time_ms() - t;
+        }
+        t = time_ms();
+        mt_attr = MaxTreeCreate(img, template, Attribs[a].NewAuxData, Attribs[a].AddToAuxData,
+                                Attribs[a].MergeAuxData, Attribs[a].DeleteAuxData);
+        build = time_ms() - t;
+        for (ulong i = 0; i < mt->NumNodes; ++i) {
+            double v = (*Attribs[a].Attribute)(mt_attr->Attributes[i]);
+            if (v!=values[i] && !(isnan(v) && isnan(values[i]))) {
+                fprintf(stderr, "'%s' differs at node %lu: %g vs %g\n", Attribs[a].Name, i, v, values[i]);
+                st = -1;
+                break;
+            }
+        }
+        MaxTreeDelete(mt_attr);
+        printf("%-55s kernel %8.3f ms  rebuild %8.3f ms\n", Attribs[a].Name, kernel/repeats, build);
+    }
+    AttribArraysDelete(aa);
+    free(values);
+    MaxTreeDelete(mt);
+    ImageGrayDelete(template);
+    ImageGrayDelete(img);
+    return (st);
+}
+
+// Times the flooding and the four filters with the loops specialized for the attribute and with the generic ones
+// that call the attribute through a pointer, and checks that both give the same output
+int bench_specialized(int argc, char *argv[]) {
+    ImageGray *img, *template, *out[2];
+    MaxTree *mt;
+    int attrib = (argc>1) ? atoi(argv[1]) : 0;
+    double lambda = (argc>2) ? atof(argv[2]) : 100.0;
+    int repeats = (argc>3) ? atoi(argv[3]) : 10;
+    int st = 0;
+
+    img = read_bench_image(argv[0]);
+    if (img==NULL) {
+        return (-1);
+    }
+    template = GetTemplate(NULL, img);
+    out[0] = ImageGrayCreate(img->Width, img->Height);
+    out[1] = ImageGrayCreate(img->Width, img->Height);
+    printf("Attribute: %s, lambda %g, %d runs\n", Attribs[attrib].Name, lambda, repeats);
+    for (int special = 0; special < 2 && st==0; ++special) {
+        double build = 0.0, filter[NUMDECISIONS] = {0.0}, t;
+        MaxTreeUseSpecialized = special;
+        for (int r = 0; r < repeats; ++r) {
+            t = time_ms();
+            mt = MaxTreeCreate(img, template, Attribs[attrib].NewAuxData, Attribs[attrib].AddToAuxData,
+                               Attribs[attrib].MergeAuxData, Attribs[attrib].DeleteAuxData);
+            build += time_ms() - t;
+            if (mt==NULL) {
+                fprintf(stderr, "Can't create Max-tree\n");
+                st = -1;
+                break;
+            }
+            for (int d = 0; d < NUMDECISIONS; ++d) {
+                t = time_ms();
+                Decisions[d].Filter(mt, img, template, out[special], Attribs[attrib].Attribute, lambda);
+                filter[d] += time_ms() - t;
+            }
+            MaxTreeDelete(mt);
+        }
+        printf("%-11s build %9.3f ms  filters", special ? "specialized" : "generic", build/repeats);
+        for (int d = 0; d < NUMDECISIONS; ++d) {
+            printf(" %s %7.3f", Decisions[d].Name, filter[d]/repeats);
+        }
+        printf(" ms\n");
+    }
+    MaxTreeUseSpecialized = true;
+    if (st==0 && memcmp(out[0]->Pixmap, out[1]->Pixmap, img->Width*img->Height)!=0) {
+        fprintf(stderr, "Specialized and generic output differ\n");
+        st = -1;
+    }
+    ImageGrayDelete(out[0]);
+    ImageGrayDelete(out[1]);
+    ImageGrayDelete(template);
+    ImageGrayDelete(img);
+    return (st);
+}
+
+// Times the disparity of a stereo pair with the node matching of calc_disp and the pixel scan of calc_disp_scan,
+// and the node matching limited to disparities up to d_max if one is given
+int bench_disparity(int argc, char *argv[]) {
+    ImageGray *img_l, *img_r, *template, *out_node, *out_scan, *out_bound;
+    MaxTree *mt_l, *mt_r;
+    int attrib = (argc>2) ? atoi(argv[2]) : 12;
+    int repeats = (argc>3) ? atoi(argv[3]) : 3;
+    ulong d_max = (argc>4) ? strtoul(argv[4], NULL, 10) : 0;
+    double node = 0.0, scan = 0.0, bound = 0.0, t;
+
+    img_l = read_bench_image(argv[0]);
+    img_r = (argc>1) ? read_bench_image(argv[1]) : NULL;
+    if (img_l==NULL || img_r==NULL || img_l->Width!=img_r->Width || img_l->Height!=img_r->Height) {
+        if (img_l) ImageGrayDelete(img_l);
+        if (img_r) ImageGrayDelete(img_r);
+        return (-1);
+    }
+    template = GetTemplate(NULL, img_l);
+    out_node = ImageGrayCreate(img_l->Width, img_l->Height);
+    out_scan = ImageGrayCreate(img_l->Width, img_l->Height);
+    out_bound = ImageGrayCreate(img_l->Width, img_l->Height);
+    MultiAttribSelect(Attribs, (1UL << attrib) | (1UL << 13));
+    double (*multi_attribute)(void *) = MultiAttribFor(&Attribs[attrib]);
+    mt_l = MaxTreeCreate(img_l, template, NewMultiData, AddToMultiData, MergeMultiData, DeleteMultiData);
+    mt_r = MaxTreeCreate(img_r, template, NewMultiData, AddToMultiData, MergeMultiData, DeleteMultiData);
+    if (mt_l==NULL || mt_r==NULL) {
+        fprintf(stderr, "Can't create Max-trees\n");
+    }
+    for (int r = 0; mt_l && mt_r && r < repeats; ++r) {
+        t = time_ms();
+        calc_disp(mt_l, mt_r, img_l, img_r, out_node, multi_attribute, MultiMeanXAttribute, 0, img_l->Width);
+        node += time_ms() - t;
+        if (d_max > 0) {
+            t = time_ms();
+            calc_disp(mt_l, mt_r, img_l, img_r, out_bound, multi_attribute, MultiMeanXAttribute, 0, d_max);
+            bound += time_ms() - t;
+        }
+        t = time_ms();
+        calc_disp_scan(mt_l, mt_r, img_l, img_r, out_scan, multi_attribute, MultiMeanXAttribute);
+        scan += time_ms() - t;
+    }
+    if (mt_l && mt_r) {
+        ulong imgsize = img_l->Width*img_l->Height, num_diff = 0;
+        for (ulong p = 0; p < imgsize; ++p) {
+            num_diff += (out_node->Pixmap[p]!=out_scan->Pixmap[p]);
+        }
+        printf("Attribute: %s, %lu + %lu nodes\n", Attribs[attrib].Name, mt_l->NumNodes, mt_r->NumNodes);
+        printf("pixel scan %10.3f ms\nnode match %10.3f ms  speedup %.1f  %.2f%% of the pixels differ\n",
+               scan/repeats, node/repeats, scan/node, 100.0*num_diff/imgsize);
+        if (d_max > 0) {
+            num_diff = 0;
+            for (ulong p = 0; p < imgsize; ++p) {
+                num_diff += (out_node->Pixmap[p]!=out_bound->Pixmap[p]);
+            }
+            printf("d_max %-4lu %10.3f ms  speedup %.1f  %.2f%% of the pixels differ from the full range\n",
+                   d_max, bound/repeats, node/bound, 100.0*num_diff/imgsize);
+        }
+    }
+    if (mt_l) MaxTreeDelete(mt_l);
+    if (mt_r) MaxTreeDelete(mt_r);
+    ImageGrayDelete(out_bound);
+    ImageGrayDelete(out_scan);
+    ImageGrayDelete(out_node);
+    ImageGrayDelete(template);
+    ImageGrayDelete(img_r);
+    ImageGrayDelete(img_l);
+    return (0);
+}
+
+// Times the disparity of a stereo pair with the rows split over 1 to 16 threads and checks that the output does not
+// depend on the number of threads
+int bench_dispthreads(int argc, char *argv[]) {
+    int thread_counts[] = {1, 2, 4, 8, 16};
+    ImageGray *img_l, *img_r, *template, *out, *out_ref;
+    MaxTree *mt_l, *mt_r;
+    int attrib = (argc>2) ? atoi(argv[2]) : 12;
+    int repeats = (argc>3) ? atoi(argv[3]) : 5;
+    double single = 0.0;
+    int st = 0;
+
+    img_l = read_bench_image(argv[0]);
+    img_r = (argc>1) ? read_bench_image(argv[1]) : NULL;
+    if (img_l==NULL || img_r==NULL || img_l->Width!=img_r->Width || img_l->Height!=img_r->Height) {
+        if (img_l) ImageGrayDelete(img_l);
+        if (img_r) ImageGrayDelete(img_r);
+        return (-1);
+    }
+    template = GetTemplate(NULL, img_l);
+    out = ImageGrayCreate(img_l->Width, img_l->Height);
+    out_ref = ImageGrayCreate(img_l->Width, img_l->Height);
+    printf("Attribute: %s, %d runs, %ld processors online\n", Attribs[attrib].Name, repeats,
+           sysconf(_SC_NPROCESSORS_ONLN));
+    MultiAttribSelect(Attribs, (1UL << attrib) | (1UL << 13));
+    double (*multi_attribute)(void *) = MultiAttribFor(&Attribs[attrib]);
+    mt_l = MaxTreeCreate(img_l, template, NewMultiData, AddToMultiData, MergeMultiData, DeleteMultiData);
+    mt_r = MaxTreeCreate(img_r, template, NewMultiData, AddToMultiData, MergeMultiData, DeleteMultiData);
+    if (mt_l==NULL || mt_r==NULL) {
+        fprintf(stderr, "Can't create Max-trees\n");
+        st = -1;
+    }
+    else {
+        MaxTreeBuildRuns(mt_l, img_l);
+        MaxTreeBuildRuns(mt_r, img_r);
+    }
+    for (ulong i = 0; st==0 && i < sizeof(thread_counts)/sizeof(thread_counts[0]); ++i) {
+        double disp = 0.0, t;
+        DispNumThreads = thread_counts[i];
+        for (int r = 0; r < repeats; ++r) {
+            t = time_ms();
+            calc_disp(mt_l, mt_r, img_l, img_r, i ? out : out_ref, multi_attribute, MultiMeanXAttribute, 0,
+                      img_l->Width);
+            disp += time_ms() - t;
+        }
+        disp /= repeats;
+        if (i==0) {
+            single = disp;
+        }
+        bool same = (i==0) || memcmp(out->Pixmap, out_ref->Pixmap, img_l->Width*img_l->Height)==0;
+        printf("%2d threads  disparity %9.3f ms  speedup %5.2f  %s\n", thread_counts[i], disp, single/disp,
+               same ? "same as 1 thread" : "DIFFERS from 1 thread");
+    }
+    DispNumThreads = 0;
+    if (mt_l) MaxTreeDelete(mt_l);
+    if (mt_r) MaxTreeDelete(mt_r);
+    ImageGrayDelete(out_ref);
+    ImageGrayDelete(out);
+    ImageGrayDelete(template);
+    ImageGrayDelete(img_r);
+    ImageGrayDelete(img_l);
+    return (st);
+}
+
+// Times, for every attribute, filling the node caches of a stereo pair, matching from the filled caches, and
+// calc_disp, which fills its own caches on every call
+int bench_nodecache(int argc, char *argv[]) {
+    ImageGray *img_l, *img_r, *template, *out;
+    MaxTree *mt_l, *mt_r;
+    DispNodeCache *cache_l = NULL, *cache_r = NULL;
+    int repeats = (argc>2) ? atoi(argv[2]) : 5;
+    int st = 0;
+
+    img_l = read_bench_image(argv[0]);
+    img_r = (argc>1) ? read_bench_image(argv[1]) : NULL;
+    if (img_l==NULL || img_r==NULL || img_l->Width!=img_r->Width || img_l->Height!=img_r->Height) {
+        if (img_l) ImageGrayDelete(img_l);
+        if (img_r) ImageGrayDelete(img_r);
+        return (-1);
+    }
+    template = GetTemplate(NULL, img_l);
+    out = ImageGrayCreate(img_l->Width, img_l->Height);
+    MultiAttribSelect(Attribs, (1UL << NUMATTR) - 1);
+    mt_l = MaxTreeCreate(img_l, template, NewMultiData, AddToMultiData, MergeMultiData, DeleteMultiData);
+    mt_r = MaxTreeCreate(img_r, template, NewMultiData, AddToMultiData, MergeMultiData, DeleteMultiData);
+    if (mt_l==NULL || mt_r==NULL) {
+        fprintf(stderr, "Can't create Max-trees\n");
+        st = -1;
+    }
+    else {
+        MaxTreeBuildRuns(mt_l, img_l);
+        MaxTreeBuildRuns(mt_r, img_r);
+        cache_l = DispNodeCacheCreate(mt_l, MultiMeanXAttribute);
+        cache_r = DispNodeCacheCreate(mt_r, MultiMeanXAttribute);
+        if (cache_l==NULL || cache_r==NULL) {
+            st = -1;
+        }
+    }
+    if (st==0) {
+        printf("%lu + %lu nodes, %d runs\n", mt_l->NumNodes, mt_r->NumNodes, repeats);
+    }
+    for (int a = 0; st==0 && a < NUMATTR; ++a) {
+        double fill = 0.0, match = 0.0, call = 0.0, t;
+        double (*multi_attribute)(void *) = MultiAttribFor(&Attribs[a]);
+        for (int r = 0; r < repeats; ++r) {
+            t = time_ms();
+            DispNodeCacheSetAttribute(cache_l, mt_l, multi_attribute);
+            DispNodeCacheSetAttribute(cache_r, mt_r, multi_attribute);
+            fill += time_ms() - t;
+            t = time_ms();
+            calc_disp_cached(mt_l, mt_r, img_l, img_r, out, cache_l, cache_r, 0, img_l->Width);
+            match += time_ms() - t;
+            t = time_ms();
+            calc_disp(mt_l, mt_r, img_l, img_r, out, multi_attribute, MultiMeanXAttribute, 0, img_l->Width);
+            call += time_ms() - t;
+        }
+        printf("%2d values %8.3f ms  match %8.3f ms  calc_disp %8.3f ms  %s\n", a, fill/repeats, match/repeats,
+               call/repeats, Attribs[a].Name);
+    }
+    if (cache_l) DispNodeCacheDelete(cache_l);
+    if (cache_r) DispNodeCacheDelete(cache_r);
+    if (mt_l) MaxTreeDelete(mt_l);
+    if (mt_r) MaxTreeDelete(mt_r);
+    ImageGrayDelete(out);
+    ImageGrayDelete(template);
+    ImageGrayDelete(img_r);
+    ImageGrayDelete(img_l);
+    return (st);
+}
+
+// Times coarse to fine matching of a stereo pair for several pass counts and windows, and reports the mean absolute
+// error and the share of pixels off by more than one against a ground truth image holding scale times the
+// disparity (16 for Tsukuba, 8 for Venus). Pixels where the ground truth is 0 are not counted.
+int bench_coarsefine(int argc, char *argv[]) {
+    int pass_counts[] = {1, 2, 4, 8};
+    ulong windows[] = {2, 4, 8, 16};
+    ImageGray *img_l, *img_r, *gt, *template, *out;
+    MaxTree *mt_l, *mt_r;
+    double scale = (argc>3) ? atof(argv[3]) : 16.0;
+    int attrib = (argc>4) ? atoi(argv[4]) : 12;
+    int repeats = (argc>6) ? atoi(argv[6]) : 3;
+    int st = 0;
+
+    img_l = read_bench_image(argv[0]);
+    img_r = (argc>1) ? read_bench_image(argv[1]) : NULL;
+    gt = (argc>2) ? read_bench_image(argv[2]) : NULL;
+    if (img_l==NULL || img_r==NULL || gt==NULL || img_l->Width!=img_r->Width || img_l->Height!=img_r->Height ||
+        gt->Width!=img_l->Width || gt->Height!=img_l->Height) {
+        if (img_l) ImageGrayDelete(img_l);
+        if (img_r) ImageGrayDelete(img_r);
+        if (gt) ImageGrayDelete(gt);
+        return (-1);
+    }
+    ulong d_max = (argc>5) ? strtoul(argv[5], NULL, 10) : 0;
+    if (d_max==0) {
+        d_max = img_l->Width;
+    }
+    template = GetTemplate(NULL, img_l);
+    out = ImageGrayCreate(img_l->Width, img_l->Height);
+    MultiAttribSelect(Attribs, (1UL << attrib) | (1UL << 13));
+    double (*multi_attribute)(void *) = MultiAttribFor(&Attribs[attrib]);
+    mt_l = MaxTreeCreate(img_l, template, NewMultiData, AddToMultiData, MergeMultiData, DeleteMultiData);
+    mt_r = MaxTreeCreate(img_r, template, NewMultiData, AddToMultiData, MergeMultiData, DeleteMultiData);
+    if (mt_l==NULL || mt_r==NULL) {
+        fprintf(stderr, "Can't create Max-trees\n");
+        st = -1;
+    }
+    else {
+        MaxTreeBuildRuns(mt_l, img_l);
+        MaxTreeBuildRuns(mt_r, img_r);
+        printf("Attribute: %s, d_max %lu, %d runs\n", Attribs[attrib].Name, d_max, repeats);
+    }
+    for (ulong i = 0; st==0 && i < sizeof(pass_counts)/sizeof(pass_counts[0]); ++i) {
+        for (ulong w = 0; w < sizeof(windows)/sizeof(windows[0]); ++w) {
+            double disp = 0.0, err = 0.0, t;
+            ulong num = 0, num_bad = 0;
+            if (pass_counts[i]==1 && w > 0) {
+                break;
+            }
+            DispCoarseFinePasses = pass_counts[i];
+            DispCoarseFineWindow = windows[w];
+            for (int r = 0; r < repeats; ++r) {
+                t = time_ms();
+                calc_disp(mt_l, mt_r, img_l, img_r, out, multi_attribute, MultiMeanXAttribute, 0, d_max);
+                disp += time_ms() - t;
+            }
+            for (ulong p = 0; p < img_l->Width*img_l->Height; ++p) {
+                if (gt->Pixmap[p]) {
+                    double e = fabs(out->Pixmap[p] - gt->Pixmap[p]/scale);
+                    err += e;
+                    num_bad += (e > 1.0);
+                    ++num;
+                }
+            }
+            if (pass_counts[i]==1) {
+                printf("%d pass            disparity %9.3f ms  mean error %6.2f  bad %5.1f%%\n", pass_counts[i],
+                       disp/repeats, num ? err/num : 0.0, num ? 100.0*num_bad/num : 0.0);
+            }
+            else {
+                printf("%d passes window %2lu disparity %9.3f ms  mean error %6.2f  bad %5.1f%%\n", pass_counts[i],
+                       windows[w], disp/repeats, num ? err/num : 0.0, num ? 100.0*num_bad/num : 0.0);
+            }
+        }
+    }
+    DispCoarseFinePasses = 1;
+    DispCoarseFineWindow = 4;
+    if (mt_l) MaxTreeDelete(mt_l);
+    if (mt_r) MaxTreeDelete(mt_r);
+    ImageGrayDelete(out);
+    ImageGrayDelete(template);
+    ImageGrayDelete(gt);
+    ImageGrayDelete(img_r);
+    ImageGrayDelete(img_l);
+    return (st);
+}
+
+// Mirrors img left to right
+ImageGray *mirror_image(const ImageGray *img) {
+    ImageGray *out = ImageGrayCreate(img->Width, img->Height);
+    for (ulong r = 0; out && r < img->Height; ++r) {
+        for (ulong x = 0; x < img->Width; ++x) {
+            out->Pixmap[r*img->Width + x] = img->Pixmap[r*img->Width + img->Width-1-x];
+        }
+    }
+    return (out);
+}
+
+// Times the left disparity alone, both disparities from the same trees and the left-right check, against a second
+// pipeline for the right disparity on the mirrored pair (trees, caches and matching), and checks that both right
+// disparities agree: they may only differ where rounding of the mirrored attribute values and centroids changes a
+// match, on at most LRCHECK_MAX_MISMATCH of the pixels by more than one. With a ground truth image holding scale
+// times the disparity it reports the error of the left disparity before and after the check, over the pixels the
+// check keeps.
+#define LRCHECK_MAX_MISMATCH 0.05
+int bench_lrcheck(int argc, char *argv[]) {
+    ImageGray *img_l, *img_r, *gt = NULL, *template, *out_l, *out_r, *out_m = NULL, *checked_l, *mirror_l = NULL,
+              *mirror_r = NULL;
+    MaxTree *mt_l, *mt_r;
+    DispNodeCache *cache_l = NULL, *cache_r = NULL;
+    double scale = (argc>3) ? atof(argv[3]) : 16.0;
+    int attrib = (argc>4) ? atoi(argv[4]) : 12;
+    int repeats = (argc>5) ? atoi(argv[5]) : 3;
+    ulong d_max = (argc>6) ? strtoul(argv[6], NULL, 10) : 0;
+    ulong max_diff = 1;
+    long num_invalid = 0;
+    int st = 0;
+
+    img_l = read_bench_image(argv[0]);
+    img_r = (argc>1) ? read_bench_image(argv[1]) : NULL;
+    if (img_l==NULL || img_r==NULL || img_l->Width!=img_r->Width || img_l->Height!=img_r->Height) {
+        if (img_l) ImageGrayDelete(img_l);
+        if (img_r) ImageGrayDelete(img_r);
+        return (-1);
+    }
+    if (argc>2 && strcmp(argv[2], "-")!=0) {
+        gt = read_bench_image(argv[2]);
+        if (gt && (gt->Width!=img_l->Width || gt->Height!=img_l->Height)) {
+            ImageGrayDelete(gt);
+            gt = NULL;
+        }
+    }
+    if (d_max==0) {
+        d_max = img_l->Width;
+    }
+    template = GetTemplate(NULL, img_l);
+    out_l = ImageGrayCreate(img_l->Width, img_l->Height);
+    out_r = ImageGrayCreate(img_l->Width, img_l->Height);
+    out_m = ImageGrayCreate(img_l->Width, img_l->Height);
+    checked_l = ImageGrayCreate(img_l->Width, img_l->Height);
+    MultiAttribSelect(Attribs, (1UL << attrib) | (1UL << 13));
+    double (*multi_attribute)(void *) = MultiAttribFor(&Attribs[attrib]);
+    mt_l = MaxTreeCreate(img_l, template, NewMultiData, AddToMultiData, MergeMultiData, DeleteMultiData);
+    mt_r = MaxTreeCreate(img_r, template, NewMultiData, AddToMultiData, MergeMultiData, DeleteMultiData);
+    if (mt_l==NULL || mt_r==NULL) {
+        fprintf(stderr, "Can't create Max-trees\n");
+        st = -1;
+    }
+    else {
+        MaxTreeBuildRuns(mt_l, img_l);
+        MaxTreeBuildRuns(mt_r, img_r);
+        cache_l = DispNodeCacheCreate(mt_l, MultiMeanXAttribute);
+        cache_r = DispNodeCacheCreate(mt_r, MultiMeanXAttribute);
+        mirror_l = mirror_image(img_r);
+        mirror_r = mirror_image(img_l);
+        if (cache_l==NULL || cache_r==NULL || DispNodeCacheSetAttribute(cache_l, mt_l, multi_attribute)!=0 ||
+            DispNodeCacheSetAttribute(cache_r, mt_r, multi_attribute)!=0 || mirror_l==NULL || mirror_r==NULL ||
+            out_m==NULL) {
+            st = -1;
+        }
+    }
+    double left = 0.0, both = 0.0, check = 0.0, second = 0.0, t;
+    for (int r = 0; st==0 && r < repeats; ++r) {
+        t = time_ms();
+        calc_disp_cached(mt_l, mt_r, img_l, img_r, out_l, cache_l, cache_r, 0, d_max);
+        left += time_ms() - t;
+        t = time_ms();
+        st = calc_disp_lr_cached(mt_l, mt_r, img_l, img_r, checked_l, out_r, cache_l, cache_r, 0, d_max);
+        both += time_ms() - t;
+        t = time_ms();
+        num_invalid = disp_lr_check(checked_l, out_r, max_diff);
+        check += time_ms() - t;
+        // The right disparity as a second pipeline would get it
+        t = time_ms();
+        MaxTree *mt_ml = MaxTreeCreate(mirror_l, template, NewMultiData, AddToMultiData, MergeMultiData,
+                                       DeleteMultiData);
+        MaxTree *mt_mr = MaxTreeCreate(mirror_r, template, NewMultiData, AddToMultiData, MergeMultiData,
+                                       DeleteMultiData);
+        if (mt_ml && mt_mr) {
+            calc_disp(mt_ml, mt_mr, mirror_l, mirror_r, out_m, multi_attribute, MultiMeanXAttribute, 0, d_max);
+        }
+        second += time_ms() - t;
+        if (mt_ml) MaxTreeDelete(mt_ml);
+        if (mt_mr) MaxTreeDelete(mt_mr);
+    }
+    if (st==0) {
+        printf("Attribute: %s, %d runs\n", Attribs[attrib].Name, repeats);
+        printf("left disparity      %9.3f ms\n", left/repeats);
+        printf("left and right      %9.3f ms  %.2fx the left alone\n", both/repeats, both/left);
+        printf("left-right check    %9.3f ms  %.1f%% of the left pixels set to 0\n", check/repeats,
+               100.0*num_invalid/(img_l->Width*img_l->Height));
+        printf("mirrored pipeline   %9.3f ms  for the right disparity alone\n", second/repeats);
+        // Both right disparities are taken before the check sets pixels to 0
+        ulong width = img_l->Width, num_pixels = width*img_l->Height, num_diff = 0, num_far = 0;
+        calc_disp_lr_cached(mt_l, mt_r, img_l, img_r, checked_l, out_r, cache_l, cache_r, 0, d_max);
+        for (ulong p = 0; p < num_pixels; ++p) {
+            int d = abs(out_r->Pixmap[p] - out_m->Pixmap[p - p%width + width-1 - p%width]);
+            num_diff += (d!=0);
+            num_far += (d > 1);
+        }
+        bool same = num_far <= LRCHECK_MAX_MISMATCH*num_pixels;
+        printf("right disparity     %.2f%% of the pixels differ from the mirrored pipeline, %.2f%% by more than 1"
+               "  %s\n", 100.0*num_diff/num_pixels, 100.0*num_far/num_pixels, same ? "ok" : "DIFFERS");
+        if (!same) {
+            st = -1;
+        }
+        num_invalid = disp_lr_check(checked_l, out_r, max_diff);
+    }
+    if (st==0 && gt) {
+        double err_all = 0.0, err_kept = 0.0;
+        ulong num_all = 0, num_kept = 0, bad_all = 0, bad_kept = 0;
+        for (ulong p = 0; p < img_l->Width*img_l->Height; ++p) {
+            if (gt->Pixmap[p]==0) {
+                continue;
+            }
+            double e = fabs(out_l->Pixmap[p] - gt->Pixmap[p]/scale);
+            err_all += e;
+            bad_all += (e > 1.0);
+            ++num_all;
+            if (checked_l->Pixmap[p]!=0) {
+                err_kept += e;
+                bad_kept += (e > 1.0);
+                ++num_kept;
+            }
+        }
+        printf("unchecked  mean error %6.2f  bad %5.1f%%  of %lu pixels\n", num_all ? err_all/num_all : 0.0,
+               num_all ? 100.0*bad_all/num_all : 0.0, num_all);
+        printf("kept       mean error %6.2f  bad %5.1f%%  of %lu pixels\n", num_kept ? err_kept/num_kept : 0.0,
+               num_kept ? 100.0*bad_kept/num_kept : 0.0, num_kept);
+    }
+    if (cache_l) DispNodeCacheDelete(cache_l);
+    if (cache_r) DispNodeCacheDelete(cache_r);
+    if (mt_l) MaxTreeDelete(mt_l);
+    if (mt_r) MaxTreeDelete(mt_r);
+    if (mirror_l) ImageGrayDelete(mirror_l);
+    if (mirror_r) ImageGrayDelete(mirror_r);
+    if (gt) ImageGrayDelete(gt);
+    if (out_m) ImageGrayDelete(out_m);
+    ImageGrayDelete(checked_l);
+    ImageGrayDelete(out_r);
+    ImageGrayDelete(out_l);
+    ImageGrayDelete(template);
+    ImageGrayDelete(img_r);
+    ImageGrayDelete(img_l);
+    return (st);
+}
+
+// Times reading the two images of a pair and building their trees one after the other and with read_image_pair and
+// create_tree_pair, which do the right image on a second thread
+int bench_pair(int argc, char *argv[]) {
+    ImageGray *img_l, *img_r, *template;
+    MaxTree *mt_l, *mt_r;
+    int attrib = (argc>2) ? atoi(argv[2]) : 12;
+    int repeats = (argc>3) ? atoi(argv[3]) : 5;
+    double read_serial = 0.0, read_pair = 0.0, build_serial = 0.0, build_pair = 0.0, t;
+    int st = 0;
+
+    if (argc<2) {
+        return (-1);
+    }
+    for (int r = 0; st==0 && r < repeats; ++r) {
+        t = time_ms();
+        img_l = ImagePGMRead(argv[0]);
+        img_r = ImagePGMRead(argv[1]);
+        read_serial += time_ms() - t;
+        if (img_l) ImageGrayDelete(img_l);
+        if (img_r) ImageGrayDelete(img_r);
+        t = time_ms();
+        st = read_image_pair(argv[0], argv[1], &img_l, &img_r);
+        read_pair += time_ms() - t;
+        if (st==0 && r < repeats-1) {
+            ImageGrayDelete(img_l);
+            ImageGrayDelete(img_r);
+        }
+    }
+    if (st!=0) {
+        return (-1);
+    }
+    template = GetTemplate(NULL, img_l);
+    for (int r = 0; st==0 && r < repeats; ++r) {
+        t = time_ms();
+        mt_l = Builders[0].Create(img_l, template, Attribs[attrib].NewAuxData, Attribs[attrib].AddToAuxData,
+                                  Attribs[attrib].MergeAuxData, Attribs[attrib].DeleteAuxData);
+        mt_r = Builders[0].Create(img_r, template, Attribs[attrib].NewAuxData, Attribs[attrib].AddToAuxData,
+                                  Attribs[attrib].MergeAuxData, Attribs[attrib].DeleteAuxData);
+        build_serial += time_ms() - t;
+        if (mt_l) MaxTreeDelete(mt_l);
+        if (mt_r) MaxTreeDelete(mt_r);
+        t = time_ms();
+        st = create_tree_pair(img_l, img_r, template, template, 0, &Attribs[attrib], &mt_l, &mt_r);
+        build_pair += time_ms() - t;
+        if (st==0) {
+            MaxTreeDelete(mt_l);
+            MaxTreeDelete(mt_r);
+        }
+    }
+    if (st==0) {
+        printf("Attribute: %s, %d runs, %ld processors online\n", Attribs[attrib].Name, repeats,
+               sysconf(_SC_NPROCESSORS_ONLN));
+        printf("read   serial %9.3f ms  pair %9.3f ms  speedup %.2f\n", read_serial/repeats, read_pair/repeats,
+               read_serial/read_pair);
+        printf("build  serial %9.3f ms  pair %9.3f ms  speedup %.2f\n", build_serial/repeats, build_pair/repeats,
+               build_serial/build_pair);
+    }
+    ImageGrayDelete(template);
+    ImageGrayDelete(img_l);
+    ImageGrayDelete(img_r);
+    return (st);
+}
+
+// Times the matching with the nodes below several areas pruned and reports the nodes kept, and with a ground truth
+// image holding scale times the disparity the mean absolute error and share of pixels off by more than one
+int bench_prune(int argc, char *argv[]) {
+    ulong areas[] = {0, 2, 4, 8, 16, 32, 64, 128};
+    ImageGray *img_l, *img_r, *gt = NULL, *template, *out;
+    MaxTree *mt_l, *mt_r;
+    DispNodeCache *cache_l = NULL, *cache_r = NULL;
+    double scale = (argc>3) ? atof(argv[3]) : 16.0;
+    int attrib = (argc>4) ? atoi(argv[4]) : 12;
+    int repeats = (argc>5) ? atoi(argv[5]) : 3;
+    int st = 0;
+
+    img_l = read_bench_image(argv[0]);
+    img_r = (argc>1) ? read_bench_image(argv[1]) : NULL;
+    if (img_l==NULL || img_r==NULL || img_l->Width!=img_r->Width || img_l->Height!=img_r->Height) {
+        if (img_l) ImageGrayDelete(img_l);
+        if (img_r) ImageGrayDelete(img_r);
+        return (-1);
+    }
+    if (argc>2 && strcmp(argv[2], "-")!=0) {
+        gt = read_bench_image(argv[2]);
+        if (gt && (gt->Width!=img_l->Width || gt->Height!=img_l->Height)) {
+            ImageGrayDelete(gt);
+            gt = NULL;
+        }
+    }
+    template = GetTemplate(NULL, img_l);
+    out = ImageGrayCreate(img_l->Width, img_l->Height);
+    MultiAttribSelect(Attribs, (1UL << attrib) | (1UL << 13));
+    double (*multi_attribute)(void *) = MultiAttribFor(&Attribs[attrib]);
+    mt_l = MaxTreeCreate(img_l, template, NewMultiData, AddToMultiData, MergeMultiData, DeleteMultiData);
+    mt_r = MaxTreeCreate(img_r, template, NewMultiData, AddToMultiData, MergeMultiData, DeleteMultiData);
+    if (mt_l==NULL || mt_r==NULL) {
+        fprintf(stderr, "Can't create Max-trees\n");
+        st = -1;
+    }
+    else {
+        MaxTreeBuildRuns(mt_l, img_l);
+        MaxTreeBuildRuns(mt_r, img_r);
+        cache_l = DispNodeCacheCreate(mt_l, MultiMeanXAttribute);
+        cache_r = DispNodeCacheCreate(mt_r, MultiMeanXAttribute);
+        if (cache_l==NULL || cache_r==NULL || DispNodeCacheSetAttribute(cache_l, mt_l, multi_attribute)!=0 ||
+            DispNodeCacheSetAttribute(cache_r, mt_r, multi_attribute)!=0) {
+            st = -1;
+        }
+        else {
+            printf("Attribute: %s, %d runs\n", Attribs[attrib].Name, repeats);
+        }
+    }
+    for (ulong a = 0; st==0 && a < sizeof(areas)/sizeof(areas[0]); ++a) {
+        ulong num_kept = 0;
+        double disp = 0.0, t;
+        for (ulong n = 0; n < mt_l->NumNodes; ++n) {
+            num_kept += (n==0 || mt_l->Nodes[n].Area >= areas[a]);
+        }
+        for (ulong n = 0; n < mt_r->NumNodes; ++n) {
+            num_kept += (n==0 || mt_r->Nodes[n].Area >= areas[a]);
+        }
+        DispPruneArea = areas[a];
+        for (int r = 0; st==0 && r < repeats; ++r) {
+            t = time_ms();
+            st = calc_disp_cached(mt_l, mt_r, img_l, img_r, out, cache_l, cache_r, 0, img_l->Width);
+            disp += time_ms() - t;
+        }
+        printf("min area %3lu  %6lu nodes (%5.1f%%)  disparity %9.3f ms", areas[a], num_kept,
+               100.0*num_kept/(mt_l->NumNodes + mt_r->NumNodes), disp/repeats);
+        if (gt) {
+            double err = 0.0;
+            ulong num = 0, num_bad = 0;
+            for (ulong p = 0; p < img_l->Width*img_l->Height; ++p) {
+                if (gt->Pixmap[p]) {
+                    double e = fabs(out->Pixmap[p] - gt->Pixmap[p]/scale);
+                    err += e;
+                    num_bad += (e > 1.0);
+                    ++num;
+                }
+            }
+            printf("  mean error %6.2f  bad %5.1f%%", num ? err/num : 0.0, num ? 100.0*num_bad/num : 0.0);
+        }
+        printf("\n");
+    }
+    DispPruneArea = 0;
+    if (cache_l) DispNodeCacheDelete(cache_l);
+    if (cache_r) DispNodeCacheDelete(cache_r);
+    if (mt_l) MaxTreeDelete(mt_l);
+    if (mt_r) MaxTreeDelete(mt_r);
+    if (gt) ImageGrayDelete(gt);
+    ImageGrayDelete(out);
+    ImageGrayDelete(template);
+    ImageGrayDelete(img_r);
+    ImageGrayDelete(img_l);
+    return (st);
+}
+
+// Times the matching on weighted costs over several attributes against the single elongation attribute, and with a
+// ground truth image holding scale times the disparity reports the mean absolute error and the share of pixels off
+// by more than one. Costs are given as for the main program, e.g. l1:0=1,12=1,14=1,17=1.
+int bench_cost(int argc, char *argv[]) {
+    char *default_specs[] = {"l1:12=1", "l1:0=1,12=1,14=1,17=1", "l2:0=1,12=1,14=1,17=1", "l1:12=1,14=1"};
+    char **specs = default_specs;
+    int num_specs = sizeof(default_specs)/sizeof(default_specs[0]);
+    ImageGray *img_l, *img_r, *gt, *template, *out;
+    MaxTree *mt_l, *mt_r;
+    DispNodeCache *cache_l = NULL, *cache_r = NULL;
+    double scale = (argc>3) ? atof(argv[3]) : 16.0;
+    int repeats = 3;
+    int st = 0;
+
+    if (argc>4) {
+        specs = argv + 4;
+        num_specs = argc - 4;
+    }
+    img_l = read_bench_image(argv[0]);
+    img_r = (argc>1) ? read_bench_image(argv[1]) : NULL;
+    gt = (argc>2) ? read_bench_image(argv[2]) : NULL;
+    if (img_l==NULL || img_r==NULL || gt==NULL || img_l->Width!=img_r->Width || img_l->Height!=img_r->Height ||
+        gt->Width!=img_l->Width || gt->Height!=img_l->Height) {
+        if (img_l) ImageGrayDelete(img_l);
+        if (img_r) ImageGrayDelete(img_r);
+        if (gt) ImageGrayDelete(gt);
+        return (-1);
+    }
+    template = GetTemplate(NULL, img_l);
+    out = ImageGrayCreate(img_l->Width, img_l->Height);
+    MultiAttribSelect(Attribs, (1UL << NUMATTR) - 1);
+    mt_l = MaxTreeCreate(img_l, template, NewMultiData, AddToMultiData, MergeMultiData, DeleteMultiData);
+    mt_r = MaxTreeCreate(img_r, template, NewMultiData, AddToMultiData, MergeMultiData, DeleteMultiData);
+    if (mt_l==NULL || mt_r==NULL) {
+        fprintf(stderr, "Can't create Max-trees\n");
+        st = -1;
+    }
+    else {
+        MaxTreeBuildRuns(mt_l, img_l);
+        MaxTreeBuildRuns(mt_r, img_r);
+        cache_l = DispNodeCacheCreate(mt_l, MultiMeanXAttribute);
+        cache_r = DispNodeCacheCreate(mt_r, MultiMeanXAttribute);
+        if (cache_l==NULL || cache_r==NULL) {
+            st = -1;
+        }
+    }
+    for (int i = 0; st==0 && i < num_specs; ++i) {
+        DispCost cost;
+        double disp = 0.0, err = 0.0, t;
+        ulong num = 0, num_bad = 0;
+        if (parse_disp_cost(specs[i], &cost)!=0 || disp_set_cost(cache_l, cache_r, mt_l, mt_r, &cost)!=0) {
+            st = -1;
+            break;
+        }
+        for (int r = 0; st==0 && r < repeats; ++r) {
+            t = time_ms();
+            st = calc_disp_cached(mt_l, mt_r, img_l, img_r, out, cache_l, cache_r, 0, img_l->Width);
+            disp += time_ms() - t;
+        }
+        for (ulong p = 0; p < img_l->Width*img_l->Height; ++p) {
+            if (gt->Pixmap[p]) {
+                double e = fabs(out->Pixmap[p] - gt->Pixmap[p]/scale);
+                err += e;
+                num_bad += (e > 1.0);
+                ++num;
+            }
+        }
+        printf("%-28s disparity %9.3f ms  mean error %6.2f  bad %5.1f%%\n", specs[i], disp/repeats,
+               num ? err/num : 0.0, num ? 100.0*num_bad/num : 0.0);
+    }
+    if (cache_l) DispNodeCacheDelete(cache_l);
+    if (cache_r) DispNodeCacheDelete(cache_r);
+    if (mt_l) MaxTreeDelete(mt_l);
+    if (mt_r) MaxTreeDelete(mt_r);
+    ImageGrayDelete(out);
+    ImageGrayDelete(template);
+    ImageGrayDelete(gt);
+    ImageGrayDelete(img_r);
+    ImageGrayDelete(img_l);
+    return (st);
+}
+
+// Matches a pair on one cost per node and with the costs aggregated along 1, 3 and 5 paths, and reports the time,
+// the working memory of the aggregation and the error against the ground truth of each
+int bench_sgm(int argc, char *argv[]) {
+    int paths[] = {0, 1, 3, 5};
+    int num_runs = sizeof(paths)/sizeof(paths[0]);
+    ImageGray *img_l, *img_r, *gt, *template, *out;
+    MaxTree *mt_l, *mt_r;
+    DispNodeCache *cache_l = NULL, *cache_r = NULL;
+    DispCost cost;
+    double scale = (argc>3) ? atof(argv[3]) : 16.0;
+    ulong d_max = (argc>4) ? strtoul(argv[4], NULL, 10) : 0;
+    char *spec = (argc>5) ? argv[5] : "l1:0=1,12=1,14=1,17=1";
+    int repeats = 3;
+    int st = 0;
+
+    img_l = read_bench_image(argv[0]);
+    img_r = (argc>1) ? read_bench_image(argv[1]) : NULL;
+    gt = (argc>2) ? read_bench_image(argv[2]) : NULL;
+    if (img_l==NULL || img_r==NULL || gt==NULL || img_l->Width!=img_r->Width || img_l->Height!=img_r->Height ||
+        gt->Width!=img_l->Width || gt->Height!=img_l->Height || parse_disp_cost(spec, &cost)!=0) {
+        if (img_l) ImageGrayDelete(img_l);
+        if (img_r) ImageGrayDelete(img_r);
+        if (gt) ImageGrayDelete(gt);
+        return (-1);
+    }
+    if (d_max==0) {
+        d_max = SGM_DEFAULTDISP - 1;
+    }
+    if (d_max >= img_l->Width) {
+        d_max = img_l->Width - 1;
+    }
+    if (d_max > SGM_MAXDISP) {
+        d_max = SGM_MAXDISP;
+    }
+    template = GetTemplate(NULL, img_l);
+    out = ImageGrayCreate(img_l->Width, img_l->Height);
+    MultiAttribSelect(Attribs, (1UL << NUMATTR) - 1);
+    mt_l = MaxTreeCreate(img_l, template, NewMultiData, AddToMultiData, MergeMultiData, DeleteMultiData);
+    mt_r = MaxTreeCreate(img_r, template, NewMultiData, AddToMultiData, MergeMultiData, DeleteMultiData);
+    if (mt_l==NULL || mt_r==NULL) {
+        fprintf(stderr, "Can't create Max-trees\n");
+        st = -1;
+    }
+    else {
+        MaxTreeBuildRuns(mt_l, img_l);
+        MaxTreeBuildRuns(mt_r, img_r);
+        cache_l = DispNodeCacheCreate(mt_l, MultiMeanXAttribute);
+        cache_r = DispNodeCacheCreate(mt_r, MultiMeanXAttribute);
+        if (cache_l==NULL || cache_r==NULL || disp_set_cost(cache_l, cache_r, mt_l, mt_r, &cost)!=0) {
+            st = -1;
+        }
+    }
+    printf("%s, disparities 0 to %lu\n", spec, d_max);
+    for (int i = 0; st==0 && i < num_runs; ++i) {
+        double disp = 0.0, err = 0.0, t;
+        ulong num = 0, num_bad = 0;
+        for (int r = 0; st==0 && r < repeats; ++r) {
+            t = time_ms();
+            if (paths[i]==0) {
+                st = calc_disp_cached(mt_l, mt_r, img_l, img_r, out, cache_l, cache_r, 0, d_max);
+            }
+            else {
+                DispSGMPaths = paths[i];
+                st = calc_disp_sgm(mt_l, mt_r, img_l, img_r, out, cache_l, cache_r, 0, d_max);
+            }
+            disp += time_ms() - t;
+        }
+        for (ulong p = 0; p < img_l->Width*img_l->Height; ++p) {
+            if (gt->Pixmap[p]) {
+                double e = fabs(out->Pixmap[p] - gt->Pixmap[p]/scale);
+                err += e;
+                num_bad += (e > 1.0);
+                ++num;
+            }
+        }
+        if (paths[i]==0) {
+            printf("per node        ");
+        }
+        else {
+            printf("%d path%s %7.2f MB", paths[i], (paths[i] > 1) ? "s" : " ",
+                   sgm_working_size(img_l->Width, d_max + 1, paths[i], paths[i])/1048576.0);
+        }
+        printf("  disparity %9.3f ms  mean error %6.2f  bad %5.1f%%\n", disp/repeats, num ? err/num : 0.0,
+               num ? 100.0*num_bad/num : 0.0);
+    }
+    printf("%d paths at 1920x1080 with 256 disparities: %.2f MB\n", SGM_MAXPATHS,
+           sgm_working_size(1920, 256, SGM_MAXPATHS, SGM_MAXPATHS)/1048576.0);
+    DispSGMPaths = 0;
+    if (cache_l) DispNodeCacheDelete(cache_l);
+    if (cache_r) DispNodeCacheDelete(cache_r);
+    if (mt_l) MaxTreeDelete(mt_l);
+    if (mt_r) MaxTreeDelete(mt_r);
+    ImageGrayDelete(out);
+    ImageGrayDelete(template);
+    ImageGrayDelete(gt);
+    ImageGrayDelete(img_r);
+    ImageGrayDelete(img_l);
+    return (st);
+}
+
+// Times every row match kernel the processor supports on random rows of the given length, and checks that each
+// finds the candidate of the scalar loop. Values are drawn from few levels so there are many equal differences.
+// The single precision kernels search the same rows, which are exact in floats, and are compared with the double
+// ones as well.
+int bench_rowmatch(int argc, char *argv[]) {
+    ulong length = (argc>0) ? strtoul(argv[0], NULL, 10) : 256;
+    int repeats = (argc>1) ? atoi(argv[1]) : 20000;
+    ulong num_rows = 64, size = (num_rows*length > 0) ? num_rows*length : 1;
+    int num_attribs = 4;
+    double weights[] = {1.0, 0.5, 0.25, 2.0}, value[4];
+    double *values = malloc(size*sizeof(double));
+    double *values4 = malloc(num_attribs*size*sizeof(double));
+    double *centroids = malloc(size*sizeof(double));
+    float *values_f = malloc(size*sizeof(float));
+    float *centroids_f = malloc(size*sizeof(float));
+    long *ref = malloc(repeats*sizeof(long));
+    double scalar = 0.0, time_double[NUMROWMATCH];
+    int st = 0;
+
+    if (values==NULL || values4==NULL || centroids==NULL || values_f==NULL || centroids_f==NULL || ref==NULL) {
+        free(values);
+        free(values4);
+        free(centroids);
+        free(values_f);
+        free(centroids_f);
+        free(ref);
+        return (-1);
+    }
+    srand(1);
+    for (ulong i = 0; i < num_rows*length; ++i) {
+        values[i] = (rand()%64)/8.0;
+        centroids[i] = rand()%length;
+        values_f[i] = (float) values[i];
+        centroids_f[i] = (float) centroids[i];
+    }
+    // Rows of num_attribs arrays of length values
+    for (ulong i = 0; i < num_attribs*num_rows*length; ++i) {
+        values4[i] = (rand()%1000)/64.0;
+    }
+    printf("Rows of %lu candidates, %d searches\n", length, repeats);
+    for (int k = 0; k < NUMROWMATCH; ++k) {
+        long sum = 0;
+        bool same = true;
+        double t;
+        if (!RowMatchKernels[k].Supported()) {
+            printf("%-8s not supported\n", RowMatchKernels[k].Name);
+            continue;
+        }
+        srand(2);
+        t = time_ms();
+        for (int r = 0; r < repeats; ++r) {
+            ulong row = (ulong) r%num_rows;
+            double best_diff = (r%4) ? INFINITY : 0.5;
+            long j = RowMatchKernels[k].Best(values + row*length, centroids + row*length, length, (r%61)/7.0,
+                                             (double) (r%length), 0.0, length/4.0, &best_diff);
+            if (k==0) {
+                ref[r] = j;
+            }
+            else {
+                same &= (j==ref[r]);
+            }
+            sum += j;
+        }
+        t = time_ms() - t;
+        if (k==0) {
+            scalar = t;
+        }
+        time_double[k] = t;
+        printf("%-8s %8.3f ns per candidate  speedup %5.2f  %s (checksum %ld)\n", RowMatchKernels[k].Name,
+               1e6*t/((double) repeats*length), scalar/t, same ? "same as scalar" : "DIFFERS from scalar", sum);
+        if (!same) {
+            st = -1;
+        }
+    }
+    printf("Single precision\n");
+    for (int k = 0; k < NUMROWMATCH; ++k) {
+        long sum = 0;
+        bool same = true;
+        double t;
+        if (!RowMatchKernels[k].Supported()) {
+            continue;
+        }
+        t = time_ms();
+        for (int r = 0; r < repeats; ++r) {
+            ulong row = (ulong) r%num_rows;
+            float best_diff = (r%4) ? INFINITY : 0.5f;
+            long j = RowMatchKernels[k].BestFloat(values_f + row*length, centroids_f + row*length, length,
+                                                  (float) ((r%61)/7.0), (float) (r%length), 0.0f,
+                                                  (float) (length/4.0), &best_diff);
+            if (k==0) {
+                ref[r] = j;
+            }
+            else {
+                same &= (j==ref[r]);
+            }
+            sum += j;
+        }
+        t = time_ms() - t;
+        if (k==0) {
+            scalar = t;
+        }
+        printf("%-8s %8.3f ns per candidate  speedup %5.2f  %5.2f over double  %s (checksum %ld)\n",
+               RowMatchKernels[k].Name, 1e6*t/((double) repeats*length), scalar/t, time_double[k]/t,
+               same ? "same as scalar" : "DIFFERS from scalar", sum);
+        if (!same) {
+            st = -1;
+        }
+    }
+    // The weighted costs over num_attribs attributes
+    for (int sq = 0; sq < 2; ++sq) {
+        printf("Cost over %d attributes, %s differences\n", num_attribs, sq ? "squared" : "absolute");
+        for (int k = 0; k < NUMROWMATCH; ++k) {
+            long sum = 0;
+            bool same = true;
+            double t;
+            if (!RowMatchKernels[k].Supported()) {
+                continue;
+            }
+            t = time_ms();
+            for (int r = 0; r < repeats; ++r) {
+                ulong row = (ulong) r%num_rows;
+                double best_diff = (r%4) ? INFINITY : 2.0;
+                for (int a = 0; a < num_attribs; ++a) {
+                    value[a] = ((r + 13*a)%997)/64.0;
+                }
+                long j = RowMatchKernels[k].Cost(values4 + row*num_attribs*length, length, num_attribs, weights,
+                                                 sq, centroids + row*length, length, value, (double) (r%length),
+                                                 0.0, length/4.0, &best_diff);
+                if (k==0) {
+                    ref[r] = j;
+                }
+                else {
+                    same &= (j==ref[r]);
+                }
+                sum += j;
+            }
+            t = time_ms() - t;
+            if (k==0) {
+                scalar = t;
+            }
+            printf("%-8s %8.3f ns per candidate  speedup %5.2f  %s (checksum %ld)\n", RowMatchKernels[k].Name,
+                   1e6*t/((double) repeats*length), scalar/t, same ? "same as scalar" : "DIFFERS from scalar", sum);
+            if (!same) {
+                st = -1;
+            }
+        }
+    }
+    free(values);
+    free(values4);
+    free(centroids);
+    free(values_f);
+    free(centroids_f);
+    free(ref);
+    return (st);
+}
+
+BenchStruct Benches[] = {
+        {"builders", "<image> [attrib] [runs]", bench_builders},
+        {"threads", "<image> [attrib] [runs]", bench_threads},
+        {"tiled", "<image.pgm> [attrib] [lambda] [decision] [budget MB]", bench_tiled},
+        {"highbit", "<image> [attrib] [runs]", bench_highbit},
+        {"arena", "<image> [attrib] [runs]", bench_arena},
+        {"nodemap", "<left image> <right image> [attrib] [runs]", bench_nodemap},
+        {"runs", "<left image> <right image> [attrib] [runs]", bench_runs},
+        {"multiattr", "<image> [builder] [runs]", bench_multiattr},
+        {"attrarrays", "<image> [runs]", bench_attrarrays},
+        {"specialized", "<image> [attrib] [lambda] [runs]", bench_specialized},
+        {"disparity", "<left image> <right image> [attrib] [runs] [d_max]", bench_disparity},
+        {"dispthreads", "<left image> <right image> [attrib] [runs]", bench_dispthreads},
+        {"nodecache", "<left image> <right image> [runs]", bench_nodecache},
+        {"coarsefine", "<left image> <right image> <ground truth> [scale] [attrib] [d_max] [runs]", bench_coarsefine},
+        {"sgm", "<left image> <right image> <ground truth> [scale] [d_max] [cost]", bench_sgm},
+        {"cost", "<left image> <right image> <ground truth> [scale] [cost...]", bench_cost},
+        {"prune", "<left image> <right image> [ground truth|-] [scale] [attrib] [runs]", bench_prune},
+        {"pair", "<left image> <right image> [attrib] [runs]", bench_pair},
+        {"lrcheck", "<left image> <right image> [ground truth|-] [scale] [attrib] [runs] [d_max]", bench_lrcheck},
+        {"rowmatch", "[row length] [searches]", bench_rowmatch},
+};
+#define NUMBENCHES (sizeof(Benches)/sizeof(Benches[0]))
+
+int main(int argc, char *argv[]) {
+    for (ulong i = 0; argc>2 && i < NUMBENCHES; ++i) {
+        if (strcmp(argv[1], Benches[i].Name)==0) {
+            return (Benches[i].Run(argc-2, argv+2));
+        }
+    }
+    printf("Usage: %s <benchmark> <args>\nWhere benchmark is:\n", argv[0]);
+    for (ulong i = 0; i < NUMBENCHES; ++i) {
+        printf("\t%s %s\n", Benches[i].Name, Benches[i].Args);
+    }
+    return (argc>1 ? -1 : 0);
+}
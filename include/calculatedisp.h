@@ -7,7 +7,83 @@
 
 #include "maxtree3b.h"
 
-ImageGray *create_disp_img(ImageGray *img_l, ImageGray *img_r, ImageGray *template_l, ImageGray *template_r, int attrib);
+extern DecisionStruct Decisions[NUMDECISIONS];
+extern AttribStruct Attribs[NUMATTR];
+extern BuilderStruct Builders[NUMBUILDERS];
+// Threads calc_disp splits the rows over, 0 for one per processor
+extern int DispNumThreads;
+// Coarse to fine matching: the nodes are matched in this many passes from the root down, and nodes after the first
+// pass only search DispCoarseFineWindow around the disparity of their parent. 1 matches every node over the full range.
+extern int DispCoarseFinePasses;
+extern ulong DispCoarseFineWindow;
+// Left-right check of create_disp_img(s): pixels whose disparity differs more than this from the one of the pixel
+// they point to in the right image are set to 0. -1 (the default) only computes the left disparity.
+extern long DispLRMaxDiff;
+// Nodes with a smaller area are merged into their nearest ancestor before matching, so they are never matched and
+// take its disparity. 0 (the default) matches every node.
+extern ulong DispPruneArea;
+
+// Attributes a matching cost can combine
+#define DISP_MAXATTRIBS 8
+
+// Attribute values and mean x position of every node of a tree, computed once for the matcher. The centroids are
+// kept for the life of the cache, the values are replaced by DispNodeCacheSetAttribute.
+// With more than one attribute, the cost of a match is the weighted sum of the absolute differences, or of the
+// squared differences when squared is set, over the attributes. Both caches of a match must use the same ones.
+// A single attribute is matched on its absolute difference whatever its weight.
+typedef struct DispNodeCache DispNodeCache;
+struct DispNodeCache {
+    ulong num_nodes;
+    int num_attribs;    // attributes in values
+    double weights[DISP_MAXATTRIBS];
+    bool squared;
+    double *values;     // num_attribs arrays of num_nodes values, NULL until an attribute is set
+    double *centroids;
+};
+
+// Weighted cost over attributes of Attribs. The weights are relative: every attribute is divided by its standard
+// deviation over the nodes of the left tree first, so equal weights give each the same pull.
+typedef struct DispCost DispCost;
+struct DispCost {
+    int num_attribs;
+    int attribs[DISP_MAXATTRIBS];
+    double weights[DISP_MAXATTRIBS];
+    bool squared;  // weighted L2 (squared differences) instead of L1
+};
+
+DispNodeCache *DispNodeCacheCreate(const MaxTree *mt, double (*centroid)(void *));
+int DispNodeCacheSetAttribute(DispNodeCache *cache, const MaxTree *mt, double (*attribute)(void *));
+int DispNodeCacheAddAttribute(DispNodeCache *cache, const MaxTree *mt, double (*attribute)(void *), double weight);
+void DispNodeCacheDelete(DispNodeCache *cache);
+
+int calc_disp_scan(const MaxTree *mt_l, const MaxTree *mt_r, const ImageGray *img_l, const ImageGray *img_r,
+                   ImageGray *out, double (*attribute)(void *), double (*centroid)(void *));
+int calc_disp(const MaxTree *mt_l, const MaxTree *mt_r, const ImageGray *img_l, const ImageGray *img_r, ImageGray *out,
+              double (*attribute)(void *), double (*centroid)(void *), ulong d_min, ulong d_max);
+int calc_disp_cached(const MaxTree *mt_l, const MaxTree *mt_r, const ImageGray *img_l, const ImageGray *img_r,
+                     ImageGray *out, const DispNodeCache *cache_l, const DispNodeCache *cache_r, ulong d_min,
+                     ulong d_max);
+int calc_disp_lr_cached(const MaxTree *mt_l, const MaxTree *mt_r, const ImageGray *img_l, const ImageGray *img_r,
+                        ImageGray *out, ImageGray *out_r, const DispNodeCache *cache_l, const DispNodeCache *cache_r,
+                        ulong d_min, ulong d_max);
+// Row runs of mt, attached or made for the call, and the same with the nodes below DispPruneArea merged into their
+// ancestors, which releases its input. Both are given back with release_node_runs.
+const MaxTreeRuns *get_node_runs(const MaxTree *mt, const ImageGray *img);
+const MaxTreeRuns *prune_node_runs(const MaxTree *mt, const MaxTreeRuns *runs);
+void release_node_runs(const MaxTree *mt, const MaxTreeRuns *runs);
+int read_image_pair(char *fname_l, char *fname_r, ImageGray **img_l, ImageGray **img_r);
+int create_tree_pair(ImageGray *img_l, ImageGray *img_r, ImageGray *template_l, ImageGray *template_r, int builder,
+                     AttribStruct *aux, MaxTree **mt_l, MaxTree **mt_r);
+long disp_lr_check(ImageGray *disp_l, ImageGray *disp_r, ulong max_diff);
+int parse_disp_cost(const char *spec, DispCost *cost);
+int disp_set_cost(DispNodeCache *cache_l, DispNodeCache *cache_r, const MaxTree *mt_l, const MaxTree *mt_r,
+                  const DispCost *cost);
+ImageGray *create_disp_img_cost(ImageGray *img_l, ImageGray *img_r, ImageGray *template_l, ImageGray *template_r,
+                                const DispCost *cost, int builder, ulong d_min, ulong d_max);
+ImageGray *create_disp_img(ImageGray *img_l, ImageGray *img_r, ImageGray *template_l, ImageGray *template_r, int attrib,
+                           int builder, ulong d_min, ulong d_max);
+int create_disp_imgs(ImageGray *img_l, ImageGray *img_r, ImageGray *template_l, ImageGray *template_r, ulong mask,
+                     int builder, ulong d_min, ulong d_max, ImageGray **outs);
 ImageGray *comp_ground_truth(ImageGray *disp, ImageGray *gt);
 
 #endif //COMPUTERVISIONPROJECT_CALCULATEDISP_H
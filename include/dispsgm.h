@@ -0,0 +1,39 @@
+//
+// Semi-global aggregation of the matching costs of a pair of trees.
+//
+
+#ifndef COMPUTERVISIONPROJECT_DISPSGM_H
+#define COMPUTERVISIONPROJECT_DISPSGM_H
+
+#include "calculatedisp.h"
+
+// Paths costs are aggregated along, in the order left to right, right to left, top to bottom, top left to bottom
+// right and top right to bottom left; the first DispSGMPaths of them are used. 0 (the default) leaves the disparity
+// to the per node matching of calc_disp.
+#define SGM_MAXPATHS 5
+extern int DispSGMPaths;
+// Penalties for a disparity step of one pixel and for any larger step between neighbours along a path
+extern uint DispSGMPenalty1;
+extern uint DispSGMPenalty2;
+// Matching costs are stored as uint16 units of 1/DispSGMCostScale, capped at SGM_MAXCOST
+#define SGM_MAXCOST 1023
+extern double DispSGMCostScale;
+// Disparities are written as bytes, so d_max is capped at SGM_MAXDISP. The memory grows with the range, so the main
+// program searches SGM_DEFAULTDISP disparities from d_min when no d_max is given.
+#define SGM_MAXDISP 255
+#define SGM_DEFAULTDISP 64
+
+// Disparity of every pixel in [d_min, d_max] with the smallest sum of the costs aggregated along the paths. The cost
+// of pixel (x, y) at disparity d is the cost of matching its node in the left tree to the node of (x-d, y) in the
+// right one, as weighted by the caches. The rows are streamed from the top down, so besides the caches the memory
+// used is two rows of costs and a row of aggregated costs per path, two for the paths that come from the row above,
+// each row holding width*(d_max-d_min+1) uint16. Every path has a thread of its own with more than one processor.
+// d_max is capped at SGM_MAXDISP and width-1. Nodes smaller than DispPruneArea take the cost of the ancestor they
+// are merged into, as in calc_disp.
+int calc_disp_sgm(const MaxTree *mt_l, const MaxTree *mt_r, const ImageGray *img_l, const ImageGray *img_r,
+                  ImageGray *out, const DispNodeCache *cache_l, const DispNodeCache *cache_r, ulong d_min,
+                  ulong d_max);
+// Bytes calc_disp_sgm works in for rows of ncols pixels and num_disp disparities, whatever the number of rows
+size_t sgm_working_size(ulong ncols, ulong num_disp, int num_paths, int num_threads);
+
+#endif //COMPUTERVISIONPROJECT_DISPSGM_H
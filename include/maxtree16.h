@@ -0,0 +1,85 @@
+//
+// Max-tree of high bit-depth (up to 16-bit) gray-scale images.
+//
+
+#ifndef COMPUTERVISIONPROJECT_MAXTREE16_H
+#define COMPUTERVISIONPROJECT_MAXTREE16_H
+
+#include "maxtree3b.h"
+
+typedef unsigned short ushort;
+
+typedef struct ImageGray16 ImageGray16;
+struct ImageGray16
+{
+    ulong Width;
+    ulong Height;
+    ushort *Pixmap;
+};
+
+/* Nodes are stored in order of increasing level, so every parent comes
+ * before its children and no per-level arrays are needed */
+typedef struct MaxNode16 MaxNode16;
+struct MaxNode16
+{
+    uint Parent;
+    uint Area;
+    ushort Level;
+    ushort NewLevel;  /* gray level after filtering */
+};
+
+typedef struct MaxTree16 MaxTree16;
+struct MaxTree16
+{
+    ulong *NodeOf;    /* node of every pixel, UF_Unprocessed outside the template */
+    ulong NumNodes;
+    MaxNode16 *Nodes;
+    void **Attributes;  /* attribute data of every node, indexed like Nodes */
+    AuxArena *Arena;  /* attribute data of all nodes, NULL if each has its own malloc */
+    void *(*NewAuxData)(ulong, ulong, int, ulong *, ImageGray *);
+    void (*AddToAuxData)(void *, ulong, ulong, int, ulong *, ImageGray *);
+    void (*MergeAuxData)(void *, void *);
+    void (*DeleteAuxData)(void *);
+};
+
+typedef struct Decision16Struct Decision16Struct;
+struct Decision16Struct
+{
+    char *Name;
+    void (*Filter)(MaxTree16 *, ImageGray16 *, ImageGray *, ImageGray16 *, double (*attribute)(void *), double);
+};
+
+extern Decision16Struct Decisions16[NUMDECISIONS];
+
+ImageGray16 *ImageGray16Create(ulong width, ulong height);
+void ImageGray16Delete(ImageGray16 *img);
+ImageGray16 *ImageGray16Read(char *fname);
+int ImagePGM16BinWrite(ImageGray16 *img, char *fname);
+
+/* The attribute callbacks get no gray levels (img is NULL), so only
+ * attributes that ignore them can be used with MaxTree16 */
+bool MaxTree16SupportsAttrib(AttribStruct *attrib);
+MaxTree16 *MaxTree16Create(ImageGray16 *img, ImageGray *template,
+                           void *(*newauxdata)(ulong, ulong, int, ulong *, ImageGray *),
+                           void (*addtoauxdata)(void *, ulong, ulong, int, ulong *, ImageGray *),
+                           void (*mergeauxdata)(void *, void *),
+                           void (*deleteauxdata)(void *));
+void MaxTree16Delete(MaxTree16 *mt);
+
+void MaxTree16FilterMin(MaxTree16 *mt, ImageGray16 *img, ImageGray *template,
+                        ImageGray16 *out, double (*attribute)(void *),
+                        double lambda);
+
+void MaxTree16FilterDirect(MaxTree16 *mt, ImageGray16 *img, ImageGray *template,
+                           ImageGray16 *out, double (*attribute)(void *),
+                           double lambda);
+
+void MaxTree16FilterMax(MaxTree16 *mt, ImageGray16 *img, ImageGray *template,
+                        ImageGray16 *out, double (*attribute)(void *),
+                        double lambda);
+
+void MaxTree16FilterSubtractive(MaxTree16 *mt, ImageGray16 *img, ImageGray *template,
+                                ImageGray16 *out, double (*attribute)(void *),
+                                double lambda);
+
+#endif //COMPUTERVISIONPROJECT_MAXTREE16_H
@@ -5,8 +5,13 @@
 #ifndef COMPUTERVISIONPROJECT_MAXTREE3B_H
 #define COMPUTERVISIONPROJECT_MAXTREE3B_H
 
+#include <limits.h>
+#include <stddef.h>
+
 #define NUMLEVELS     256
+#define CONNECTIVITY  4
 #define NUMDECISIONS 4
+#define NUMBUILDERS 3
 #define NUMATTR 19
 
 typedef short bool;
@@ -28,20 +33,46 @@ struct ImageGray
 typedef struct MaxNode MaxNode;
 struct MaxNode
 {
-    ulong Parent;
-    ulong Area;
-    void *Attribute;
+    uint Parent;
+    uint Area;
     ubyte Level;
     ubyte NewLevel;  /* gray level after filtering */
 };
 
+typedef struct AuxArena AuxArena;
+
+/* Maximal run of pixels of a row that belong to the same node */
+typedef struct MaxTreeRun MaxTreeRun;
+struct MaxTreeRun
+{
+    uint Start;   /* first column */
+    uint Length;
+    uint Node;    /* MAXTREE_NoNode outside the template */
+};
+
+typedef struct MaxTreeRuns MaxTreeRuns;
+struct MaxTreeRuns
+{
+    ulong Width;
+    ulong Height;
+    ulong NumRuns;
+    ulong *RowStart;  /* runs of row y are Runs[RowStart[y]] up to Runs[RowStart[y+1]] */
+    MaxTreeRun *Runs;
+};
+
 typedef struct MaxTree MaxTree;
 struct MaxTree
 {
-    long *Status;
-    ulong *NumPixelsBelowLevel;
+    long *Status;  /* node of p within its level, negative outside the template, NULL once NodeMap is built */
+    uint *NodeMap; /* node of every pixel, MAXTREE_NoNode outside the template */
+    MaxTreeRuns *Runs;  /* run-length form of the pixel to node map, NULL until MaxTreeBuildRuns */
+    ulong *NumPixelsBelowLevel; /* Offset of level h in Nodes while building */
+    ulong *NumNodesBelowLevel;  /* Offset of level h in Nodes of the finished tree */
     ulong *NumNodesAtLevel; /* Number of nodes C^k_h at level h */
+    ulong NumNodes;
     MaxNode *Nodes;
+    void **Attributes;  /* attribute data of every node, indexed like Nodes */
+    AuxArena *Arena;  /* attribute data of all nodes, NULL if each has its own malloc */
     void *(*NewAuxData)(ulong, ulong, int, ulong *, ImageGray *);
     void (*AddToAuxData)(void *, ulong, ulong, int, ulong *, ImageGray *);
     void (*MergeAuxData)(void *, void *);
@@ -54,6 +85,16 @@ struct DecisionStruct
     char *Name;
     void (*Filter)(MaxTree *, ImageGray *, ImageGray *, ImageGray *, double (*attribute)(void *), double);
 };
+typedef struct BuilderStruct BuilderStruct;
+struct BuilderStruct
+{
+    char *Name;
+    MaxTree *(*Create)(ImageGray *, ImageGray *,
+                       void *(*)(ulong, ulong, int, ulong *, ImageGray *),
+                       void (*)(void *, ulong, ulong, int, ulong *, ImageGray *),
+                       void (*)(void *, void *),
+                       void (*)(void *));
+};
 typedef struct AttribStruct AttribStruct;
 struct AttribStruct
 {
@@ -72,6 +113,18 @@ struct InertiaData
     double SumX, SumY, SumX2, SumY2;
 };
 
+/* Attribute data are bump-allocated from an arena owned by the tree while
+ * MaxTreeUseArena is set; AuxDataMallocCount counts the mallocs made for them */
+extern bool MaxTreeUseArena;
+void AuxArenaBegin(AuxArena **arena, ulong numpixels);
+void AuxArenaEnd(void);
+void AuxArenaAppend(AuxArena **arena, AuxArena *other);
+void AuxArenaDelete(AuxArena *arena);
+ulong AuxDataMallocCount(void);
+void *AuxDataAlloc(size_t size);
+void AuxDataFree(void *data);
+size_t AuxDataRecordSize(void *(*newauxdata)(ulong, ulong, int, ulong *, ImageGray *));
+
 ImageGray *ImagePGMRead(char *fname);
 ImageGray *GetTemplate(char *templatefname, ImageGray *img);
 void ImageGrayDelete(ImageGray *img);
@@ -82,6 +135,50 @@ MaxTree *MaxTreeCreate(ImageGray *img, ImageGray *template,
                        void (*addtoauxdata)(void *, ulong, ulong, int, ulong *, ImageGray *),
                        void (*mergeauxdata)(void *, void *),
                        void (*deleteauxdata)(void *));
+MaxTree *MaxTreeCreateUnionFind(ImageGray *img, ImageGray *template,
+                                void *(*newauxdata)(ulong, ulong, int, ulong *, ImageGray *),
+                                void (*addtoauxdata)(void *, ulong, ulong, int, ulong *, ImageGray *),
+                                void (*mergeauxdata)(void *, void *),
+                                void (*deleteauxdata)(void *));
+MaxTree *MaxTreeCreateParallel(ImageGray *img, ImageGray *template,
+                               void *(*newauxdata)(ulong, ulong, int, ulong *, ImageGray *),
+                               void (*addtoauxdata)(void *, ulong, ulong, int, ulong *, ImageGray *),
+                               void (*mergeauxdata)(void *, void *),
+                               void (*deleteauxdata)(void *),
+                               int numthreads);
+/* The builders replace Status by NodeMap while MaxTreeUseNodeMap is set;
+ * MaxTreeNodeOf finds the node of pixel p in either case, MAXTREE_NoNode
+ * outside the template, where the builders leave Status negative */
+#define MAXTREE_NoNode  UINT_MAX
+extern bool MaxTreeUseNodeMap;
+#define MaxTreeNodeOf(mt, img, p)  ((mt)->NodeMap ? (ulong)((mt)->NodeMap[p]) : \
+                                    ((mt)->Status[p]<0) ? (ulong)MAXTREE_NoNode : \
+                                    (mt)->NumNodesBelowLevel[(img)->Pixmap[p]] + (mt)->Status[p])
+void MaxTreeBuildNodeMap(MaxTree *mt, ImageGray *img, ubyte *shape);
+/* Row runs of the pixel to node map; MaxTreeBuildRuns attaches them to mt
+ * (once) and MaxTreeDelete releases them, MaxTreeRunsCreate gives a copy
+ * owned by the caller */
+MaxTreeRuns *MaxTreeRunsCreate(const MaxTree *mt, const ImageGray *img);
+void MaxTreeRunsDelete(MaxTreeRuns *runs);
+MaxTreeRuns *MaxTreeBuildRuns(MaxTree *mt, ImageGray *img);
+/* Runs with the nodes keep leaves out merged into their nearest kept
+ * ancestor, which prunes them from whatever walks the runs */
+MaxTreeRuns *MaxTreeRunsPrune(const MaxTreeRuns *runs, const MaxTree *mt, const bool *keep);
+/* Thread count used by MaxTreeCreateStrips, 0 for one per processor */
+extern int MaxTreeNumThreads;
+MaxTree *MaxTreeCreateStrips(ImageGray *img, ImageGray *template,
+                             void *(*newauxdata)(ulong, ulong, int, ulong *, ImageGray *),
+                             void (*addtoauxdata)(void *, ulong, ulong, int, ulong *, ImageGray *),
+                             void (*mergeauxdata)(void *, void *),
+                             void (*deleteauxdata)(void *));
+int GetNeighbors(ubyte *shape, ulong imgwidth, ulong imgsize, ulong p,
+                 ulong *neighbors);
+/* Marks pixels not yet added to the union-find forest */
+#define UF_Unprocessed  ((ulong)-1)
+ulong UFFindRoot(ulong *zpar, ulong p);
+ulong UFLevelRoot(ubyte *pixmap, ulong *parent, ulong p);
+ulong UFLevelRootCompress(ubyte *pixmap, ulong *parent, ulong p);
+void UFConnect(ubyte *pixmap, ulong *parent, ulong x, ulong y);
 
 void MaxTreeDelete(MaxTree *mt);
 int ImagePGMBinWrite(ImageGray *img, char *fname);
@@ -161,5 +258,21 @@ void DeleteLevelData(void *levelattr);
 void AddToLevelData(void *levelattr, ulong x, ulong y, int numneighbors, ulong *neighbors, ImageGray *img);
 void MergeLevelData(void *levelattr, void *childattr);
 double LevelAttribute(void *levelattr);
+/* Combined data of the attributes selected with MultiAttribSelect, built in
+ * one pass; MultiAttribFor gives the function evaluating one of them on it.
+ * Every record keeps the families it was built with, so a tree stays
+ * readable after later selections. */
+bool MultiAttribSelect(AttribStruct *attribs, ulong mask);
+double (*MultiAttribFor(AttribStruct *attrib))(void *);
+void *MultiAttribData(void *multiattr, AttribStruct *attrib);
+void *NewMultiData(ulong x, ulong y, int numneighbors, ulong *neighbors, ImageGray *img);
+void DeleteMultiData(void *multiattr);
+void AddToMultiData(void *multiattr, ulong x, ulong y, int numneighbors, ulong *neighbors, ImageGray *img);
+void MergeMultiData(void *multiattr, void *childattr);
+double MultiMeanXAttribute(void *multiattr);
+/* Builders and filters pick loops specialized for the attribute callbacks
+ * of the Attribs table while MaxTreeUseSpecialized is set */
+extern bool MaxTreeUseSpecialized;
+void MaxTreeAttribValues(const MaxTree *mt, double (*attribute)(void *), double *values);
 
 #endif //COMPUTERVISIONPROJECT_MAXTREE3B_H
@@ -0,0 +1,41 @@
+//
+// Attributes of a finished Max-tree, computed into one array per quantity.
+//
+
+#ifndef COMPUTERVISIONPROJECT_MAXTREEATTR_H
+#define COMPUTERVISIONPROJECT_MAXTREEATTR_H
+
+#include "maxtree3b.h"
+
+/* Families of per-node quantities AttribArraysCreate can accumulate */
+#define ATTRFAM_AREA       0x01  /* Area */
+#define ATTRFAM_ENCLRECT   0x02  /* MinX, MinY, MaxX, MaxY */
+#define ATTRFAM_MOMENTS    0x04  /* SumX, SumY, SumX2, SumY2 */
+#define ATTRFAM_PERICB     0x08  /* Perimeter (cityblock) */
+#define ATTRFAM_LAMBDAMAX  0x10  /* MaxLevel */
+#define ATTRFAM_ALL        0x1f
+
+/* Arrays are indexed like the nodes of the tree, NULL if their family was
+ * not requested */
+typedef struct AttribArrays AttribArrays;
+struct AttribArrays
+{
+    ulong NumNodes;
+    int Families;
+    ubyte *Level;
+    uint *Area;
+    uint *MinX, *MinY, *MaxX, *MaxY;
+    double *SumX, *SumY, *SumX2, *SumY2;
+    long *Perimeter;
+    ubyte *MaxLevel;
+};
+
+AttribArrays *AttribArraysCreate(MaxTree *mt, ImageGray *img, ImageGray *template, int families);
+void AttribArraysDelete(AttribArrays *aa);
+/* Families needed to evaluate attribute, -1 if it has no array form */
+int AttribArraysFamiliesOf(double (*attribute)(void *));
+/* Writes the value of attribute for every node to out, as the attribute
+ * function would return it from the data of a tree build */
+int AttribArraysCompute(AttribArrays *aa, double (*attribute)(void *), double *out);
+
+#endif //COMPUTERVISIONPROJECT_MAXTREEATTR_H
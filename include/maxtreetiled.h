@@ -0,0 +1,27 @@
+//
+// Out-of-core Max-tree filtering of images that do not fit in memory.
+//
+
+#ifndef COMPUTERVISIONPROJECT_MAXTREETILED_H
+#define COMPUTERVISIONPROJECT_MAXTREETILED_H
+
+#include "maxtree3b.h"
+
+/* Indices of the decision rules, in the order of the Decisions table */
+#define DECISION_MIN          0
+#define DECISION_DIRECT       1
+#define DECISION_MAX          2
+#define DECISION_SUBTRACTIVE  3
+
+/* Estimate of the working memory per pixel of a band: image buffers, Status,
+ * Nodes, the hierarchical queue and the per-node bookkeeping of the bands */
+#define TILED_BYTES_PER_PIXEL  64
+
+/* Filters a P5 PGM image band by band. The bands, the attribute records
+ * and the boundary forest are counted against membudget; the bands shrink
+ * until they fit and the call fails if bands of one row do not. */
+int MaxTreeTiledFilter(char *infname, char *outfname, AttribStruct *attrib,
+                       int decision, double lambda, ulong membudget,
+                       ulong *numbands, ulong *numboundarynodes, ulong *peakbytes);
+
+#endif //COMPUTERVISIONPROJECT_MAXTREETILED_H
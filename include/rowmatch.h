@@ -0,0 +1,48 @@
+//
+// Kernels for the best attribute match among the candidates of a row.
+//
+
+#ifndef COMPUTERVISIONPROJECT_ROWMATCH_H
+#define COMPUTERVISIONPROJECT_ROWMATCH_H
+
+#include "maxtree3b.h"
+
+// Returns the first j < num with the smallest fabs(value-values[j]) below *best_diff among those whose disparity
+// centroid-centroids[j] is within [d_min, d_max], and stores that difference in *best_diff; -1 if there is none.
+// Every kernel gives the result of the scalar loop.
+typedef long (*RowMatchFunc)(const double *values, const double *centroids, ulong num, double value, double centroid,
+                             double d_min, double d_max, double *best_diff);
+
+// The same over rows of single precision values, for num below 2^24
+typedef long (*RowMatchFloatFunc)(const float *values, const float *centroids, ulong num, float value, float centroid,
+                                  float d_min, float d_max, float *best_diff);
+
+// The same over several attributes: values holds num_attribs arrays of stride values, value one value per attribute,
+// and the difference of candidate j is the sum over the attributes of weights[k]*fabs(value[k]-values[k*stride+j]),
+// or of weights[k]*(d*d) with d the difference when squared is set, added up in attribute order.
+typedef long (*RowMatchCostFunc)(const double *values, ulong stride, int num_attribs, const double *weights,
+                                 bool squared, const double *centroids, ulong num, const double *value,
+                                 double centroid, double d_min, double d_max, double *best_diff);
+
+typedef struct RowMatchStruct RowMatchStruct;
+struct RowMatchStruct {
+    char *Name;
+    bool (*Supported)(void);
+    RowMatchFunc Best;
+    RowMatchFloatFunc BestFloat;
+    RowMatchCostFunc Cost;
+};
+
+#define NUMROWMATCH 3
+// Ordered from slowest to fastest
+extern RowMatchStruct RowMatchKernels[NUMROWMATCH];
+
+// Fastest kernel the processor supports
+RowMatchFunc RowMatchSelect(void);
+RowMatchFloatFunc RowMatchFloatSelect(void);
+RowMatchCostFunc RowMatchCostSelect(void);
+// Difference of candidate j as the cost kernels compute it
+double RowMatchCost(const double *values, ulong stride, int num_attribs, const double *weights, bool squared, ulong j,
+                    const double *value);
+
+#endif //COMPUTERVISIONPROJECT_ROWMATCH_H
@@ -3,18 +3,30 @@
 //
 
 #include "calculatedisp.h"
+#include "rowmatch.h"
+#include "dispsgm.h"
 #include <stdio.h>
 #include <limits.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+// Index of "Mean X position" in Attribs
+#define ATTR_MEANX 13
 
-// TODO: maybe filter the tree before comparing both?
 DecisionStruct Decisions[NUMDECISIONS] = {
                 {"Min", MaxTreeFilterMin},
                 {"Direct", MaxTreeFilterDirect},
                 {"Max", MaxTreeFilterMax},
                 {"Subtractive", MaxTreeFilterSubtractive},
         };
+BuilderStruct Builders[NUMBUILDERS] = {
+                {"Flooding", MaxTreeCreate},
+                {"Union-find", MaxTreeCreateUnionFind},
+                {"Parallel strips", MaxTreeCreateStrips},
+        };
 AttribStruct Attribs[NUMATTR] = {
                 {"Area", NewAreaData, DeleteAreaData, AddToAreaData, MergeAreaData, AreaAttribute},
                 {"Area of min. enclosing rectangle", NewEnclRectData, DeleteEnclRectData, AddToEnclRectData, MergeEnclRectData, EnclRectAreaAttribute},
@@ -39,37 +51,34 @@ AttribStruct Attribs[NUMATTR] = {
 
 typedef struct DispNodeAux DispNodeAux;
 struct DispNodeAux {  // Same indexation as with MaxNodes
-    double *attr_diff;  // difference between attribute values of node_l and node_r
-    double *disparity;  // Disparity for specific node
-
-    // TODO: Couldn't think of a better way to know if attr_diff is zero because of calloc or because it's found a perfect match
-    bool *is_set;
+    double *attr_diff;  // difference between attribute values of node_l and node_r, DISP_UNSET without a match
+    float *disparity;   // Disparity for specific node, rounded down to a float
 };
 
-DispNodeAux *DispNodeAuxCreate(ulong imgsize)
+// attr_diff of a node without a match, above any difference a match is taken with
+#define DISP_UNSET INFINITY
+#define disp_is_set(aux, n) ((aux)->attr_diff[n] < DISP_UNSET)
+
+DispNodeAux *DispNodeAuxCreate(ulong num_nodes)
 {
     DispNodeAux *aux;
     /* Allocate structures */
     aux = malloc(sizeof(DispNodeAux));
     if (aux==NULL)
         return(NULL);
-    aux->attr_diff = calloc((size_t)imgsize, sizeof(double));
+    aux->attr_diff = malloc((num_nodes ? num_nodes : 1)*sizeof(double));
     if (aux->attr_diff==NULL) {
         free(aux);
         return(NULL);
     }
-    aux->disparity = calloc((size_t)imgsize, sizeof(double));
+    aux->disparity = calloc((size_t)(num_nodes ? num_nodes : 1), sizeof(float));
     if (aux->disparity==NULL) {
         free(aux->attr_diff);
         free(aux);
         return(NULL);
     }
-    aux->is_set = calloc((size_t)imgsize, sizeof(bool));
-    if (aux->is_set==NULL) {
-        free(aux->attr_diff);
-        free(aux->disparity);
-        free(aux);
-        return(NULL);
+    for (ulong n = 0; n < num_nodes; ++n) {
+        aux->attr_diff[n] = DISP_UNSET;
     }
     return(aux);
 } /* DispNodeAuxCreate */
@@ -78,18 +87,115 @@ void DispNodeAuxDelete(DispNodeAux *aux)
 {
     free(aux->attr_diff);
     free(aux->disparity);
-    free(aux->is_set);
     free(aux);
 } /* DispNodeAuxDelete */
 
+// Keeps a match of node n. The disparity is rounded down, so its integer part, which ends up in the output, is
+// the one of the double. The differences stay double: as floats, near ties between rows would pick other matches.
+void disp_aux_keep(DispNodeAux *aux, ulong n, double diff, double disparity) {
+    float disparity_f = (float) disparity;
+    if ((double) disparity_f > disparity) {
+        disparity_f = nextafterf(disparity_f, -INFINITY);
+    }
+    aux->attr_diff[n] = diff;
+    aux->disparity[n] = disparity_f;
+}
+
 bool is_in_range(double ref_val, double new_val, double margin) {
     return ((fabs(ref_val-new_val) <= margin) ? true : false);
 }
 
-// TODO: keep thinking what the return value should be.. Probably return pointer to out
-int calc_disp(const MaxTree *mt_l, const MaxTree *mt_r, const ImageGray *img_l, const ImageGray *img_r, ImageGray *out,
-              double (*attribute)(void *)) {
-    MaxNode *node_l, *node_r;
+// Returns the pixel to node map of mt, or a copy made from Status when the tree keeps no NodeMap
+const uint *get_node_map(const MaxTree *mt, const ImageGray *img) {
+    uint *map;
+    if (mt->NodeMap) {
+        return (mt->NodeMap);
+    }
+    ulong imgsize = img->Height*img->Width;
+    map = malloc((imgsize ? imgsize : 1)*sizeof(uint));
+    if (map==NULL) {
+        return (NULL);
+    }
+    for (ulong p = 0; p < imgsize; ++p) {
+        map[p] = (uint) MaxTreeNodeOf(mt, img, p);
+    }
+    return (map);
+}
+
+void release_node_map(const MaxTree *mt, const uint *map) {
+    if (map!=mt->NodeMap) {
+        free((uint *) map);
+    }
+}
+
+// Returns the value of attribute for every node of mt, computed in one specialized pass
+double *get_node_values(const MaxTree *mt, double (*attribute)(void *)) {
+    double *values = malloc((mt->NumNodes ? mt->NumNodes : 1)*sizeof(double));
+    if (values!=NULL) {
+        MaxTreeAttribValues(mt, attribute, values);
+    }
+    return (values);
+}
+
+DispNodeCache *DispNodeCacheCreate(const MaxTree *mt, double (*centroid)(void *)) {
+    DispNodeCache *cache = malloc(sizeof(DispNodeCache));
+    if (cache==NULL) {
+        return (NULL);
+    }
+    cache->num_nodes = mt->NumNodes;
+    cache->num_attribs = 0;
+    cache->squared = false;
+    cache->values = NULL;
+    cache->centroids = get_node_values(mt, centroid);
+    if (cache->centroids==NULL) {
+        free(cache);
+        return (NULL);
+    }
+    return (cache);
+}
+
+// Makes attribute the only one of the cache, reusing the array of the previous attributes
+int DispNodeCacheSetAttribute(DispNodeCache *cache, const MaxTree *mt, double (*attribute)(void *)) {
+    if (cache->values==NULL) {
+        cache->values = malloc((cache->num_nodes ? cache->num_nodes : 1)*sizeof(double));
+        if (cache->values==NULL) {
+            return (-1);
+        }
+    }
+    MaxTreeAttribValues(mt, attribute, cache->values);
+    cache->num_attribs = 1;
+    cache->weights[0] = 1.0;
+    cache->squared = false;
+    return (0);
+}
+
+// Adds attribute with weight to the cost of the cache
+int DispNodeCacheAddAttribute(DispNodeCache *cache, const MaxTree *mt, double (*attribute)(void *), double weight) {
+    ulong num_nodes = cache->num_nodes ? cache->num_nodes : 1;
+    if (cache->num_attribs >= DISP_MAXATTRIBS) {
+        return (-1);
+    }
+    double *values = realloc(cache->values, (cache->num_attribs+1)*num_nodes*sizeof(double));
+    if (values==NULL) {
+        return (-1);
+    }
+    cache->values = values;
+    MaxTreeAttribValues(mt, attribute, values + cache->num_attribs*num_nodes);
+    cache->weights[cache->num_attribs++] = weight;
+    return (0);
+}
+
+void DispNodeCacheDelete(DispNodeCache *cache) {
+    free(cache->values);
+    free(cache->centroids);
+    free(cache);
+}
+
+// Reference matching per pixel: every left pixel is compared with every right pixel to its left on the same row.
+// centroid gives the mean x position of a node from its attribute data
+int calc_disp_scan(const MaxTree *mt_l, const MaxTree *mt_r, const ImageGray *img_l, const ImageGray *img_r, ImageGray *out,
+              double (*attribute)(void *), double (*centroid)(void *)) {
+    MaxNode *node_l;
     DispNodeAux *disp_aux;
     ulong imgsize = img_l->Height*img_l->Width;
     ulong nrows = img_l->Height, ncols = img_l->Width;
@@ -101,63 +207,1017 @@ int calc_disp(const MaxTree *mt_l, const MaxTree *mt_r, const ImageGray *img_l,
     // TODO: maybe not necessary to reset image...
     ImageGrayInit(out, (ubyte) 0); // set image to 0 (all black)
 
-    disp_aux = DispNodeAuxCreate(imgsize);
+    disp_aux = DispNodeAuxCreate(mt_l->NumNodes);
     if (disp_aux==NULL) {
         return (-1);
     }
+    const uint *map_l = get_node_map(mt_l, img_l);
+    const uint *map_r = get_node_map(mt_r, img_r);
+    // Attribute values and centroids of all nodes, so the row scan does not call back per pixel pair
+    double *values_l = get_node_values(mt_l, attribute);
+    double *values_r = get_node_values(mt_r, attribute);
+    double *centroid_l = get_node_values(mt_l, centroid);
+    double *centroid_r = get_node_values(mt_r, centroid);
+    if (map_l==NULL || map_r==NULL || values_l==NULL || values_r==NULL || centroid_l==NULL || centroid_r==NULL) {
+        if (map_l) release_node_map(mt_l, map_l);
+        if (map_r) release_node_map(mt_r, map_r);
+        free(values_l);
+        free(values_r);
+        free(centroid_l);
+        free(centroid_r);
+        DispNodeAuxDelete(disp_aux);
+        return (-1);
+    }
     for (ulong r = 0; r < nrows; ++r) {
         for (ulong col_l = 0; col_l < ncols; ++col_l) {
             ulong pix_l = r*ncols + col_l;
-            ulong idx_l = mt_l->NumPixelsBelowLevel[img_l->Pixmap[pix_l]] + mt_l->Status[pix_l];
+            ulong idx_l = map_l[pix_l];
             node_l = &(mt_l->Nodes[idx_l]);
-            InertiaData *inertiadata_l = node_l->Attribute;
-            double value_l = (*attribute)(node_l->Attribute);
+            double value_l = values_l[idx_l];
 
             // Find the equivalent node along the current row
             for (ulong col_r = col_l; col_r < ULONG_MAX; --col_r) { // swipe epipolar line to the left only
                 ulong pix_r = r*ncols + col_r;
-                ulong idx_r = mt_r->NumPixelsBelowLevel[img_r->Pixmap[pix_r]] + mt_r->Status[pix_r];
-                node_r = &(mt_r->Nodes[idx_r]);
-                InertiaData *inertiadata_r = node_r->Attribute;
-                double value_r = (*attribute)(node_r->Attribute);
+                ulong idx_r = map_r[pix_r];
+                double value_r = values_r[idx_r];
 
                 double diff_value = fabs(value_l-value_r);
-                if (!disp_aux->is_set[idx_l] || (diff_value < disp_aux->attr_diff[idx_l])) {
-                    double disparity = (inertiadata_l->SumX / inertiadata_l->Area) - (inertiadata_r->SumX / inertiadata_r->Area);
+                if (!disp_is_set(disp_aux, idx_l) || (diff_value < disp_aux->attr_diff[idx_l])) {
+                    double disparity = centroid_l[idx_l] - centroid_r[idx_r];
                     // Only update when disparity makes sense. Take parent's value otherwise
                     if (disparity < 0) {
                         disp_aux->disparity[idx_l] = disp_aux->disparity[node_l->Parent];
                     }
                     else {
-                        disp_aux->is_set[idx_l] = true;
-                        disp_aux->attr_diff[idx_l] = diff_value;
-                        disp_aux->disparity[idx_l] = disparity;
+                        disp_aux_keep(disp_aux, idx_l, diff_value, disparity);
                     }
                 }
             }
         }
     }
     for (ulong i = 0; i<imgsize; ++i) {
-        ulong idx_l = mt_l->NumPixelsBelowLevel[img_l->Pixmap[i]] + mt_l->Status[i];
-        out->Pixmap[i] = (ubyte) disp_aux->disparity[idx_l];
+        out->Pixmap[i] = (ubyte) disp_aux->disparity[map_l[i]];
     }
+    release_node_map(mt_l, map_l);
+    release_node_map(mt_r, map_r);
+    free(values_l);
+    free(values_r);
+    free(centroid_l);
+    free(centroid_r);
 
     DispNodeAuxDelete(disp_aux);
     return (0);
 }
 
-ImageGray *create_disp_img(ImageGray *img_l, ImageGray *img_r, ImageGray *template_l, ImageGray *template_r, int attrib) {
-    ImageGray *out;
-    MaxTree *mt_l, *mt_r;
-    mt_l = MaxTreeCreate(img_l, template_l, Attribs[attrib].NewAuxData, Attribs[attrib].AddToAuxData, Attribs[attrib].MergeAuxData, Attribs[attrib].DeleteAuxData);
-    if (mt_l==NULL) {
+typedef struct RowNode RowNode;
+struct RowNode {
+    uint node;   // node index in its tree
+    uint first;  // first and last column of the node on the row
+    uint last;
+};
+
+// Returns the row runs of mt, or a copy made from its pixel to node map when none are attached
+const MaxTreeRuns *get_node_runs(const MaxTree *mt, const ImageGray *img) {
+    if (mt->Runs) {
+        return (mt->Runs);
+    }
+    return (MaxTreeRunsCreate(mt, img));
+}
+
+void release_node_runs(const MaxTree *mt, const MaxTreeRuns *runs) {
+    if (runs!=mt->Runs) {
+        MaxTreeRunsDelete((MaxTreeRuns *) runs);
+    }
+}
+
+// Returns runs with the nodes of mt whose area is below DispPruneArea merged into their nearest ancestor that is
+// not, so the matcher never lists them, and releases runs. NULL on error.
+const MaxTreeRuns *prune_node_runs(const MaxTree *mt, const MaxTreeRuns *runs) {
+    MaxTreeRuns *pruned = NULL;
+    bool *keep = malloc((mt->NumNodes ? mt->NumNodes : 1)*sizeof(bool));
+    if (keep!=NULL) {
+        for (ulong n = 0; n < mt->NumNodes; ++n) {
+            keep[n] = mt->Nodes[n].Area >= DispPruneArea;
+        }
+        pruned = MaxTreeRunsPrune(runs, mt, keep);
+    }
+    free(keep);
+    release_node_runs(mt, runs);
+    return (pruned);
+}
+
+// Lists the distinct nodes of one row in order of first appearance, with their first and last column on the row.
+// seen[n] holds the row (plus one) in which node n was last listed, slot[n] its place in the list.
+ulong list_row_nodes(const MaxTreeRuns *runs, ulong row, uint *seen, uint *slot, RowNode *list) {
+    ulong num = 0;
+    const MaxTreeRun *run = runs->Runs + runs->RowStart[row];
+    const MaxTreeRun *end = runs->Runs + runs->RowStart[row+1];
+    for (; run < end; ++run) {
+        uint n = run->Node;
+        if (n==MAXTREE_NoNode) {
+            continue;
+        }
+        if (seen[n]!=row+1) {
+            seen[n] = (uint) (row+1);
+            slot[n] = (uint) num;
+            list[num].node = n;
+            list[num].first = run->Start;
+            list[num++].last = run->Start + run->Length - 1;
+        }
+        else {
+            list[slot[n]].last = run->Start + run->Length - 1;
+        }
+    }
+    return (num);
+}
+
+// Right node of a row in the attribute index of the row
+typedef struct SortedNode SortedNode;
+struct SortedNode {
+    double value;     // attribute value
+    double centroid;  // mean x position
+    uint first;       // first column on the row
+    uint pos;         // place in the row list, which breaks ties like the linear scan
+};
+
+// A left node searches the attribute index of its row when it has more than this many candidates and they are at
+// least a quarter of the row, and the index is only built for rows with at least SORTED_MIN_QUERIES such nodes,
+// as sorting costs more than a few scans
+#define SORTED_MIN_CANDIDATES 32
+#define SORTED_MIN_QUERIES 8
+#define is_wide(num_cand, num_r) ((num_cand) > SORTED_MIN_CANDIDATES && 4*(num_cand) > (num_r))
+
+int cmp_sorted_node(const void *a, const void *b) {
+    const SortedNode *na = a, *nb = b;
+    if (na->value!=nb->value) {
+        return ((na->value < nb->value) ? -1 : 1);
+    }
+    return ((na->pos < nb->pos) ? -1 : (na->pos > nb->pos));
+}
+
+// Builds the attribute index of a row from its right node list: the nodes with a finite value, sorted by value.
+// Other values never give a difference below the best one, so they are left out.
+ulong sort_row_nodes(const RowNode *row_r, ulong num_r, const double *row_value_r, const double *row_centroid_r,
+                     SortedNode *sorted) {
+    ulong num = 0;
+    for (ulong j = 0; j < num_r; ++j) {
+        if (isfinite(row_value_r[j])) {
+            sorted[num].value = row_value_r[j];
+            sorted[num].centroid = row_centroid_r[j];
+            sorted[num].first = row_r[j].first;
+            sorted[num++].pos = (uint) j;
+        }
+    }
+    qsort(sorted, num, sizeof(SortedNode), cmp_sorted_node);
+    return (num);
+}
+
+// Finds the candidate with the smallest attribute difference to value_l that starts in columns [lo, hi] and whose
+// disparity is within [d_min, d_max], by walking out from the place of value_l in the index until the
+// difference exceeds the best one. Among equal differences the first in the row list wins, and only a difference
+// below *best_diff is taken, as in the linear scan.
+bool search_sorted(const SortedNode *sorted, ulong num, double value_l, double centroid_l, ulong lo, ulong hi,
+                   ulong d_min, ulong d_max, double *best_diff, double *best_disparity) {
+    ulong start = 0, up = num;
+    uint best_pos = UINT_MAX;
+    double limit = *best_diff;
+    bool found = false;
+    if (!isfinite(value_l)) {
+        return (false);
+    }
+    while (start < up) {
+        ulong mid = start + (up-start)/2;
+        if (sorted[mid].value < value_l) {
+            start = mid + 1;
+        }
+        else {
+            up = mid;
+        }
+    }
+    for (int dir = 0; dir < 2; ++dir) {
+        for (ulong k = start; dir==0 ? k > 0 : k < num; dir==0 ? --k : ++k) {
+            const SortedNode *node = &sorted[dir==0 ? k-1 : k];
+            double diff_value = fabs(value_l-node->value);
+            if (found ? diff_value > limit : !(diff_value < limit)) {
+                break;
+            }
+            double disparity = centroid_l - node->centroid;
+            if (node->first < lo || node->first > hi || disparity < d_min || disparity > d_max) {
+                continue;
+            }
+            if (!found || diff_value < limit || node->pos < best_pos) {
+                limit = diff_value;
+                best_pos = node->pos;
+                *best_disparity = disparity;
+                found = true;
+            }
+        }
+    }
+    if (found) {
+        *best_diff = limit;
+    }
+    return (found);
+}
+
+// Inputs of the matching, shared read-only by the workers
+typedef struct DispMatch DispMatch;
+struct DispMatch {
+    const MaxTreeRuns *runs_l, *runs_r;
+    const double *values_l, *values_r;      // attribute values of every node, num_attribs arrays each
+    const double *centroid_l, *centroid_r;  // mean x position of every node
+    ulong num_nodes_l, num_nodes_r, ncols;
+    ulong d_min, d_max;
+    int num_attribs;
+    const double *weights;
+    bool squared;
+    RowMatchFunc row_match;     // kernel for the prefix scans of a single attribute
+    RowMatchCostFunc row_cost;  // and of several
+    ulong node_begin, node_end;         // left nodes matched in this pass
+    bool match_right;                   // also match the right nodes against the left ones, over [d_min, d_max]
+    const uint *node_dmin, *node_dmax;  // disparity range of every left node, NULL for [d_min, d_max]
+    const RowNode *pass_nodes;          // row lists of the left nodes of this pass, NULL to list every row
+    const uint *pass_node_rows;         // row of each of them
+    ulong pass_num;
+};
+
+// A band of rows and the best matches found in it
+typedef struct DispJob DispJob;
+struct DispJob {
+    const DispMatch *match;
+    ulong row_begin, row_end;
+    DispNodeAux *aux;
+    DispNodeAux *aux_r;  // matches of the right nodes, when the pass matches them
+    bool started;  // matched by a thread of its own
+    int st;
+};
+
+int DispNumThreads = 0;
+int DispCoarseFinePasses = 1;
+ulong DispCoarseFineWindow = 4;
+long DispLRMaxDiff = -1;
+ulong DispPruneArea = 0;
+
+// Row lists of the left nodes of every coarse to fine pass, so a pass only visits the rows and nodes of its own.
+// The entries of pass p are nodes[start[p]] to nodes[start[p+1]-1], by row and within a row in list_row_nodes order.
+typedef struct DispPassLists DispPassLists;
+struct DispPassLists {
+    RowNode *nodes;
+    uint *rows;    // row of every entry
+    ulong *start;  // num_passes+1 entries
+};
+
+// Pass of node n when num_nodes nodes are matched in num_passes groups in index order
+ulong node_pass(ulong n, ulong num_nodes, ulong num_passes) {
+    return (((n+1)*num_passes - 1)/num_nodes);
+}
+
+void DispPassListsDelete(DispPassLists *lists) {
+    free(lists->nodes);
+    free(lists->rows);
+    free(lists->start);
+}
+
+// Lists the rows of runs once to count the entries of every pass and once to place them
+int DispPassListsCreate(DispPassLists *lists, const MaxTreeRuns *runs, ulong nrows, ulong ncols, ulong num_nodes,
+                        ulong num_passes) {
+    uint *seen = calloc(num_nodes ? num_nodes : 1, sizeof(uint));
+    uint *slot = malloc((num_nodes ? num_nodes : 1)*sizeof(uint));
+    RowNode *list = malloc((ncols ? ncols : 1)*sizeof(RowNode));
+    ulong *next = malloc(num_passes*sizeof(ulong));
+    int st = 0;
+
+    lists->nodes = NULL;
+    lists->rows = NULL;
+    lists->start = calloc(num_passes+1, sizeof(ulong));
+    if (seen==NULL || slot==NULL || list==NULL || next==NULL || lists->start==NULL) {
+        st = -1;
+    }
+    for (ulong r = 0; st==0 && r < nrows; ++r) {
+        ulong num = list_row_nodes(runs, r, seen, slot, list);
+        for (ulong i = 0; i < num; ++i) {
+            lists->start[node_pass(list[i].node, num_nodes, num_passes)+1]++;
+        }
+    }
+    for (ulong p = 0; st==0 && p < num_passes; ++p) {
+        lists->start[p+1] += lists->start[p];
+        next[p] = lists->start[p];
+    }
+    if (st==0) {
+        ulong total = lists->start[num_passes];
+        lists->nodes = malloc((total ? total : 1)*sizeof(RowNode));
+        lists->rows = malloc((total ? total : 1)*sizeof(uint));
+        if (lists->nodes==NULL || lists->rows==NULL) {
+            st = -1;
+        }
+    }
+    if (st==0) {
+        memset(seen, 0, (num_nodes ? num_nodes : 1)*sizeof(uint));
+    }
+    for (ulong r = 0; st==0 && r < nrows; ++r) {
+        ulong num = list_row_nodes(runs, r, seen, slot, list);
+        for (ulong i = 0; i < num; ++i) {
+            ulong k = next[node_pass(list[i].node, num_nodes, num_passes)]++;
+            lists->nodes[k] = list[i];
+            lists->rows[k] = (uint) r;
+        }
+    }
+    free(seen);
+    free(slot);
+    free(list);
+    free(next);
+    if (st) {
+        DispPassListsDelete(lists);
+    }
+    return (st);
+}
+
+// Gets the disparity range of left node n in this pass, false if n is not matched in it
+bool node_range(const DispMatch *m, uint n, ulong *d_min, ulong *d_max) {
+    if (n < m->node_begin || n >= m->node_end) {
+        return (false);
+    }
+    if (m->node_dmin) {
+        *d_min = m->node_dmin[n];
+        *d_max = m->node_dmax[n];
+        return (*d_min <= *d_max);
+    }
+    *d_min = m->d_min;
+    *d_max = m->d_max;
+    return (true);
+}
+
+// Best of candidates [begin, end) of a row for the attribute values value of a node, whose row arrays hold
+// m->num_attribs arrays of m->ncols values. Returns the place of the best one in the row, -1 if none is better.
+long match_slice(const DispMatch *m, const double *row_values, const double *row_centroids, ulong begin, ulong end,
+                 const double *value, double centroid, ulong d_min, ulong d_max, double *best_diff) {
+    long j;
+    if (m->num_attribs==1) {
+        j = m->row_match(row_values + begin, row_centroids + begin, end - begin, value[0], centroid, (double) d_min,
+                         (double) d_max, best_diff);
+    }
+    else {
+        j = m->row_cost(row_values + begin, m->ncols, m->num_attribs, m->weights, m->squared, row_centroids + begin,
+                        end - begin, value, centroid, (double) d_min, (double) d_max, best_diff);
+    }
+    return ((j >= 0) ? j + (long) begin : -1);
+}
+
+// Sets bound[c], for every column c of a row, to the number of nodes of its list that start at or before c, which
+// is ordered by first column. When reverse is set the list is ordered by last column from the right, and bound[c]
+// is the number of nodes that end at or after c.
+void row_bounds(const RowNode *list, ulong num, ulong ncols, bool reverse, uint *bound) {
+    ulong j = 0;
+    for (ulong i = 0; i < ncols; ++i) {
+        ulong c = reverse ? ncols-1-i : i;
+        while (j < num && (reverse ? list[j].last >= c : list[j].first <= c)) {
+            ++j;
+        }
+        bound[c] = (uint) j;
+    }
+}
+
+// Matches the left nodes of rows [row_begin, row_end) and keeps in disp_aux the best match of each node over
+// these rows, the first one among equal differences. Rows are scanned in order, so the bands of a split image
+// give the serial result when they are combined in order.
+// A left node spanning columns [a, b] of a row is compared with the right nodes that start in [a-d_max, b-d_min]
+// on it, a slice of the right list of the row, which is ordered by first column.
+// When m->match_right is set the right nodes of the same rows are matched in aux_r as well, from the row lists
+// already made for the left ones. A right node spanning columns [a, b] is compared with the left nodes that end in
+// [a+d_min, b+d_max], the mirror image of the left search, with the disparity of the pair taken as for the left
+// nodes.
+int match_rows(const DispMatch *m, ulong row_begin, ulong row_end, DispNodeAux *disp_aux, DispNodeAux *aux_r) {
+    ulong ncols = m->ncols, d_min, d_max;
+    ulong num_nodes = m->num_nodes_l, num_nodes_r = m->num_nodes_r;
+    int num_attribs = m->num_attribs;
+    double value_l[DISP_MAXATTRIBS], value_r[DISP_MAXATTRIBS];
+    const MaxTreeRuns *runs_l = m->runs_l, *runs_r = m->runs_r;
+    const double *values_l = m->values_l, *values_r = m->values_r;
+    const double *centroid_l = m->centroid_l, *centroid_r = m->centroid_r;
+    int st = 0;
+
+    uint *seen_l = calloc(num_nodes ? num_nodes : 1, sizeof(uint));
+    uint *seen_r = calloc(num_nodes_r ? num_nodes_r : 1, sizeof(uint));
+    uint *slot_l = malloc((num_nodes ? num_nodes : 1)*sizeof(uint));
+    uint *slot_r = malloc((num_nodes_r ? num_nodes_r : 1)*sizeof(uint));
+    RowNode *list_l = malloc((ncols ? ncols : 1)*sizeof(RowNode));
+    RowNode *row_r = malloc((ncols ? ncols : 1)*sizeof(RowNode));
+    double *row_value_r = malloc(num_attribs*(ncols ? ncols : 1)*sizeof(double));
+    double *row_centroid_r = malloc((ncols ? ncols : 1)*sizeof(double));
+    SortedNode *sorted_r = malloc((ncols ? ncols : 1)*sizeof(SortedNode));
+    uint *cand_l = malloc(2*(ncols ? ncols : 1)*sizeof(uint));
+    uint *bound = malloc((ncols ? ncols : 1)*sizeof(uint));
+    RowNode *rev_l = NULL;
+    double *row_value_l = NULL, *row_centroid_l = NULL;
+    if (m->match_right) {
+        rev_l = malloc((ncols ? ncols : 1)*sizeof(RowNode));
+        row_value_l = malloc(num_attribs*(ncols ? ncols : 1)*sizeof(double));
+        row_centroid_l = malloc((ncols ? ncols : 1)*sizeof(double));
+        if (rev_l==NULL || row_value_l==NULL || row_centroid_l==NULL) {
+            st = -1;
+        }
+    }
+    if (seen_l==NULL || seen_r==NULL || slot_l==NULL || slot_r==NULL || list_l==NULL || row_r==NULL ||
+        row_value_r==NULL || row_centroid_r==NULL || sorted_r==NULL || cand_l==NULL ||
+        bound==NULL) {
+        st = -1;
+    }
+    // The first entry of the pass lists at or after row_begin
+    ulong k_pass = 0, up_pass = m->pass_num;
+    while (k_pass < up_pass) {
+        ulong mid = k_pass + (up_pass-k_pass)/2;
+        if (m->pass_node_rows[mid] < row_begin) {
+            k_pass = mid + 1;
+        }
+        else {
+            up_pass = mid;
+        }
+    }
+    for (ulong r = row_begin; st==0 && r < row_end; ++r) {
+        const RowNode *row_l = list_l;
+        ulong num_l = 0;
+        if (m->pass_nodes) {
+            // Skip to the next row holding a node of this pass
+            if (k_pass==m->pass_num || m->pass_node_rows[k_pass] >= row_end) {
+                break;
+            }
+            r = m->pass_node_rows[k_pass];
+            row_l = m->pass_nodes + k_pass;
+            for (; k_pass < m->pass_num && m->pass_node_rows[k_pass]==r; ++k_pass) {
+                ++num_l;
+            }
+        }
+        else {
+            num_l = list_row_nodes(runs_l, r, seen_l, slot_l, list_l);
+        }
+        // A row without any left node to match is skipped
+        bool any_l = m->match_right;
+        for (ulong i = 0; !any_l && i < num_l; ++i) {
+            any_l = node_range(m, row_l[i].node, &d_min, &d_max) && row_l[i].last >= d_min;
+        }
+        if (!any_l) {
+            continue;
+        }
+        ulong num_r = list_row_nodes(runs_r, r, seen_r, slot_r, row_r);
+        // Copy what the candidates need next to each other, in list order
+        for (ulong j = 0; j < num_r; ++j) {
+            for (int k = 0; k < num_attribs; ++k) {
+                row_value_r[k*ncols + j] = values_r[k*num_nodes_r + row_r[j].node];
+            }
+            row_centroid_r[j] = centroid_r[row_r[j].node];
+        }
+        // Candidates of every left node: the slice of the right list starting in its search range. The index of
+        // the row is only sorted when enough of them are wide, and only holds a single attribute.
+        ulong num_wide = 0, num_sorted = 0;
+        row_bounds(row_r, num_r, ncols, false, bound);
+        for (ulong i = 0; i < num_l; ++i) {
+            ulong begin = 0, end = 0;
+            if (node_range(m, row_l[i].node, &d_min, &d_max) && row_l[i].last >= d_min) {
+                end = bound[row_l[i].last - d_min];
+                begin = (row_l[i].first > d_max) ? bound[row_l[i].first - d_max - 1] : 0;
+            }
+            cand_l[2*i] = (uint) begin;
+            cand_l[2*i+1] = (uint) end;
+            num_wide += is_wide(end - begin, num_r);
+        }
+        bool use_index = num_attribs==1 && num_wide >= SORTED_MIN_QUERIES;
+        if (use_index) {
+            num_sorted = sort_row_nodes(row_r, num_r, row_value_r, row_centroid_r, sorted_r);
+        }
+        for (ulong i = 0; i < num_l; ++i) {
+            uint idx_l = row_l[i].node;
+            double centroid_node_l = centroid_l[idx_l];
+            double best_diff = disp_aux->attr_diff[idx_l];
+            double best_disparity = 0.0;
+            bool found = false;
+            if (!node_range(m, idx_l, &d_min, &d_max) || row_l[i].last < d_min) {
+                continue;
+            }
+            ulong hi = row_l[i].last - d_min;
+            ulong lo = (row_l[i].first > d_max) ? row_l[i].first - d_max : 0;
+            ulong begin = cand_l[2*i], end = cand_l[2*i+1];
+            for (int k = 0; k < num_attribs; ++k) {
+                value_l[k] = values_l[k*num_nodes + idx_l];
+            }
+            if (use_index && is_wide(end - begin, num_r)) {
+                found = search_sorted(sorted_r, num_sorted, value_l[0], centroid_node_l, lo, hi, d_min, d_max,
+                                      &best_diff, &best_disparity);
+            }
+            else {
+                long j = match_slice(m, row_value_r, row_centroid_r, begin, end, value_l, centroid_node_l, d_min, d_max,
+                                     &best_diff);
+                if (j >= 0) {
+                    best_disparity = centroid_node_l - row_centroid_r[j];
+                    found = true;
+                }
+            }
+            if (found) {
+                disp_aux_keep(disp_aux, idx_l, best_diff, best_disparity);
+            }
+        }
+        if (!m->match_right) {
+            continue;
+        }
+        // The left list in order of last column from the right, so the left nodes ending in [a+d_min, b+d_max] are a
+        // slice of it. Their centroids are negated for the kernel, which then gives centroid_l - centroid_r.
+        ulong num_rev = 0;
+        const MaxTreeRun *run_l = runs_l->Runs + runs_l->RowStart[r+1];
+        for (; run_l > runs_l->Runs + runs_l->RowStart[r]; --run_l) {
+            uint n = run_l[-1].Node;
+            if (n!=MAXTREE_NoNode && seen_l[n]==r+1) {
+                seen_l[n] = 0;
+                rev_l[num_rev] = row_l[slot_l[n]];
+                for (int k = 0; k < num_attribs; ++k) {
+                    row_value_l[k*ncols + num_rev] = values_l[k*num_nodes + n];
+                }
+                row_centroid_l[num_rev++] = -centroid_l[n];
+            }
+        }
+        row_bounds(rev_l, num_rev, ncols, true, bound);
+        for (ulong j = 0; j < num_r; ++j) {
+            uint idx_r = row_r[j].node;
+            double best_diff = aux_r->attr_diff[idx_r];
+            double best_disparity = 0.0;
+            bool found = false;
+            ulong lo = row_r[j].first + m->d_min, hi = row_r[j].last + m->d_max;
+            if (lo >= ncols) {
+                continue;
+            }
+            for (int k = 0; k < num_attribs; ++k) {
+                value_r[k] = values_r[k*num_nodes_r + idx_r];
+            }
+            ulong end = bound[lo];
+            ulong begin = (hi < ncols-1) ? bound[hi + 1] : 0;
+            long k = match_slice(m, row_value_l, row_centroid_l, begin, end, value_r, -centroid_r[idx_r], m->d_min,
+                                 m->d_max, &best_diff);
+            if (k >= 0) {
+                best_disparity = -row_centroid_l[k] - centroid_r[idx_r];
+                found = true;
+            }
+            if (found) {
+                disp_aux_keep(aux_r, idx_r, best_diff, best_disparity);
+            }
+        }
+    }
+    free(seen_l);
+    free(seen_r);
+    free(slot_l);
+    free(slot_r);
+    free(list_l);
+    free(row_r);
+    free(row_value_r);
+    free(row_centroid_r);
+    free(sorted_r);
+    free(cand_l);
+    free(bound);
+    free(rev_l);
+    free(row_value_l);
+    free(row_centroid_l);
+    return (st);
+}
+
+void *match_rows_worker(void *arg) {
+    DispJob *job = arg;
+    job->st = match_rows(job->match, job->row_begin, job->row_end, job->aux, job->aux_r);
+    return (NULL);
+}
+
+// Matches the left nodes [m->node_begin, m->node_end) over all rows, split in bands of rows over num_jobs jobs, and
+// combines the matches of the bands into disp_aux, the aux of the first job. The right nodes, when matched, are
+// combined into the aux_r of the first job.
+int match_pass(const DispMatch *m, DispJob *jobs, pthread_t *threads, int num_jobs, DispNodeAux *disp_aux) {
+    int st = 0;
+
+    // A band whose thread can't be started is matched here after the first one
+    for (int j = 1; j < num_jobs; ++j) {
+        jobs[j].started = pthread_create(&threads[j], NULL, match_rows_worker, &jobs[j])==0;
+    }
+    match_rows_worker(&jobs[0]);
+    for (int j = 1; j < num_jobs; ++j) {
+        if (jobs[j].started) {
+            pthread_join(threads[j], NULL);
+        }
+        else {
+            match_rows_worker(&jobs[j]);
+        }
+    }
+    for (int j = 0; j < num_jobs; ++j) {
+        st |= jobs[j].st;
+    }
+    // Later bands only win with a smaller difference, as later rows do in the serial scan
+    for (int j = 1; st==0 && j < num_jobs; ++j) {
+        DispNodeAux *aux = jobs[j].aux;
+        for (ulong n = m->node_begin; n < m->node_end; ++n) {
+            if (aux->attr_diff[n] < disp_aux->attr_diff[n]) {
+                disp_aux->attr_diff[n] = aux->attr_diff[n];
+                disp_aux->disparity[n] = aux->disparity[n];
+            }
+        }
+        if (!m->match_right) {
+            continue;
+        }
+        aux = jobs[j].aux_r;
+        for (ulong n = 0; n < m->num_nodes_r; ++n) {
+            if (aux->attr_diff[n] < jobs[0].aux_r->attr_diff[n]) {
+                jobs[0].aux_r->attr_diff[n] = aux->attr_diff[n];
+                jobs[0].aux_r->disparity[n] = aux->disparity[n];
+            }
+        }
+    }
+    return (st);
+}
+
+// Sets the disparity range of the left nodes [begin, end) for a coarse to fine pass: DispCoarseFineWindow around
+// the disparity of the nearest ancestor matched in an earlier pass (or inheriting one), within [d_min, d_max].
+// Nodes without such an ancestor get all of [d_min, d_max].
+void set_pass_ranges(const MaxTree *mt_l, const DispNodeAux *disp_aux, const bool *anchored, ulong begin, ulong end,
+                     ulong d_min, ulong d_max, uint *node_dmin, uint *node_dmax) {
+    double window = (double) DispCoarseFineWindow;
+    for (ulong n = begin; n < end; ++n) {
+        ulong parent = mt_l->Nodes[n].Parent;
+        // Roots are their own parent: node 0, and more with a template that splits the image
+        if (parent==n) {
+            node_dmin[n] = (uint) d_min;
+            node_dmax[n] = (uint) d_max;
+        }
+        else if (parent >= begin) {
+            // Same pass: the parent's range comes from the same ancestor
+            node_dmin[n] = node_dmin[parent];
+            node_dmax[n] = node_dmax[parent];
+        }
+        else if (anchored[parent]) {
+            double lo = ceil(disp_aux->disparity[parent] - window);
+            double hi = floor(disp_aux->disparity[parent] + window);
+            if (lo < (double) d_min) lo = (double) d_min;
+            if (hi > (double) d_max) hi = (double) d_max;
+            // An empty range leaves the node to take the disparity of its parent
+            node_dmin[n] = (lo > hi) ? 1 : (uint) lo;
+            node_dmax[n] = (lo > hi) ? 0 : (uint) hi;
+        }
+        else {
+            node_dmin[n] = (uint) d_min;
+            node_dmax[n] = (uint) d_max;
+        }
+    }
+}
+
+// Matches nodes instead of pixels, walking the row runs of both trees. On every row, each distinct left node
+// spanning columns [a, b] there is compared once with the distinct right nodes that have a pixel in
+// [a-d_max, b-d_min], the columns its pixels would reach. When that range starts at column 0 and holds many
+// nodes, the best of them is searched in the attribute index of the row instead.
+// A left node keeps the right node with the smallest attribute difference over all rows, among those whose
+// centroid disparity is within [d_min, d_max]; nodes without one take the disparity of their parent. The node
+// disparities are then written to the runs of the left tree.
+// The rows are split in DispNumThreads bands (one per processor if 0), matched in parallel with a DispNodeAux
+// each. Those are combined in band order keeping the earlier band on equal differences, which is what the serial
+// scan keeps, so the output does not depend on the number of threads.
+// With DispCoarseFinePasses above 1 the left nodes are matched coarse to fine, in that many passes over groups
+// of nodes in tree order (parents first). A node then only searches DispCoarseFineWindow pixels around the
+// disparity of its nearest ancestor from an earlier pass, so a smaller window or more passes is faster and relies
+// more on the ancestors. The rows are listed once for all passes, and a pass only visits the rows of its own nodes.
+// With DispPruneArea above 1, nodes of either tree with a smaller area are merged into their nearest ancestor that
+// is not before matching, so the noise-level nodes are never candidates and the matching work follows the nodes kept.
+// The attribute values and centroids of the nodes are read from cache_l and cache_r, which must have an attribute set
+int calc_disp_cached(const MaxTree *mt_l, const MaxTree *mt_r, const ImageGray *img_l, const ImageGray *img_r,
+                     ImageGray *out, const DispNodeCache *cache_l, const DispNodeCache *cache_r, ulong d_min,
+                     ulong d_max) {
+    return (calc_disp_lr_cached(mt_l, mt_r, img_l, img_r, out, NULL, cache_l, cache_r, d_min, d_max));
+}
+
+// calc_disp_cached that also writes the disparity of the right image to out_r, unless it is NULL. The right nodes
+// are matched in the first pass over the rows, on the same row lists as the left ones, and always over all of
+// [d_min, d_max]. Unmatched right nodes take the disparity of their parent too.
+// The search of a right node is the mirror image of that of a left node, and among equal differences the left node
+// ending furthest right wins, which comes first in the mirrored row. So out_r is the disparity calc_disp gives on
+// the mirrored pair, except where the attribute values or centroids of the mirrored trees round differently.
+int calc_disp_lr_cached(const MaxTree *mt_l, const MaxTree *mt_r, const ImageGray *img_l, const ImageGray *img_r,
+                        ImageGray *out, ImageGray *out_r, const DispNodeCache *cache_l, const DispNodeCache *cache_r,
+                        ulong d_min, ulong d_max) {
+    DispNodeAux *disp_aux;
+    DispMatch match;
+    DispJob *jobs = NULL;
+    pthread_t *threads = NULL;
+    uint *node_dmin = NULL, *node_dmax = NULL;
+    bool *anchored = NULL;
+    DispPassLists pass_lists = {NULL, NULL, NULL};
+    ulong nrows = img_l->Height, ncols = img_l->Width;
+    ulong num_nodes = mt_l->NumNodes;
+    int num_jobs = DispNumThreads;
+    int num_passes = DispCoarseFinePasses;
+    int st = 0;
+
+    if (num_jobs < 1) {
+        num_jobs = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    if (num_jobs < 1) {
+        num_jobs = 1;
+    }
+    if ((ulong) num_jobs > nrows) {
+        num_jobs = nrows ? (int) nrows : 1;
+    }
+    if (num_passes < 1) {
+        num_passes = 1;
+    }
+    if ((ulong) num_passes > num_nodes) {
+        num_passes = num_nodes ? (int) num_nodes : 1;
+    }
+    // The ranges are stored per node as uint
+    if (d_max > UINT_MAX) {
+        d_max = UINT_MAX;
+    }
+    disp_aux = DispNodeAuxCreate(num_nodes);
+    if (disp_aux==NULL) {
+        return (-1);
+    }
+    const MaxTreeRuns *runs_l = get_node_runs(mt_l, img_l);
+    const MaxTreeRuns *runs_r = get_node_runs(mt_r, img_r);
+    // Pruned nodes are left out of the runs, their pixels take the disparity of the ancestor they are merged into
+    if (DispPruneArea > 1) {
+        if (runs_l) runs_l = prune_node_runs(mt_l, runs_l);
+        if (runs_r) runs_r = prune_node_runs(mt_r, runs_r);
+    }
+    match.runs_l = runs_l;
+    match.runs_r = runs_r;
+    match.values_l = cache_l->values;
+    match.values_r = cache_r->values;
+    match.centroid_l = cache_l->centroids;
+    match.centroid_r = cache_r->centroids;
+    match.num_nodes_l = num_nodes;
+    match.num_nodes_r = mt_r->NumNodes;
+    match.ncols = ncols;
+    match.d_min = d_min;
+    match.d_max = d_max;
+    match.num_attribs = cache_l->num_attribs;
+    match.weights = cache_l->weights;
+    match.squared = cache_l->squared;
+    match.row_match = RowMatchSelect();
+    match.row_cost = RowMatchCostSelect();
+    match.node_dmin = NULL;
+    match.node_dmax = NULL;
+    match.pass_nodes = NULL;
+    match.pass_node_rows = NULL;
+    match.pass_num = 0;
+    jobs = calloc((size_t) num_jobs, sizeof(DispJob));
+    threads = malloc((size_t) num_jobs*sizeof(pthread_t));
+    if (num_passes > 1) {
+        node_dmin = malloc((num_nodes ? num_nodes : 1)*sizeof(uint));
+        node_dmax = malloc((num_nodes ? num_nodes : 1)*sizeof(uint));
+        anchored = malloc((num_nodes ? num_nodes : 1)*sizeof(bool));
+        if (node_dmin==NULL || node_dmax==NULL || anchored==NULL ||
+            (runs_l && DispPassListsCreate(&pass_lists, runs_l, nrows, ncols, num_nodes, (ulong) num_passes))) {
+            st = -1;
+        }
+    }
+    if (runs_l==NULL || runs_r==NULL || cache_l->values==NULL || cache_r->values==NULL || jobs==NULL ||
+        threads==NULL || cache_l->num_attribs < 1 || cache_l->num_attribs!=cache_r->num_attribs) {
+        st = -1;
+    }
+    // Bands of whole rows, the first ones get the remainder. The first band keeps its matches in disp_aux.
+    ulong rows = 0;
+    for (int j = 0; st==0 && j < num_jobs; ++j) {
+        jobs[j].match = &match;
+        jobs[j].row_begin = rows;
+        rows += nrows/num_jobs + (((ulong) j < nrows%num_jobs) ? 1 : 0);
+        jobs[j].row_end = rows;
+        jobs[j].aux = j ? DispNodeAuxCreate(num_nodes) : disp_aux;
+        jobs[j].aux_r = out_r ? DispNodeAuxCreate(mt_r->NumNodes) : NULL;
+        if (jobs[j].aux==NULL || (out_r && jobs[j].aux_r==NULL)) {
+            st = -1;
+        }
+    }
+    // Groups of nodes in index order, so every pass has its ancestors matched by the earlier ones
+    for (int p = 0; st==0 && p < num_passes; ++p) {
+        match.node_begin = num_nodes*p/num_passes;
+        match.node_end = num_nodes*(p+1)/num_passes;
+        match.match_right = out_r && p==0;
+        if (num_passes > 1) {
+            set_pass_ranges(mt_l, disp_aux, anchored, match.node_begin, match.node_end, d_min, d_max, node_dmin,
+                            node_dmax);
+            match.node_dmin = node_dmin;
+            match.node_dmax = node_dmax;
+            // The right nodes are matched on every row, the left ones of a pass only on their own rows
+            if (!match.match_right) {
+                match.pass_nodes = pass_lists.nodes + pass_lists.start[p];
+                match.pass_node_rows = pass_lists.rows + pass_lists.start[p];
+                match.pass_num = pass_lists.start[p+1] - pass_lists.start[p];
+            }
+        }
+        st = match_pass(&match, jobs, threads, num_jobs, disp_aux);
+        // Parents come before their children, roots are their own parent
+        for (ulong n = match.node_begin; st==0 && n < match.node_end; ++n) {
+            ulong parent = mt_l->Nodes[n].Parent;
+            if (parent!=n && !disp_is_set(disp_aux, n)) {
+                disp_aux->disparity[n] = disp_aux->disparity[parent];
+            }
+            if (anchored) {
+                anchored[n] = disp_is_set(disp_aux, n) || (parent!=n && anchored[parent]);
+            }
+        }
+    }
+    if (st==0) {
+        // Pixels outside the template have no node and stay 0
+        ImageGrayInit(out, (ubyte) 0);
+        for (ulong r = 0; r < nrows; ++r) {
+            const MaxTreeRun *run = runs_l->Runs + runs_l->RowStart[r];
+            const MaxTreeRun *end = runs_l->Runs + runs_l->RowStart[r+1];
+            for (; run < end; ++run) {
+                if (run->Node!=MAXTREE_NoNode) {
+                    memset(out->Pixmap + r*ncols + run->Start, (ubyte) disp_aux->disparity[run->Node], run->Length);
+                }
+            }
+        }
+    }
+    if (st==0 && out_r) {
+        DispNodeAux *aux_r = jobs[0].aux_r;
+        for (ulong n = 1; n < mt_r->NumNodes; ++n) {
+            if (!disp_is_set(aux_r, n)) {
+                aux_r->disparity[n] = aux_r->disparity[mt_r->Nodes[n].Parent];
+            }
+        }
+        ImageGrayInit(out_r, (ubyte) 0);
+        for (ulong r = 0; r < nrows; ++r) {
+            const MaxTreeRun *run = runs_r->Runs + runs_r->RowStart[r];
+            const MaxTreeRun *end = runs_r->Runs + runs_r->RowStart[r+1];
+            for (; run < end; ++run) {
+                if (run->Node!=MAXTREE_NoNode) {
+                    memset(out_r->Pixmap + r*ncols + run->Start, (ubyte) aux_r->disparity[run->Node], run->Length);
+                }
+            }
+        }
+    }
+    for (int j = 0; jobs && j < num_jobs; ++j) {
+        if (j > 0 && jobs[j].aux) DispNodeAuxDelete(jobs[j].aux);
+        if (jobs[j].aux_r) DispNodeAuxDelete(jobs[j].aux_r);
+    }
+    if (runs_l) release_node_runs(mt_l, runs_l);
+    if (runs_r) release_node_runs(mt_r, runs_r);
+    free(jobs);
+    free(threads);
+    free(node_dmin);
+    free(node_dmax);
+    free(anchored);
+    DispPassListsDelete(&pass_lists);
+    DispNodeAuxDelete(disp_aux);
+    return (st);
+}
+
+// calc_disp_cached with caches made for this call only
+int calc_disp(const MaxTree *mt_l, const MaxTree *mt_r, const ImageGray *img_l, const ImageGray *img_r, ImageGray *out,
+              double (*attribute)(void *), double (*centroid)(void *), ulong d_min, ulong d_max) {
+    DispNodeCache *cache_l = DispNodeCacheCreate(mt_l, centroid);
+    DispNodeCache *cache_r = DispNodeCacheCreate(mt_r, centroid);
+    int st = -1;
+
+    if (cache_l && cache_r && DispNodeCacheSetAttribute(cache_l, mt_l, attribute)==0 &&
+        DispNodeCacheSetAttribute(cache_r, mt_r, attribute)==0) {
+        st = calc_disp_cached(mt_l, mt_r, img_l, img_r, out, cache_l, cache_r, d_min, d_max);
+    }
+    if (cache_l) DispNodeCacheDelete(cache_l);
+    if (cache_r) DispNodeCacheDelete(cache_r);
+    return (st);
+}
+
+// An image to read or a tree to build on a thread of its own
+typedef struct PairJob PairJob;
+struct PairJob {
+    char *fname;
+    ImageGray *img, *template;
+    int builder;
+    AttribStruct *aux;  // only the aux data functions are used
+    MaxTree *mt;
+};
+
+void *read_image_worker(void *arg) {
+    PairJob *job = arg;
+    job->img = ImagePGMRead(job->fname);
+    // A file that can't be decoded comes back without pixels
+    if (job->img && job->img->Pixmap==NULL) {
+        free(job->img);
+        job->img = NULL;
+    }
+    return (NULL);
+}
+
+void *create_tree_worker(void *arg) {
+    PairJob *job = arg;
+    job->mt = Builders[job->builder].Create(job->img, job->template, job->aux->NewAuxData, job->aux->AddToAuxData,
+                                            job->aux->MergeAuxData, job->aux->DeleteAuxData);
+    return (NULL);
+}
+
+// Runs worker on both jobs, the right one on a thread of its own. The jobs share no state, so the left and right
+// halves of the pipeline take about the time of one on two processors. Both run here on a single processor, where
+// the second thread only adds switches, or if it can't start.
+void run_pair(void *(*worker)(void *), PairJob *job_l, PairJob *job_r) {
+    pthread_t thread;
+    bool started = sysconf(_SC_NPROCESSORS_ONLN) > 1 && pthread_create(&thread, NULL, worker, job_r)==0;
+    worker(job_l);
+    if (started) {
+        pthread_join(thread, NULL);
+    }
+    else {
+        worker(job_r);
+    }
+}
+
+// Reads the left and right images concurrently. Returns 0 with both images, -1 with neither.
+int read_image_pair(char *fname_l, char *fname_r, ImageGray **img_l, ImageGray **img_r) {
+    PairJob job_l = {.fname = fname_l}, job_r = {.fname = fname_r};
+
+    run_pair(read_image_worker, &job_l, &job_r);
+    if (job_l.img==NULL) {
+        fprintf(stderr, "Can't read src images '%s'\n", fname_l);
+    }
+    if (job_r.img==NULL) {
+        fprintf(stderr, "Can't read src images '%s'\n", fname_r);
+    }
+    if (job_l.img==NULL || job_r.img==NULL) {
+        if (job_l.img) ImageGrayDelete(job_l.img);
+        if (job_r.img) ImageGrayDelete(job_r.img);
+        return (-1);
+    }
+    *img_l = job_l.img;
+    *img_r = job_r.img;
+    return (0);
+}
+
+// Builds the trees of both images concurrently with builder and the aux data functions of aux. Returns 0 with both
+// trees, -1 with neither.
+int create_tree_pair(ImageGray *img_l, ImageGray *img_r, ImageGray *template_l, ImageGray *template_r, int builder,
+                     AttribStruct *aux, MaxTree **mt_l, MaxTree **mt_r) {
+    PairJob job_l = {.img = img_l, .template = template_l, .builder = builder, .aux = aux};
+    PairJob job_r = {.img = img_r, .template = template_r, .builder = builder, .aux = aux};
+
+    run_pair(create_tree_worker, &job_l, &job_r);
+    if (job_l.mt==NULL) {
         fprintf(stderr, "Can't create left Max-tree\n");
-        return(NULL);
     }
-    mt_r = MaxTreeCreate(img_r, template_r, Attribs[attrib].NewAuxData, Attribs[attrib].AddToAuxData, Attribs[attrib].MergeAuxData, Attribs[attrib].DeleteAuxData);
-    if (mt_r==NULL) {
+    if (job_r.mt==NULL) {
         fprintf(stderr, "Can't create right Max-tree\n");
-        MaxTreeDelete(mt_l);
+    }
+    if (job_l.mt==NULL || job_r.mt==NULL) {
+        if (job_l.mt) MaxTreeDelete(job_l.mt);
+        if (job_r.mt) MaxTreeDelete(job_r.mt);
+        return (-1);
+    }
+    *mt_l = job_l.mt;
+    *mt_r = job_r.mt;
+    return (0);
+}
+
+// Left-right consistency check of the disparities of both images: a left pixel at column x with disparity d keeps
+// it if the right pixel at x-d has a disparity within max_diff of d, and a right pixel at x with disparity d if the
+// left pixel at x+d has. Other pixels, occluded or mismatched, are set to 0 in both images, the value the ground
+// truths use for unknown. Returns the number of left pixels set to 0, -1 on error.
+long disp_lr_check(ImageGray *disp_l, ImageGray *disp_r, ulong max_diff) {
+    ulong nrows = disp_l->Height, ncols = disp_l->Width;
+    long num_invalid = 0;
+
+    if (disp_r->Width!=ncols || disp_r->Height!=nrows) {
+        return (-1);
+    }
+    // Both rows are checked against the disparities from before the check
+    ubyte *row_l = malloc((ncols ? ncols : 1)*sizeof(ubyte));
+    ubyte *row_r = malloc((ncols ? ncols : 1)*sizeof(ubyte));
+    if (row_l==NULL || row_r==NULL) {
+        free(row_l);
+        free(row_r);
+        return (-1);
+    }
+    for (ulong r = 0; r < nrows; ++r) {
+        ubyte *pix_l = disp_l->Pixmap + r*ncols, *pix_r = disp_r->Pixmap + r*ncols;
+        memcpy(row_l, pix_l, ncols*sizeof(ubyte));
+        memcpy(row_r, pix_r, ncols*sizeof(ubyte));
+        for (ulong x = 0; x < ncols; ++x) {
+            ulong d = row_l[x];
+            if (d > x || (ulong) abs((int) row_r[x-d] - (int) d) > max_diff) {
+                pix_l[x] = 0;
+                ++num_invalid;
+            }
+            d = row_r[x];
+            if (x+d >= ncols || (ulong) abs((int) row_l[x+d] - (int) d) > max_diff) {
+                pix_r[x] = 0;
+            }
+        }
+    }
+    free(row_l);
+    free(row_r);
+    return (num_invalid);
+}
+
+// Disparities are searched in [d_min, d_max], use d_max >= width for the whole epipolar line
+ImageGray *create_disp_img(ImageGray *img_l, ImageGray *img_r, ImageGray *template_l, ImageGray *template_r, int attrib,
+                           int builder, ulong d_min, ulong d_max) {
+    ImageGray *out, *outs[NUMATTR];
+    MaxTree *mt_l, *mt_r;
+    // The centroids come from inertia data, other attributes get it alongside in a combined tree. The left-right
+    // check is only done there.
+    if (Attribs[attrib].NewAuxData!=NewInertiaData || DispLRMaxDiff >= 0) {
+        if (create_disp_imgs(img_l, img_r, template_l, template_r, 1UL << attrib, builder, d_min, d_max, outs)!=0) {
+            return (NULL);
+        }
+        return (outs[attrib]);
+    }
+    if (create_tree_pair(img_l, img_r, template_l, template_r, builder, &Attribs[attrib], &mt_l, &mt_r)!=0) {
         return(NULL);
     }
 
@@ -171,7 +1231,7 @@ ImageGray *create_disp_img(ImageGray *img_l, ImageGray *img_r, ImageGray *templa
 
 //    Decisions[3].Filter(mt_l, img_l, template_l, out, Attribs[attrib].Attribute, 1.2); // to check how they filer and use the nodes
 
-    int st = calc_disp(mt_l, mt_r, img_l, img_r, out, Attribs[attrib].Attribute);
+    int st = calc_disp(mt_l, mt_r, img_l, img_r, out, Attribs[attrib].Attribute, MeanXAttribute, d_min, d_max);
     if (st!=0) {
         fprintf(stderr, "Error calculating disparity\n");
         MaxTreeDelete(mt_l);
@@ -184,6 +1244,213 @@ ImageGray *create_disp_img(ImageGray *img_l, ImageGray *img_r, ImageGray *templa
     return (out);
 }
 
+// Computes the disparity image of every attribute i with bit i set in mask from a single pair of trees, whose
+// nodes hold the data of all those attributes. outs[i] gets the image of attribute i, NULL for the others.
+// With DispLRMaxDiff >= 0 the right disparities are computed alongside and the images are left-right checked.
+int create_disp_imgs(ImageGray *img_l, ImageGray *img_r, ImageGray *template_l, ImageGray *template_r, ulong mask,
+                     int builder, ulong d_min, ulong d_max, ImageGray **outs) {
+    MaxTree *mt_l, *mt_r;
+    ImageGray *out_r = NULL;
+    int st = 0;
+
+    for (int i = 0; i < NUMATTR; ++i) {
+        outs[i] = NULL;
+    }
+    // The disparity itself needs the mean x position of the nodes
+    if (!MultiAttribSelect(Attribs, mask | (1UL << ATTR_MEANX))) {
+        fprintf(stderr, "Can't combine the selected attributes\n");
+        return (-1);
+    }
+    AttribStruct multi = {"Combined", NewMultiData, DeleteMultiData, AddToMultiData, MergeMultiData, NULL};
+    if (create_tree_pair(img_l, img_r, template_l, template_r, builder, &multi, &mt_l, &mt_r)!=0) {
+        return (-1);
+    }
+    // Kept with the trees, so every attribute matches on the same runs
+    MaxTreeBuildRuns(mt_l, img_l);
+    MaxTreeBuildRuns(mt_r, img_r);
+    // The centroids are computed once for all attributes, the values once per attribute
+    DispNodeCache *cache_l = DispNodeCacheCreate(mt_l, MultiMeanXAttribute);
+    DispNodeCache *cache_r = DispNodeCacheCreate(mt_r, MultiMeanXAttribute);
+    if (cache_l==NULL || cache_r==NULL) {
+        fprintf(stderr, "Can't create node caches\n");
+        st = -1;
+    }
+    if (st==0 && DispLRMaxDiff >= 0) {
+        out_r = ImageGrayCreate(img_r->Width, img_r->Height);
+        if (out_r==NULL) {
+            fprintf(stderr, "Can't create output image\n");
+            st = -1;
+        }
+    }
+    for (int i = 0; i < NUMATTR && st==0; ++i) {
+        if (!(mask & (1UL << i))) {
+            continue;
+        }
+        outs[i] = ImageGrayCreate(img_l->Width, img_l->Height);
+        if (outs[i]==NULL) {
+            fprintf(stderr, "Can't create output image\n");
+            st = -1;
+            break;
+        }
+        if (DispNodeCacheSetAttribute(cache_l, mt_l, MultiAttribFor(&Attribs[i]))!=0 ||
+            DispNodeCacheSetAttribute(cache_r, mt_r, MultiAttribFor(&Attribs[i]))!=0) {
+            fprintf(stderr, "Can't create node caches\n");
+            st = -1;
+            break;
+        }
+        st = calc_disp_lr_cached(mt_l, mt_r, img_l, img_r, outs[i], out_r, cache_l, cache_r, d_min, d_max);
+        if (st==0 && out_r && disp_lr_check(outs[i], out_r, (ulong) DispLRMaxDiff) < 0) {
+            st = -1;
+        }
+        if (st!=0) {
+            fprintf(stderr, "Error calculating disparity\n");
+        }
+    }
+    if (out_r) ImageGrayDelete(out_r);
+    if (cache_l) DispNodeCacheDelete(cache_l);
+    if (cache_r) DispNodeCacheDelete(cache_r);
+    MaxTreeDelete(mt_l);
+    MaxTreeDelete(mt_r);
+    if (st!=0) {
+        for (int i = 0; i < NUMATTR; ++i) {
+            if (outs[i]) {
+                ImageGrayDelete(outs[i]);
+                outs[i] = NULL;
+            }
+        }
+    }
+    return (st);
+}
+
+// Reads a cost from "[l1:|l2:]attrib=weight,attrib=weight,...", e.g. "l1:0=1,12=1,14=1,17=1" for area,
+// elongation, mean Y and lambda-max. Returns 0, or -1 with a message if spec is malformed.
+int parse_disp_cost(const char *spec, DispCost *cost) {
+    const char *c = spec;
+    char *end;
+
+    cost->num_attribs = 0;
+    cost->squared = false;
+    if (strncmp(c, "l1:", 3)==0 || strncmp(c, "l2:", 3)==0) {
+        cost->squared = c[1]=='2';
+        c += 3;
+    }
+    while (*c) {
+        long attrib = strtol(c, &end, 10);
+        if (end==c || *end!='=' || attrib < 0 || attrib >= NUMATTR || cost->num_attribs >= DISP_MAXATTRIBS) {
+            fprintf(stderr, "Bad matching cost '%s'\n", spec);
+            return (-1);
+        }
+        c = end + 1;
+        double weight = strtod(c, &end);
+        if (end==c || weight < 0.0 || (*end!=',' && *end!='\0')) {
+            fprintf(stderr, "Bad matching cost '%s'\n", spec);
+            return (-1);
+        }
+        cost->attribs[cost->num_attribs] = (int) attrib;
+        cost->weights[cost->num_attribs++] = weight;
+        c = (*end==',') ? end + 1 : end;
+    }
+    if (cost->num_attribs==0) {
+        fprintf(stderr, "Bad matching cost '%s'\n", spec);
+        return (-1);
+    }
+    return (0);
+}
+
+// Standard deviation of the finite values of an attribute over the nodes of a cache, 1 if there is no spread
+double attrib_spread(const double *values, ulong num_nodes) {
+    double sum = 0.0, sum2 = 0.0;
+    ulong num = 0;
+    for (ulong n = 0; n < num_nodes; ++n) {
+        if (isfinite(values[n])) {
+            sum += values[n];
+            sum2 += values[n]*values[n];
+            ++num;
+        }
+    }
+    double var = num ? sum2/num - (sum/num)*(sum/num) : 0.0;
+    return ((var > 0.0) ? sqrt(var) : 1.0);
+}
+
+// Fills the caches of a pair of trees holding multi attribute data for all attributes of cost with their values and
+// the weights of cost, scaled by the spread of each attribute over the left tree
+int disp_set_cost(DispNodeCache *cache_l, DispNodeCache *cache_r, const MaxTree *mt_l, const MaxTree *mt_r,
+                  const DispCost *cost) {
+    cache_l->num_attribs = cache_r->num_attribs = 0;
+    for (int k = 0; k < cost->num_attribs; ++k) {
+        double (*attribute)(void *) = MultiAttribFor(&Attribs[cost->attribs[k]]);
+        if (DispNodeCacheAddAttribute(cache_l, mt_l, attribute, 1.0)!=0 ||
+            DispNodeCacheAddAttribute(cache_r, mt_r, attribute, 1.0)!=0) {
+            return (-1);
+        }
+        double spread = attrib_spread(cache_l->values + k*mt_l->NumNodes, mt_l->NumNodes);
+        cache_l->weights[k] = cache_r->weights[k] = cost->weights[k] / (cost->squared ? spread*spread : spread);
+    }
+    cache_l->squared = cache_r->squared = cost->squared;
+    return (0);
+}
+
+// Disparity image matched on the weighted cost over the attributes of cost, from a single pair of trees holding the
+// data of all of them, left-right checked as in create_disp_imgs when DispLRMaxDiff is 0 or more. With DispSGMPaths
+// set the costs are aggregated over the pixels by calc_disp_sgm instead, which gives no right disparity to check.
+ImageGray *create_disp_img_cost(ImageGray *img_l, ImageGray *img_r, ImageGray *template_l, ImageGray *template_r,
+                                const DispCost *cost, int builder, ulong d_min, ulong d_max) {
+    MaxTree *mt_l, *mt_r;
+    ImageGray *out = NULL, *out_r = NULL;
+    ulong mask = 1UL << ATTR_MEANX;
+    int st = 0;
+
+    for (int k = 0; k < cost->num_attribs; ++k) {
+        mask |= 1UL << cost->attribs[k];
+    }
+    if (!MultiAttribSelect(Attribs, mask)) {
+        fprintf(stderr, "Can't combine the selected attributes\n");
+        return (NULL);
+    }
+    AttribStruct multi = {"Combined", NewMultiData, DeleteMultiData, AddToMultiData, MergeMultiData, NULL};
+    if (create_tree_pair(img_l, img_r, template_l, template_r, builder, &multi, &mt_l, &mt_r)!=0) {
+        return (NULL);
+    }
+    MaxTreeBuildRuns(mt_l, img_l);
+    MaxTreeBuildRuns(mt_r, img_r);
+    DispNodeCache *cache_l = DispNodeCacheCreate(mt_l, MultiMeanXAttribute);
+    DispNodeCache *cache_r = DispNodeCacheCreate(mt_r, MultiMeanXAttribute);
+    if (cache_l==NULL || cache_r==NULL || disp_set_cost(cache_l, cache_r, mt_l, mt_r, cost)!=0) {
+        st = -1;
+    }
+    if (st==0) {
+        out = ImageGrayCreate(img_l->Width, img_l->Height);
+        if (out==NULL) {
+            st = -1;
+        }
+        else if (DispSGMPaths > 0) {
+            st = calc_disp_sgm(mt_l, mt_r, img_l, img_r, out, cache_l, cache_r, d_min, d_max);
+        }
+        else if (DispLRMaxDiff >= 0) {
+            out_r = ImageGrayCreate(img_r->Width, img_r->Height);
+            st = (out_r==NULL) ? -1 : calc_disp_lr_cached(mt_l, mt_r, img_l, img_r, out, out_r, cache_l, cache_r,
+                                                          d_min, d_max);
+            if (st==0 && disp_lr_check(out, out_r, (ulong) DispLRMaxDiff) < 0) {
+                st = -1;
+            }
+        }
+        else {
+            st = calc_disp_cached(mt_l, mt_r, img_l, img_r, out, cache_l, cache_r, d_min, d_max);
+        }
+    }
+    if (st!=0) {
+        fprintf(stderr, "Error calculating disparity\n");
+        if (out) ImageGrayDelete(out);
+        out = NULL;
+    }
+    if (out_r) ImageGrayDelete(out_r);
+    if (cache_l) DispNodeCacheDelete(cache_l);
+    if (cache_r) DispNodeCacheDelete(cache_r);
+    MaxTreeDelete(mt_l);
+    MaxTreeDelete(mt_r);
+    return (out);
+}
+
 ImageGray *comp_ground_truth(ImageGray *disp, ImageGray *gt) {
 
     if ((disp->Height != gt->Height) || (disp->Width != gt->Width)) {
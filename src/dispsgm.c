@@ -0,0 +1,395 @@
+//
+// Semi-global aggregation of tree matching costs, streamed row by row.
+// Every path only looks at the pixel before it on the path, which for the paths used here is on the same row or on
+// the row above, so a single pass from the top down aggregates all of them with a row of state per path. The threads
+// step through the rows together: the costs of a row are computed over bands of columns, every path aggregates the
+// row on a thread, and the sums of the paths are reduced to disparities over bands of columns again.
+//
+
+#include "dispsgm.h"
+#include "rowmatch.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+int DispSGMPaths = 0;
+uint DispSGMPenalty1 = 192;
+uint DispSGMPenalty2 = 2048;
+double DispSGMCostScale = 16.0;
+
+// Column offset of the pixel before on every path, and whether that pixel is on the row above
+const int SGMPathDx[SGM_MAXPATHS] = {-1, 1, 0, -1, 1};
+const bool SGMPathUp[SGM_MAXPATHS] = {false, false, true, true, true};
+
+// Barrier of the threads of a run. Its count is only set once the threads are started, until then every thread
+// waits.
+typedef struct SGMBarrier SGMBarrier;
+struct SGMBarrier {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint count;
+    uint waiting;
+    ulong generation;
+};
+
+typedef struct SGMRun SGMRun;
+struct SGMRun {
+    const MaxTreeRuns *runs_l, *runs_r;
+    const DispNodeCache *cache_l, *cache_r;
+    ImageGray *out;
+    ulong ncols, nrows;
+    ulong d_min, num_disp;
+    uint p1, p2;
+    int num_paths, num_threads;
+    uint16_t *cost[2];                // costs of a row, num_disp per pixel, alternating between the rows
+    uint16_t *aggr[SGM_MAXPATHS];     // costs of the row aggregated along every path
+    uint16_t *prev[SGM_MAXPATHS];     // and of the row above, for the paths coming from it
+    uint16_t *min_aggr[SGM_MAXPATHS]; // smallest aggregated cost of every pixel, for the paths coming from above
+    uint16_t *min_prev[SGM_MAXPATHS];
+    SGMBarrier barrier;
+};
+
+typedef struct SGMJob SGMJob;
+struct SGMJob {
+    SGMRun *run;
+    int index;
+    uint *nodes_l, *nodes_r;  // node of every pixel of the current row
+    uint *sums;               // sum over the paths of the aggregated costs of a pixel
+};
+
+void sgm_barrier_wait(SGMBarrier *b) {
+    pthread_mutex_lock(&b->lock);
+    ulong generation = b->generation;
+    if (++b->waiting >= b->count) {
+        b->waiting = 0;
+        ++b->generation;
+        pthread_cond_broadcast(&b->cond);
+    }
+    else {
+        while (generation==b->generation) {
+            pthread_cond_wait(&b->cond, &b->lock);
+        }
+    }
+    pthread_mutex_unlock(&b->lock);
+}
+
+void sgm_row_nodes(const MaxTreeRuns *runs, ulong row, uint *nodes) {
+    const MaxTreeRun *run = runs->Runs + runs->RowStart[row];
+    const MaxTreeRun *end = runs->Runs + runs->RowStart[row+1];
+    for (; run < end; ++run) {
+        for (ulong x = run->Start; x < run->Start + run->Length; ++x) {
+            nodes[x] = run->Node;
+        }
+    }
+}
+
+uint16_t sgm_quantize(double cost, double scale) {
+    double c = cost*scale;
+    // NaN costs compare false and are capped too
+    return ((c < SGM_MAXCOST) ? (uint16_t) (c + 0.5) : SGM_MAXCOST);
+}
+
+// Costs of the pixels [x_begin, x_end) of the current row. Along a run of one left node, pixel x at disparity d
+// looks at the same right pixel as x-1 at d-1, so only the smallest disparity is new.
+void sgm_row_costs(const SGMRun *run, const SGMJob *job, ulong x_begin, ulong x_end, uint16_t *cost) {
+    const DispNodeCache *cache_l = run->cache_l, *cache_r = run->cache_r;
+    ulong num_disp = run->num_disp;
+    double value[DISP_MAXATTRIBS];
+
+    for (ulong x = x_begin; x < x_end; ++x) {
+        uint16_t *c = cost + x*num_disp;
+        uint n = job->nodes_l[x];
+        ulong num_new = num_disp;
+        if (n==MAXTREE_NoNode) {
+            for (ulong k = 0; k < num_disp; ++k) {
+                c[k] = SGM_MAXCOST;
+            }
+            continue;
+        }
+        if (x > x_begin && n==job->nodes_l[x-1]) {
+            memcpy(c + 1, c - num_disp, (num_disp-1)*sizeof(uint16_t));
+            num_new = 1;
+        }
+        for (int a = 0; a < cache_l->num_attribs; ++a) {
+            value[a] = cache_l->values[a*cache_l->num_nodes + n];
+        }
+        uint last = MAXTREE_NoNode;
+        uint16_t last_cost = SGM_MAXCOST;
+        for (ulong k = 0; k < num_new; ++k) {
+            ulong d = run->d_min + k;
+            uint m = (d <= x) ? job->nodes_r[x-d] : MAXTREE_NoNode;
+            if (m!=last && m!=MAXTREE_NoNode) {
+                last_cost = sgm_quantize(RowMatchCost(cache_r->values, cache_r->num_nodes, cache_r->num_attribs,
+                                                      cache_r->weights, cache_r->squared, m, value),
+                                         DispSGMCostScale);
+            }
+            last = m;
+            c[k] = (m!=MAXTREE_NoNode) ? last_cost : SGM_MAXCOST;
+        }
+    }
+}
+
+// First pixel of a path
+uint sgm_path_start(const uint16_t *cost, uint16_t *aggr, ulong num_disp) {
+    uint min = UINT_MAX;
+    for (ulong k = 0; k < num_disp; ++k) {
+        aggr[k] = cost[k];
+        min = (cost[k] < min) ? cost[k] : min;
+    }
+    return (min);
+}
+
+// Aggregated costs of a pixel from those of the pixel before it on the path, whose smallest one is prev_min:
+// cost + min(prev[k], prev[k-1]+p1, prev[k+1]+p1, prev_min+p2) - prev_min, which stays below SGM_MAXCOST+p2.
+// Returns the smallest one.
+uint sgm_path_step(const uint16_t *cost, const uint16_t *prev, uint prev_min, uint16_t *aggr, ulong num_disp,
+                   uint p1, uint p2) {
+    uint jump = prev_min + p2;
+    uint min = UINT_MAX;
+    for (ulong k = 0; k < num_disp; ++k) {
+        uint best = prev[k];
+        uint down = (k > 0) ? prev[k-1] + p1 : jump;
+        uint up = (k+1 < num_disp) ? prev[k+1] + p1 : jump;
+        best = (down < best) ? down : best;
+        best = (up < best) ? up : best;
+        best = (jump < best) ? jump : best;
+        uint a = cost[k] + best - prev_min;
+        aggr[k] = (uint16_t) a;
+        min = (a < min) ? a : min;
+    }
+    return (min);
+}
+
+void sgm_path_row(SGMRun *run, int p, ulong y) {
+    const uint16_t *cost = run->cost[y & 1];
+    ulong ncols = run->ncols, num_disp = run->num_disp;
+    uint16_t *aggr;
+
+    if (SGMPathUp[p]) {
+        // The aggregated costs of the row before become those of the row above
+        uint16_t *swap = run->prev[p];
+        run->prev[p] = run->aggr[p];
+        run->aggr[p] = swap;
+        swap = run->min_prev[p];
+        run->min_prev[p] = run->min_aggr[p];
+        run->min_aggr[p] = swap;
+        aggr = run->aggr[p];
+        for (ulong x = 0; x < ncols; ++x) {
+            long x_prev = (long) x + SGMPathDx[p];
+            uint min;
+            if (y==0 || x_prev < 0 || x_prev >= (long) ncols) {
+                min = sgm_path_start(cost + x*num_disp, aggr + x*num_disp, num_disp);
+            }
+            else {
+                min = sgm_path_step(cost + x*num_disp, run->prev[p] + x_prev*num_disp, run->min_prev[p][x_prev],
+                                    aggr + x*num_disp, num_disp, run->p1, run->p2);
+            }
+            run->min_aggr[p][x] = (uint16_t) min;
+        }
+    }
+    else {
+        aggr = run->aggr[p];
+        ulong x = (SGMPathDx[p] < 0) ? 0 : ncols - 1;
+        uint min = sgm_path_start(cost + x*num_disp, aggr + x*num_disp, num_disp);
+        for (ulong i = 1; i < ncols; ++i) {
+            ulong x_prev = x;
+            x = (SGMPathDx[p] < 0) ? x + 1 : x - 1;
+            min = sgm_path_step(cost + x*num_disp, aggr + x_prev*num_disp, min, aggr + x*num_disp, num_disp,
+                                run->p1, run->p2);
+        }
+    }
+}
+
+// Disparities of the pixels [x_begin, x_end) of the current row, the smallest one among equal sums
+void sgm_row_disparities(const SGMRun *run, const SGMJob *job, ulong y, ulong x_begin, ulong x_end) {
+    ubyte *out = run->out->Pixmap + y*run->ncols;
+    ulong num_disp = run->num_disp;
+    uint *sums = job->sums;
+
+    for (ulong x = x_begin; x < x_end; ++x) {
+        if (job->nodes_l[x]==MAXTREE_NoNode) {
+            out[x] = 0;
+            continue;
+        }
+        const uint16_t *aggr = run->aggr[0] + x*num_disp;
+        for (ulong k = 0; k < num_disp; ++k) {
+            sums[k] = aggr[k];
+        }
+        for (int p = 1; p < run->num_paths; ++p) {
+            aggr = run->aggr[p] + x*num_disp;
+            for (ulong k = 0; k < num_disp; ++k) {
+                sums[k] += aggr[k];
+            }
+        }
+        ulong best_k = 0;
+        for (ulong k = 1; k < num_disp; ++k) {
+            if (sums[k] < sums[best_k]) {
+                best_k = k;
+            }
+        }
+        out[x] = (ubyte) (run->d_min + best_k);
+    }
+}
+
+// Rows of costs a run with num_paths paths keeps, and rows of the smallest aggregated cost per pixel
+void sgm_num_rows(int num_paths, size_t *num_rows, size_t *num_min) {
+    *num_rows = 2 + num_paths;
+    *num_min = 0;
+    for (int p = 0; p < num_paths; ++p) {
+        if (SGMPathUp[p]) {
+            ++*num_rows;
+            *num_min += 2;
+        }
+    }
+}
+
+size_t sgm_working_size(ulong ncols, ulong num_disp, int num_paths, int num_threads) {
+    size_t num_rows, num_min;
+    sgm_num_rows(num_paths, &num_rows, &num_min);
+    return ((num_rows*ncols*num_disp + num_min*ncols)*sizeof(uint16_t) +
+            (size_t) num_threads*(2*ncols + num_disp)*sizeof(uint));
+}
+
+void *sgm_worker(void *arg) {
+    SGMJob *job = arg;
+    SGMRun *run = job->run;
+
+    // Until the number of threads is known
+    sgm_barrier_wait(&run->barrier);
+    ulong x_begin = run->ncols*job->index/run->num_threads;
+    ulong x_end = run->ncols*(job->index+1)/run->num_threads;
+    for (ulong y = 0; y < run->nrows; ++y) {
+        sgm_row_nodes(run->runs_l, y, job->nodes_l);
+        sgm_row_nodes(run->runs_r, y, job->nodes_r);
+        // The other cost row may still be read by the paths of the row before, but they are done with this one
+        sgm_row_costs(run, job, x_begin, x_end, run->cost[y & 1]);
+        sgm_barrier_wait(&run->barrier);
+        for (int p = job->index; p < run->num_paths; p += run->num_threads) {
+            sgm_path_row(run, p, y);
+        }
+        sgm_barrier_wait(&run->barrier);
+        sgm_row_disparities(run, job, y, x_begin, x_end);
+    }
+    return (NULL);
+}
+
+int calc_disp_sgm(const MaxTree *mt_l, const MaxTree *mt_r, const ImageGray *img_l, const ImageGray *img_r,
+                  ImageGray *out, const DispNodeCache *cache_l, const DispNodeCache *cache_r, ulong d_min,
+                  ulong d_max) {
+    SGMRun run;
+    SGMJob jobs[SGM_MAXPATHS];
+    pthread_t threads[SGM_MAXPATHS];
+    uint16_t *rows = NULL;
+    uint *job_mem = NULL;
+    ulong ncols = img_l->Width, nrows = img_l->Height;
+    int num_started = 0;
+    int st = 0;
+
+    memset(out->Pixmap, 0, ncols*nrows*sizeof(ubyte));
+    if (ncols==0 || nrows==0) {
+        return (0);
+    }
+    if (d_max >= ncols) {
+        d_max = ncols - 1;
+    }
+    if (d_max > SGM_MAXDISP) {
+        d_max = SGM_MAXDISP;
+    }
+    // No pixel can have a disparity in range
+    if (d_min > d_max) {
+        return (0);
+    }
+    memset(&run, 0, sizeof(run));
+    run.cache_l = cache_l;
+    run.cache_r = cache_r;
+    run.out = out;
+    run.ncols = ncols;
+    run.nrows = nrows;
+    run.d_min = d_min;
+    run.num_disp = d_max - d_min + 1;
+    run.num_paths = DispSGMPaths;
+    if (run.num_paths < 1) {
+        run.num_paths = 1;
+    }
+    if (run.num_paths > SGM_MAXPATHS) {
+        run.num_paths = SGM_MAXPATHS;
+    }
+    // Aggregated costs stay below SGM_MAXCOST+p2, and a step of one is never dearer than a jump
+    run.p2 = (DispSGMPenalty2 < UINT16_MAX - SGM_MAXCOST) ? DispSGMPenalty2 : UINT16_MAX - SGM_MAXCOST;
+    run.p1 = (DispSGMPenalty1 < run.p2) ? DispSGMPenalty1 : run.p2;
+    int num_threads = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? run.num_paths : 1;
+
+    run.runs_l = get_node_runs(mt_l, img_l);
+    run.runs_r = get_node_runs(mt_r, img_r);
+    if (DispPruneArea > 1) {
+        if (run.runs_l) run.runs_l = prune_node_runs(mt_l, run.runs_l);
+        if (run.runs_r) run.runs_r = prune_node_runs(mt_r, run.runs_r);
+    }
+    size_t row_size = ncols*run.num_disp, num_rows, num_min;
+    sgm_num_rows(run.num_paths, &num_rows, &num_min);
+    if (run.runs_l && run.runs_r) {
+        rows = malloc((num_rows*row_size + num_min*ncols)*sizeof(uint16_t));
+        job_mem = malloc((size_t) num_threads*(2*ncols + run.num_disp)*sizeof(uint));
+    }
+    if (rows==NULL || job_mem==NULL) {
+        st = -1;
+    }
+    if (st==0) {
+        uint16_t *next = rows;
+        run.cost[0] = next;
+        run.cost[1] = next + row_size;
+        next += 2*row_size;
+        for (int p = 0; p < run.num_paths; ++p) {
+            run.aggr[p] = next;
+            next += row_size;
+            if (SGMPathUp[p]) {
+                run.prev[p] = next;
+                next += row_size;
+            }
+        }
+        for (int p = 0; p < run.num_paths; ++p) {
+            if (SGMPathUp[p]) {
+                run.min_aggr[p] = next;
+                run.min_prev[p] = next + ncols;
+                next += 2*ncols;
+            }
+        }
+        for (int j = 0; j < num_threads; ++j) {
+            uint *mem = job_mem + j*(2*ncols + run.num_disp);
+            jobs[j].run = &run;
+            jobs[j].index = j;
+            jobs[j].nodes_l = mem;
+            jobs[j].nodes_r = mem + ncols;
+            jobs[j].sums = mem + 2*ncols;
+        }
+
+        pthread_mutex_init(&run.barrier.lock, NULL);
+        pthread_cond_init(&run.barrier.cond, NULL);
+        run.barrier.count = UINT_MAX;
+        // Threads that can't be started leave their share to the ones that could
+        for (int j = 1; j < num_threads; ++j) {
+            if (pthread_create(&threads[j], NULL, sgm_worker, &jobs[j])!=0) {
+                break;
+            }
+            ++num_started;
+        }
+        pthread_mutex_lock(&run.barrier.lock);
+        run.num_threads = num_started + 1;
+        run.barrier.count = (uint) run.num_threads;
+        pthread_mutex_unlock(&run.barrier.lock);
+        sgm_worker(&jobs[0]);
+        for (int j = 1; j <= num_started; ++j) {
+            pthread_join(threads[j], NULL);
+        }
+        pthread_cond_destroy(&run.barrier.cond);
+        pthread_mutex_destroy(&run.barrier.lock);
+    }
+
+    free(rows);
+    free(job_mem);
+    if (run.runs_l) release_node_runs(mt_l, run.runs_l);
+    if (run.runs_r) release_node_runs(mt_r, run.runs_r);
+    return (st);
+}
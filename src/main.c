@@ -4,6 +4,7 @@
 
 #include "maxtree3b.h"
 #include "calculatedisp.h"
+#include "dispsgm.h"
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -104,17 +105,47 @@ int main(int argc, char *argv[]) {
      * will be slightly faster because the string does not have to be copied*/
 //    double lambda;
     int attrib = 12;// , decision=3; if we decide to filter tree
+    int builder = 0; // 0 - Flooding, 1 - Union-find, 2 - Parallel strips
 //    lambda = 2;// atof(argv[3]);
+    ulong d_min = 0, d_max = 0; // disparity search range, d_max = 0 searches the whole row
 
-    img_l = ImagePGMRead(img_l_fname);
-    if (img_l==NULL) {
-        fprintf(stderr, "Can't read src images '%s'\n", img_l_fname);
+    if (argc>=2 && strcmp(argv[1], "-h")==0) {
+        printf("Usage: %s [d_min] [d_max] [lr max diff] [min area] [cost] [sgm paths] [builder]\n", argv[0]);
+        printf("Searches disparities in [d_min, d_max] pixels, the whole row if d_max is 0 (default)\n");
+        printf("With lr max diff >= 0 pixels failing the left-right check by more than it are set to 0\n");
+        printf("Nodes with an area below min area are merged into their parents before matching\n");
+        printf("cost matches on weighted attributes instead of attribute %d, e.g. l1:0=1,12=1,14=1,17=1,\n", attrib);
+        printf("or - to keep attribute %d\n", attrib);
+        printf("With sgm paths > 0 the costs are aggregated along up to %d paths over the pixels instead,\n",
+               SGM_MAXPATHS);
+        printf("over %d disparities from d_min if d_max is 0 and at most up to %d\n", SGM_DEFAULTDISP, SGM_MAXDISP);
+        printf("builder is the max-tree builder:\n");
+        for (int b = 0; b < NUMBUILDERS; b++) {
+            printf("\t%d - %s%s\n", b, Builders[b].Name, (b==builder) ? " (default)" : "");
+        }
+        return (0);
+    }
+    if (argc>=2)  d_min = strtoul(argv[1], NULL, 10);
+    if (argc>=3)  d_max = strtoul(argv[2], NULL, 10);
+    if (argc>=4)  DispLRMaxDiff = atol(argv[3]);
+    if (argc>=5)  DispPruneArea = strtoul(argv[4], NULL, 10);
+    DispCost cost = {1, {attrib}, {1.0}, false};
+    bool use_cost = argc>=6 && strcmp(argv[5], "-")!=0;
+    if (use_cost && parse_disp_cost(argv[5], &cost)!=0) {
         return(-1);
     }
-    img_r = ImagePGMRead(img_r_fname);
-    if (img_r==NULL) {
-        fprintf(stderr, "Can't read src images '%s'\n", img_r_fname);
-        ImageGrayDelete(img_l);
+    if (argc>=7)  DispSGMPaths = atoi(argv[6]);
+    if (argc>=8) {
+        char *end;
+        builder = (int) strtol(argv[7], &end, 10);
+        if (end==argv[7] || *end!='\0' || builder < 0 || builder >= NUMBUILDERS) {
+            fprintf(stderr, "Bad builder '%s', use 0 to %d\n", argv[7], NUMBUILDERS-1);
+            return(-1);
+        }
+    }
+
+    // Both images are decoded at the same time
+    if (read_image_pair(img_l_fname, img_r_fname, &img_l, &img_r)!=0) {
         return(-1);
     }
 
@@ -133,7 +164,30 @@ int main(int argc, char *argv[]) {
         return(-1);
     }
 
-    disp = create_disp_img(img_l, img_r, template_l, template_r, attrib);
+    bool sgm = argc>=6 && DispSGMPaths > 0;
+    if (d_max==0) {
+        d_max = sgm ? d_min + SGM_DEFAULTDISP - 1 : img_l->Width;
+    }
+    if (sgm && d_max > SGM_MAXDISP) {
+        d_max = SGM_MAXDISP;
+    }
+    if (d_min > d_max) {
+        fprintf(stderr, "Empty disparity range [%lu, %lu]\n", d_min, d_max);
+        ImageGrayDelete(img_l);
+        ImageGrayDelete(img_r);
+        ImageGrayDelete(template_l);
+        ImageGrayDelete(template_r);
+        return(-1);
+    }
+    if (use_cost || sgm) {
+        if (sgm && DispLRMaxDiff >= 0) {
+            fprintf(stderr, "The left-right check is not done on semi-global disparities, lr max diff is ignored\n");
+        }
+        disp = create_disp_img_cost(img_l, img_r, template_l, template_r, &cost, builder, d_min, d_max);
+    }
+    else {
+        disp = create_disp_img(img_l, img_r, template_l, template_r, attrib, builder, d_min, d_max);
+    }
     if (disp==NULL) {
         fprintf(stderr, "Can't create output image\n");
         ImageGrayDelete(img_l);
@@ -0,0 +1,497 @@
+/* maxtree16.c
+ * Max-tree of gray-scale images with more than 8 bits per pixel (12-bit
+ * sensor data, 16-bit disparity maps).
+ *
+ * The 8-bit builders index NumPixelsBelowLevel, NumNodesAtLevel and the
+ * hierarchical queue by gray level, which does not scale to 65536 levels.
+ * This builder sorts the pixels with a two-pass radix sort on bytes and
+ * links them with the union-find of [1,2]. The nodes are numbered in order
+ * of increasing level, so the filters visit parents before children by
+ * walking the node array forwards, and children before parents by walking
+ * it backwards. Memory is linear in the number of pixels, independent of
+ * the bit depth.
+ *
+ * [1] C. Berger and T. Geraud and R. Levillain and N. Widynski and
+ *     A. Baillard and E. Bertin.
+ *     Effective Component Tree Computation with Application to Pattern
+ *     Recognition in Astronomical Imaging.
+ *     Proceedings of the ICIP 2007, Vol.4, Pages 41-44, 2007.
+ * [2] L. Najman and M. Couprie.
+ *     Building the component tree in quasi-linear time.
+ *     IEEE Transactions on Image Processing,
+ *     Vol.15, No.11, Pages 3531-3539, 2006.
+ */
+
+#include "maxtree16.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <FreeImage.h>
+
+FIBITMAP *GenericLoader(const char *lpszPathName, int flag);
+
+Decision16Struct Decisions16[NUMDECISIONS] =
+{
+   {"Min", MaxTree16FilterMin},
+   {"Direct", MaxTree16FilterDirect},
+   {"Max", MaxTree16FilterMax},
+   {"Subtractive", MaxTree16FilterSubtractive},
+};
+
+
+
+/****** Image create/read/write functions ******************************/
+
+ImageGray16 *ImageGray16Create(ulong width, ulong height)
+{
+   ImageGray16 *img;
+
+   img = malloc(sizeof(ImageGray16));
+   if (img==NULL)  return(NULL);
+   img->Width = width;
+   img->Height = height;
+   img->Pixmap = malloc(width*height*sizeof(ushort));
+   if (img->Pixmap==NULL)
+   {
+      free(img);
+      return(NULL);
+   }
+   return(img);
+} /* ImageGray16Create */
+
+
+
+void ImageGray16Delete(ImageGray16 *img)
+{
+   free(img->Pixmap);
+   free(img);
+} /* ImageGray16Delete */
+
+
+
+ImageGray16 *ImageGray16Read(char *fname)
+/* Reads 8-bit and 16-bit (FIT_UINT16) gray-scale images of any format
+ * FreeImage supports */
+{
+   FIBITMAP *dib;
+   ImageGray16 *img;
+   BYTE *bits;
+   WORD *words;
+   ulong width, height, x, y, i=0;
+
+   dib = GenericLoader(fname, 0);
+   if (dib==NULL)  return(NULL);
+   width = FreeImage_GetWidth(dib);
+   height = FreeImage_GetHeight(dib);
+   if ((FreeImage_GetImageType(dib)==FIT_UINT16) || (FreeImage_GetBPP(dib)==8))
+      img = ImageGray16Create(width, height);
+   else
+   {
+      fprintf(stderr, "Unsupported format of '%s': %u bits per pixel\n", fname, FreeImage_GetBPP(dib));
+      img = NULL;
+   }
+   if (img==NULL)
+   {
+      FreeImage_Unload(dib);
+      return(NULL);
+   }
+   for (y=0; y<height; y++)
+   {
+      bits = FreeImage_GetScanLine(dib, height-y-1);
+      words = (WORD *)bits;
+      if (FreeImage_GetImageType(dib)==FIT_UINT16)
+         for (x=0; x<width; x++, i++)  img->Pixmap[i] = words[x];
+      else
+         for (x=0; x<width; x++, i++)  img->Pixmap[i] = bits[x];
+   }
+   FreeImage_Unload(dib);
+   return(img);
+} /* ImageGray16Read */
+
+
+
+int ImagePGM16BinWrite(ImageGray16 *img, char *fname)
+/* Writes a raw PGM with maxval 65535, most significant byte first */
+{
+   FILE *outfile;
+   ubyte *row;
+   ulong x, y;
+
+   outfile = fopen(fname, "wb");
+   if (outfile==NULL)  return(-1);
+   row = malloc(2*(img->Width));
+   if (row==NULL)
+   {
+      fclose(outfile);
+      return(-1);
+   }
+   fprintf(outfile, "P5\n%ld %ld\n65535\n", img->Width, img->Height);
+   for (y=0; y<img->Height; y++)
+   {
+      for (x=0; x<img->Width; x++)
+      {
+         row[2*x] = img->Pixmap[y*(img->Width)+x] >> 8;
+         row[2*x+1] = img->Pixmap[y*(img->Width)+x] & 0xff;
+      }
+      fwrite(row, 1, 2*(img->Width), outfile);
+   }
+   free(row);
+   fclose(outfile);
+   return(0);
+} /* ImagePGM16BinWrite */
+
+
+
+/****** Max-tree construction ******************************/
+
+bool MaxTree16SupportsAttrib(AttribStruct *attrib)
+{
+   return((attrib->NewAuxData==NewAreaData) || (attrib->NewAuxData==NewEnclRectData) ||
+          (attrib->NewAuxData==NewInertiaData));
+} /* MaxTree16SupportsAttrib */
+
+
+
+void MaxTree16SortPixels(ImageGray16 *img, ubyte *shape, ulong *sorted, ulong *tmp,
+                         ulong *numsorted)
+/* Stable radix sort of the pixels inside shape on increasing gray level,
+ * first on the low byte into tmp, then on the high byte into sorted */
+{
+   ulong first[256];
+   ushort *pixmap = img->Pixmap;
+   ulong imgsize, p, i, n=0, count;
+   int b;
+
+   imgsize = (img->Width)*(img->Height);
+   bzero(first, 256*sizeof(ulong));
+   for (p=0; p<imgsize; p++)
+   {
+      if (shape[p])  first[pixmap[p] & 0xff]++;
+   }
+   for (b=0; b<256; b++)
+   {
+      count = first[b];
+      first[b] = n;
+      n += count;
+   }
+   for (p=0; p<imgsize; p++)
+   {
+      if (shape[p])  tmp[first[pixmap[p] & 0xff]++] = p;
+   }
+   *numsorted = n;
+   bzero(first, 256*sizeof(ulong));
+   for (i=0; i<n; i++)  first[pixmap[tmp[i]] >> 8]++;
+   for (b=0, n=0; b<256; b++)
+   {
+      count = first[b];
+      first[b] = n;
+      n += count;
+   }
+   for (i=0; i<n; i++)  sorted[first[pixmap[tmp[i]] >> 8]++] = tmp[i];
+} /* MaxTree16SortPixels */
+
+
+
+void MaxTree16BuildParents(ImageGray16 *img, ubyte *shape, ulong *sorted, ulong numsorted,
+                           ulong *parent, ulong *zpar, ulong *repr, ubyte *rank)
+/* Same as UFBuildParents for 16-bit gray levels */
+{
+   ulong neighbors[CONNECTIVITY];
+   ushort *pixmap = img->Pixmap;
+   ulong imgwidth, imgsize, i, p, q, zp, zq;
+   int numneighbors, j;
+
+   imgwidth = img->Width;
+   imgsize = imgwidth * (img->Height);
+   for (p=0; p<imgsize; p++)  zpar[p] = UF_Unprocessed;
+   for (i=numsorted; i-->0; )
+   {
+      p = sorted[i];
+      parent[p] = zpar[p] = repr[p] = zp = p;
+      rank[p] = 0;
+      numneighbors = GetNeighbors(shape, imgwidth, imgsize, p, neighbors);
+      for (j=0; j<numneighbors; j++)
+      {
+         q = neighbors[j];
+         if (zpar[q]!=UF_Unprocessed)
+         {
+            zq = UFFindRoot(zpar, q);
+            if (zq!=zp)
+            {
+               parent[repr[zq]] = p;
+               if (rank[zp]<rank[zq])
+               {
+                  zpar[zp] = zq;
+                  zp = zq;
+               }
+               else
+               {
+                  zpar[zq] = zp;
+                  if (rank[zp]==rank[zq])  rank[zp]++;
+               }
+               repr[zp] = p;
+            }
+         }
+      }
+   }
+   for (i=0; i<numsorted; i++)
+   {
+      p = sorted[i];
+      q = parent[p];
+      if (pixmap[parent[q]]==pixmap[q])  parent[p] = parent[q];
+   }
+} /* MaxTree16BuildParents */
+
+
+
+int MaxTree16FromParents(MaxTree16 *mt, ImageGray16 *img, ubyte *shape,
+                         ulong *sorted, ulong numsorted, ulong *parent)
+/* Numbers the canonical pixels in sorted order, which is the order of
+ * increasing level, and gathers the area and attributes of the nodes */
+{
+   ulong neighbors[CONNECTIVITY];
+   ushort *pixmap = img->Pixmap;
+   MaxNode16 *node, *nodes;
+   ulong imgwidth, imgsize, i, p, q;
+   void **attr;
+   int numneighbors;
+
+   imgwidth = img->Width;
+   imgsize = imgwidth * (img->Height);
+   mt->NumNodes = 0;
+   for (i=0; i<numsorted; i++)
+   {
+      p = sorted[i];
+      q = parent[p];
+      if ((q==p) || (pixmap[q]!=pixmap[p]))
+      {
+         node = mt->Nodes + mt->NumNodes;
+         node->Parent = (q==p) ? mt->NumNodes : mt->NodeOf[q];
+         node->Level = pixmap[p];
+         mt->NodeOf[p] = mt->NumNodes++;
+      }
+      else  mt->NodeOf[p] = mt->NodeOf[q];
+   }
+   nodes = realloc(mt->Nodes, (mt->NumNodes ? mt->NumNodes : 1)*sizeof(MaxNode16));
+   if (nodes)  mt->Nodes = nodes;
+   mt->Attributes = calloc((size_t)(mt->NumNodes ? mt->NumNodes : 1), sizeof(void *));
+   if (mt->Attributes==NULL)  return(-1);
+   for (p=0; p<imgsize; p++)
+   {
+      if (shape[p])
+      {
+         attr = mt->Attributes + mt->NodeOf[p];
+         numneighbors = GetNeighbors(shape, imgwidth, imgsize, p, neighbors);
+         if (*attr)  mt->AddToAuxData(*attr, p%imgwidth, p/imgwidth, numneighbors, neighbors, NULL);
+         else
+         {
+            *attr = mt->NewAuxData(p%imgwidth, p/imgwidth, numneighbors, neighbors, NULL);
+            if (*attr==NULL)  return(-1);
+         }
+         mt->Nodes[mt->NodeOf[p]].Area++;
+      }
+      else  mt->NodeOf[p] = UF_Unprocessed;
+   }
+   for (i=mt->NumNodes; i-->0; )
+   {
+      node = mt->Nodes + i;
+      if (node->Parent!=i)
+      {
+         mt->Nodes[node->Parent].Area += node->Area;
+         mt->MergeAuxData(mt->Attributes[node->Parent], mt->Attributes[i]);
+      }
+   }
+   return(0);
+} /* MaxTree16FromParents */
+
+
+
+MaxTree16 *MaxTree16Create(ImageGray16 *img, ImageGray *template,
+                           void *(*newauxdata)(ulong, ulong, int, ulong *, ImageGray *),
+                           void (*addtoauxdata)(void *, ulong, ulong, int, ulong *, ImageGray *),
+                           void (*mergeauxdata)(void *, void *),
+                           void (*deleteauxdata)(void *))
+{
+   MaxTree16 *mt;
+   ulong *sorted, *parent, *zpar;
+   ubyte *rank;
+   ulong imgsize, numsorted;
+   int r;
+
+   imgsize = (img->Width)*(img->Height);
+   /* Node indices and areas are 32-bit */
+   if (imgsize>UINT_MAX)  return(NULL);
+   mt = calloc(1, sizeof(MaxTree16));
+   if (mt==NULL)  return(NULL);
+   mt->NewAuxData = newauxdata;
+   mt->AddToAuxData = addtoauxdata;
+   mt->MergeAuxData = mergeauxdata;
+   mt->DeleteAuxData = deleteauxdata;
+   mt->NodeOf = malloc(imgsize*sizeof(ulong));
+   mt->Nodes = calloc((size_t)(imgsize ? imgsize : 1), sizeof(MaxNode16));
+   sorted = malloc(imgsize*sizeof(ulong));
+   parent = malloc(imgsize*sizeof(ulong));
+   zpar = malloc(imgsize*sizeof(ulong));
+   rank = malloc(imgsize*sizeof(ubyte));
+   if ((mt->NodeOf==NULL) || (mt->Nodes==NULL) || (sorted==NULL) || (parent==NULL) ||
+       (zpar==NULL) || (rank==NULL))
+   {
+      free(rank);
+      free(zpar);
+      free(parent);
+      free(sorted);
+      MaxTree16Delete(mt);
+      return(NULL);
+   }
+   /* zpar doubles as the buffer of the first radix pass, NodeOf as repr */
+   MaxTree16SortPixels(img, template->Pixmap, sorted, zpar, &numsorted);
+   MaxTree16BuildParents(img, template->Pixmap, sorted, numsorted, parent, zpar,
+                         mt->NodeOf, rank);
+   free(rank);
+   free(zpar);
+   AuxArenaBegin(&(mt->Arena), imgsize);
+   r = MaxTree16FromParents(mt, img, template->Pixmap, sorted, numsorted, parent);
+   AuxArenaEnd();
+   free(parent);
+   free(sorted);
+   if (r)
+   {
+      MaxTree16Delete(mt);
+      return(NULL);
+   }
+   return(mt);
+} /* MaxTree16Create */
+
+
+
+void MaxTree16Delete(MaxTree16 *mt)
+{
+   ulong i;
+
+   if (mt->Arena)  AuxArenaDelete(mt->Arena);
+   else if (mt->Attributes)
+   {
+      for (i=0; i<mt->NumNodes; i++)
+      {
+         if (mt->Attributes[i])  mt->DeleteAuxData(mt->Attributes[i]);
+      }
+   }
+   free(mt->Attributes);
+   free(mt->Nodes);
+   free(mt->NodeOf);
+   free(mt);
+} /* MaxTree16Delete */
+
+
+
+/****** Filters ******************************/
+
+void MaxTree16WriteLevels(MaxTree16 *mt, ImageGray16 *img, ImageGray *template,
+                          ImageGray16 *out)
+{
+   ubyte *shape = template->Pixmap;
+   ulong i;
+
+   for (i=0; i<(img->Width)*(img->Height); i++)
+   {
+      if (shape[i])  out->Pixmap[i] = mt->Nodes[mt->NodeOf[i]].NewLevel;
+   }
+} /* MaxTree16WriteLevels */
+
+
+
+void MaxTree16FilterMin(MaxTree16 *mt, ImageGray16 *img, ImageGray *template,
+                        ImageGray16 *out, double (*attribute)(void *),
+                        double lambda)
+{
+   MaxNode16 *node, *parnode;
+   ulong i;
+
+   for (i=0; i<mt->NumNodes; i++)
+   {
+      node = &(mt->Nodes[i]);
+      if (node->Parent!=i)
+      {
+         parnode = &(mt->Nodes[node->Parent]);
+         if (((*attribute)(mt->Attributes[i]) < lambda) || (parnode->Level!=parnode->NewLevel))
+         {
+            node->NewLevel = parnode->NewLevel;
+         } else  node->NewLevel = node->Level;
+      }
+   }
+   MaxTree16WriteLevels(mt, img, template, out);
+} /* MaxTree16FilterMin */
+
+
+
+void MaxTree16FilterDirect(MaxTree16 *mt, ImageGray16 *img, ImageGray *template,
+                           ImageGray16 *out, double (*attribute)(void *),
+                           double lambda)
+{
+   MaxNode16 *node;
+   ulong i;
+
+   for (i=0; i<mt->NumNodes; i++)
+   {
+      node = &(mt->Nodes[i]);
+      if (node->Parent!=i)
+      {
+         if ((*attribute)(mt->Attributes[i]) < lambda)  node->NewLevel = mt->Nodes[node->Parent].NewLevel;
+         else  node->NewLevel = node->Level;
+      }
+   }
+   MaxTree16WriteLevels(mt, img, template, out);
+} /* MaxTree16FilterDirect */
+
+
+
+void MaxTree16FilterMax(MaxTree16 *mt, ImageGray16 *img, ImageGray *template,
+                        ImageGray16 *out, double (*attribute)(void *),
+                        double lambda)
+{
+   MaxNode16 *node;
+   ulong i;
+
+   for (i=0; i<mt->NumNodes; i++)
+   {
+      node = &(mt->Nodes[i]);
+      if (node->Parent!=i)
+      {
+         if ((*attribute)(mt->Attributes[i]) < lambda)  node->NewLevel = mt->Nodes[node->Parent].NewLevel;
+         else  node->NewLevel = node->Level;
+      }
+   }
+   for (i=mt->NumNodes; i-->0; )
+   {
+      node = &(mt->Nodes[i]);
+      if ((node->Parent!=i) && (node->NewLevel==node->Level))
+      {
+         mt->Nodes[node->Parent].NewLevel = mt->Nodes[node->Parent].Level;
+      }
+   }
+   MaxTree16WriteLevels(mt, img, template, out);
+} /* MaxTree16FilterMax */
+
+
+
+void MaxTree16FilterSubtractive(MaxTree16 *mt, ImageGray16 *img, ImageGray *template,
+                                ImageGray16 *out, double (*attribute)(void *),
+                                double lambda)
+{
+   MaxNode16 *node, *parnode;
+   ulong i;
+
+   for (i=0; i<mt->NumNodes; i++)
+   {
+      node = &(mt->Nodes[i]);
+      if (node->Parent!=i)
+      {
+         parnode = &(mt->Nodes[node->Parent]);
+         if ((*attribute)(mt->Attributes[i]) < lambda)  node->NewLevel = parnode->NewLevel;
+         else  node->NewLevel = ((long)(node->Level)) + ((long)(parnode->NewLevel)) - ((long)(parnode->Level));
+      }
+   }
+   MaxTree16WriteLevels(mt, img, template, out);
+} /* MaxTree16FilterSubtractive */
@@ -27,21 +27,40 @@
  *     Connected Rotation-Invariant Size-Shape Granulometries.
  *     Proceedings of the 17th Int. Conf. Pat. Rec.,
  *     Vol.1, Pages 688-691, 2004.
+ * [5] C. Berger and T. Geraud and R. Levillain and N. Widynski and
+ *     A. Baillard and E. Bertin.
+ *     Effective Component Tree Computation with Application to Pattern
+ *     Recognition in Astronomical Imaging.
+ *     Proceedings of the ICIP 2007, Vol.4, Pages 41-44, 2007.
+ * [6] L. Najman and M. Couprie.
+ *     Building the component tree in quasi-linear time.
+ *     IEEE Transactions on Image Processing,
+ *     Vol.15, No.11, Pages 3531-3539, 2006.
+ * [7] M. H. F. Wilkinson and H. Gao and W. H. Hesselink and J. E. Jonker
+ *     and A. Meijster.
+ *     Concurrent Computation of Attribute Filters on Shared Memory
+ *     Parallel Machines.
+ *     IEEE Transactions on Pattern Analysis and Machine Intelligence,
+ *     Vol.30, No.10, Pages 1800-1813, 2008.
  */
 
 #include "maxtree3b.h"
 #include <math.h>
+#include <limits.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <strings.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <stdatomic.h>
 #include <FreeImage.h>
 
 
 
-#define CONNECTIVITY  4
 #define PI 3.14159265358979323846
 
 #define MIN(a,b)  ((a<=b) ? (a) : (b))
@@ -74,6 +93,196 @@ void MaxTreeDelete(MaxTree *mt);
 
 
 
+/****** Arena allocation of attribute data ******************************/
+
+bool MaxTreeUseArena = true;
+
+/* Chunks of an arena form a list; the first one is the one allocated from.
+ * The data of a chunk follow its header. Every live chunk of every arena is
+ * also on the LiveNext/LivePrev list, so a record can be told from a malloc
+ * whichever thread frees it. */
+struct AuxArena
+{
+   AuxArena *Next;
+   AuxArena *LiveNext, *LivePrev;
+   size_t Capacity;
+   size_t Used;
+};
+
+#define AUXARENA_ALIGN     sizeof(double)
+#define AUXARENA_MAXCHUNK  ((size_t)1 << 26)
+
+/* Arena the New*Data functions of this thread allocate from, and the
+ * number of pixels of the image, set by the builders */
+static _Thread_local AuxArena **AuxArenaCurrent;
+static _Thread_local ulong AuxArenaNumPixels;
+static atomic_ulong AuxDataNumMallocs;
+static AuxArena *AuxArenaLive = NULL;
+static atomic_ulong AuxArenaNumLive;
+static pthread_mutex_t AuxArenaLiveLock = PTHREAD_MUTEX_INITIALIZER;
+
+#define AuxArenaData(chunk)  (((char *)(chunk)) + ((sizeof(AuxArena)+AUXARENA_ALIGN-1) & ~(AUXARENA_ALIGN-1)))
+
+void AuxArenaBegin(AuxArena **arena, ulong numpixels)
+/* Routes the attribute allocations of this thread to *arena, which gets its
+ * first chunk on the first allocation. Without MaxTreeUseArena every record
+ * gets its own malloc. */
+{
+   AuxArenaCurrent = MaxTreeUseArena ? arena : NULL;
+   AuxArenaNumPixels = numpixels;
+} /* AuxArenaBegin */
+
+
+
+void AuxArenaEnd(void)
+{
+   AuxArenaCurrent = NULL;
+} /* AuxArenaEnd */
+
+
+
+void AuxArenaAppend(AuxArena **arena, AuxArena *other)
+/* Moves the chunks of other to the end of *arena */
+{
+   while (*arena)  arena = &((*arena)->Next);
+   *arena = other;
+} /* AuxArenaAppend */
+
+
+
+void AuxArenaDelete(AuxArena *arena)
+{
+   AuxArena *next;
+
+   if (arena==NULL)  return;
+   pthread_mutex_lock(&AuxArenaLiveLock);
+   for (next=arena; next; next=next->Next)
+   {
+      if (next->LivePrev)  next->LivePrev->LiveNext = next->LiveNext;
+      else  AuxArenaLive = next->LiveNext;
+      if (next->LiveNext)  next->LiveNext->LivePrev = next->LivePrev;
+      atomic_fetch_sub(&AuxArenaNumLive, 1);
+   }
+   pthread_mutex_unlock(&AuxArenaLiveLock);
+   while (arena)
+   {
+      next = arena->Next;
+      free(arena);
+      arena = next;
+   }
+} /* AuxArenaDelete */
+
+
+
+static bool AuxArenaOwns(void *data)
+/* Whether data lies in a live chunk of any arena; the arena of this thread
+ * is checked first, without the lock */
+{
+   AuxArena *chunk;
+   uintptr_t p = (uintptr_t)data, begin;
+   bool owns = false;
+
+   if (atomic_load(&AuxArenaNumLive)==0)  return(false);
+   for (chunk=(AuxArenaCurrent ? *AuxArenaCurrent : NULL); chunk; chunk=chunk->Next)
+   {
+      begin = (uintptr_t)AuxArenaData(chunk);
+      if ((p>=begin) && (p<begin+chunk->Capacity))  return(true);
+   }
+   pthread_mutex_lock(&AuxArenaLiveLock);
+   for (chunk=AuxArenaLive; chunk && !owns; chunk=chunk->LiveNext)
+   {
+      begin = (uintptr_t)AuxArenaData(chunk);
+      owns = (p>=begin) && (p<begin+chunk->Capacity);
+   }
+   pthread_mutex_unlock(&AuxArenaLiveLock);
+   return(owns);
+} /* AuxArenaOwns */
+
+
+
+ulong AuxDataMallocCount(void)
+{
+   return(atomic_load(&AuxDataNumMallocs));
+} /* AuxDataMallocCount */
+
+
+
+void *AuxDataAlloc(size_t size)
+/* Allocates an attribute record from the current arena. The first chunk
+ * holds a record per 16 pixels, every next chunk is twice as large, up to
+ * AUXARENA_MAXCHUNK bytes. */
+{
+   AuxArena *chunk, *arena;
+   size_t capacity;
+   void *data;
+
+   if (AuxArenaCurrent==NULL)
+   {
+      atomic_fetch_add(&AuxDataNumMallocs, 1);
+      return(malloc(size));
+   }
+   size = (size+AUXARENA_ALIGN-1) & ~(AUXARENA_ALIGN-1);
+   arena = *AuxArenaCurrent;
+   if ((arena==NULL) || (arena->Used+size > arena->Capacity))
+   {
+      capacity = arena ? 2*(arena->Capacity) : size*(AuxArenaNumPixels/16 + 1);
+      if (capacity>AUXARENA_MAXCHUNK)  capacity = AUXARENA_MAXCHUNK;
+      if (capacity<size)  capacity = size;
+      chunk = malloc(sizeof(AuxArena) + AUXARENA_ALIGN + capacity);
+      if (chunk==NULL)  return(NULL);
+      atomic_fetch_add(&AuxDataNumMallocs, 1);
+      chunk->Next = arena;
+      chunk->Capacity = capacity;
+      chunk->Used = 0;
+      pthread_mutex_lock(&AuxArenaLiveLock);
+      chunk->LivePrev = NULL;
+      chunk->LiveNext = AuxArenaLive;
+      if (AuxArenaLive)  AuxArenaLive->LivePrev = chunk;
+      AuxArenaLive = chunk;
+      atomic_fetch_add(&AuxArenaNumLive, 1);
+      pthread_mutex_unlock(&AuxArenaLiveLock);
+      *AuxArenaCurrent = arena = chunk;
+   }
+   data = AuxArenaData(arena) + arena->Used;
+   arena->Used += size;
+   return(data);
+} /* AuxDataAlloc */
+
+
+
+void AuxDataFree(void *data)
+/* Records from an arena are only released with the whole arena; which one
+ * a record came from decides, not the arena this thread allocates from */
+{
+   if (!AuxArenaOwns(data))  free(data);
+} /* AuxDataFree */
+
+
+
+size_t AuxDataRecordSize(void *(*newauxdata)(ulong, ulong, int, ulong *, ImageGray *))
+/* Bytes newauxdata allocates for one record, measured on a one pixel image
+ * in an arena of its own. Callbacks without data of their own give 0. */
+{
+   AuxArena *arena = NULL, **current = AuxArenaCurrent;
+   ulong numpixels = AuxArenaNumPixels;
+   ubyte pixel = 0;
+   ImageGray img = {1, 1, &pixel};
+   size_t size;
+
+   AuxArenaCurrent = &arena;
+   AuxArenaNumPixels = 1;
+   newauxdata(0, 0, 0, NULL, &img);
+   size = arena ? arena->Used : 0;
+   /* The chunk is not the record of any tree */
+   if (arena)  atomic_fetch_sub(&AuxDataNumMallocs, 1);
+   AuxArenaCurrent = current;
+   AuxArenaNumPixels = numpixels;
+   AuxArenaDelete(arena);
+   return(size);
+} /* AuxDataRecordSize */
+
+
+
 /****** Typedefs and functions for area attributes ******************************/
 
 typedef struct AreaData
@@ -85,14 +294,14 @@ void *NewAreaData(ulong x, ulong y, int numneighbors, ulong *neighbors, ImageGra
 {
    AreaData *areadata;
 
-   areadata = malloc(sizeof(AreaData));
+   areadata = AuxDataAlloc(sizeof(AreaData));
    areadata->Area = 1;
    return(areadata);
 } /* NewAreaData */
 
 void DeleteAreaData(void *areaattr)
 {
-   free(areaattr);
+   AuxDataFree(areaattr);
 } /* DeleteAreaData */
 
 void AddToAreaData(void *areaattr, ulong x, ulong y, int numneighbors, ulong *neighbors, ImageGray *img)
@@ -135,7 +344,7 @@ void *NewEnclRectData(ulong x, ulong y, int numneighbors, ulong *neighbors, Imag
 {
    EnclRectData *rectdata;
 
-   rectdata = malloc(sizeof(EnclRectData));
+   rectdata = AuxDataAlloc(sizeof(EnclRectData));
    rectdata->MinX = rectdata->MaxX = x;
    rectdata->MinY = rectdata->MaxY = y;
    return(rectdata);
@@ -143,7 +352,7 @@ void *NewEnclRectData(ulong x, ulong y, int numneighbors, ulong *neighbors, Imag
 
 void DeleteEnclRectData(void *rectattr)
 {
-   free(rectattr);
+   AuxDataFree(rectattr);
 } /* DeleteEnclRectData */
 
 void AddToEnclRectData(void *rectattr, ulong x, ulong y, int numneighbors, ulong *neighbors, ImageGray *img)
@@ -218,7 +427,7 @@ void *NewPeriCBData(ulong x, ulong y, int numneighbors, ulong *neighbors, ImageG
       if (img->Pixmap[q]<h)  peri++;
       if (img->Pixmap[q]>h)  peri--;
    }
-   peridata = malloc(sizeof(PeriCBData));
+   peridata = AuxDataAlloc(sizeof(PeriCBData));
    peridata->Area = 1;
    peridata->Perimeter = peri;
    return(peridata);
@@ -226,7 +435,7 @@ void *NewPeriCBData(ulong x, ulong y, int numneighbors, ulong *neighbors, ImageG
 
 void DeletePeriCBData(void *periattr)
 {
-   free(periattr);
+   AuxDataFree(periattr);
 } /* DeletePeriCBData */
 
 void AddToPeriCBData(void *periattr, ulong x, ulong y, int numneighbors, ulong *neighbors, ImageGray *img)
@@ -388,7 +597,7 @@ void *NewPeriLargeData(ulong x, ulong y, int numneighbors, ulong *neighbors, Ima
    peri += 0.5*PeriLargeCalcSide(h, neigh8[2], neigh8[3], neigh8[4], neigh8[1], neigh8[5]);
    peri += 0.5*PeriLargeCalcSide(h, neigh8[4], neigh8[5], neigh8[6], neigh8[3], neigh8[7]);
    peri += 0.5*PeriLargeCalcSide(h, neigh8[6], neigh8[7], neigh8[0], neigh8[5], neigh8[1]);
-   peridata = malloc(sizeof(PeriLargeData));
+   peridata = AuxDataAlloc(sizeof(PeriLargeData));
    peridata->Area = 1;
    peridata->Perimeter = peri;
    return(peridata);
@@ -396,7 +605,7 @@ void *NewPeriLargeData(ulong x, ulong y, int numneighbors, ulong *neighbors, Ima
 
 void DeletePeriLargeData(void *periattr)
 {
-   free(periattr);
+   AuxDataFree(periattr);
 } /* DeletePeriLargeData */
 
 void AddToPeriLargeData(void *periattr, ulong x, ulong y, int numneighbors, ulong *neighbors, ImageGray *img)
@@ -513,7 +722,7 @@ void *NewPeriSmallData(ulong x, ulong y, int numneighbors, ulong *neighbors, Ima
    peri += PeriSmallCalcSide(h, neigh8[1], neigh8[2], neigh8[3]);
    peri += PeriSmallCalcSide(h, neigh8[3], neigh8[4], neigh8[5]);
    peri += PeriSmallCalcSide(h, neigh8[5], neigh8[6], neigh8[7]);
-   peridata = malloc(sizeof(PeriSmallData));
+   peridata = AuxDataAlloc(sizeof(PeriSmallData));
    peridata->Area = 1;
    peridata->Perimeter = peri;
    return(peridata);
@@ -521,7 +730,7 @@ void *NewPeriSmallData(ulong x, ulong y, int numneighbors, ulong *neighbors, Ima
 
 void DeletePeriSmallData(void *periattr)
 {
-   free(periattr);
+   AuxDataFree(periattr);
 } /* DeletePeriSmallData */
 
 void AddToPeriSmallData(void *periattr, ulong x, ulong y, int numneighbors, ulong *neighbors, ImageGray *img)
@@ -591,7 +800,7 @@ void *NewInertiaData(ulong x, ulong y, int numneighbors, ulong *neighbors, Image
 {
    InertiaData *inertiadata;
 
-   inertiadata = malloc(sizeof(InertiaData));
+   inertiadata = AuxDataAlloc(sizeof(InertiaData));
    inertiadata->Area = 1;
    inertiadata->SumX = x;
    inertiadata->SumY = y;
@@ -602,7 +811,7 @@ void *NewInertiaData(ulong x, ulong y, int numneighbors, ulong *neighbors, Image
 
 void DeleteInertiaData(void *inertiaattr)
 {
-   free(inertiaattr);
+   AuxDataFree(inertiaattr);
 } /* DeleteInertiaData */
 
 void AddToInertiaData(void *inertiaattr, ulong x, ulong y, int numneighbors, ulong *neighbors, ImageGray *img)
@@ -703,7 +912,7 @@ void *NewJaggedData(ulong x, ulong y, int numneighbors, ulong *neighbors, ImageG
       if (img->Pixmap[q]<h)  peri++;
       if (img->Pixmap[q]>h)  peri--;
    }
-   jaggeddata = malloc(sizeof(JaggedData));
+   jaggeddata = AuxDataAlloc(sizeof(JaggedData));
    jaggeddata->Area = 1;
    jaggeddata->Perimeter = peri;
    jaggeddata->SumX = x;
@@ -715,7 +924,7 @@ void *NewJaggedData(ulong x, ulong y, int numneighbors, ulong *neighbors, ImageG
 
 void DeleteJaggedData(void *jaggedattr)
 {
-   free(jaggedattr);
+   AuxDataFree(jaggedattr);
 } /* DeleteJaggedData */
 
 void AddToJaggedData(void *jaggedattr, ulong x, ulong y, int numneighbors, ulong *neighbors, ImageGray *img)
@@ -818,7 +1027,7 @@ void *NewEntropyData(ulong x, ulong y, int numneighbors, ulong *neighbors, Image
    int i;
 
    p = ly*(img->Width) + lx;
-   entropydata = malloc(sizeof(EntropyData));
+   entropydata = AuxDataAlloc(sizeof(EntropyData));
    for (i=0; i<NUMLEVELS; i++)  entropydata->Hist[i] = 0;
    entropydata->Hist[img->Pixmap[p]] = 1;
    return(entropydata);
@@ -826,7 +1035,7 @@ void *NewEntropyData(ulong x, ulong y, int numneighbors, ulong *neighbors, Image
 
 void DeleteEntropyData(void *entropyattr)
 {
-   free(entropyattr);
+   AuxDataFree(entropyattr);
 } /* DeleteEntropyData */
 
 void AddToEntropyData(void *entropyattr, ulong x, ulong y, int numneighbors, ulong *neighbors, ImageGray *img)
@@ -850,13 +1059,20 @@ void MergeEntropyData(void *entropyattr, void *childattr)
 double EntropyAttribute(void *entropyattr)
 {
    EntropyData *entropydata = entropyattr;
-   double p[NUMLEVELS];
+   double p;
    double num=0.0, entropy = 0.0;
    int i;
 
    for (i=0; i<NUMLEVELS; i++)  num += entropydata->Hist[i];
-   for (i=0; i<NUMLEVELS; i++)  p[i] = (entropydata->Hist[i])/num;
-   for (i=0; i<NUMLEVELS; i++)  entropy += p[i] * (log(p[i]+0.00001)/log(2.0));
+   /* Empty bins add 0*log(0.00001), so only the others need a log */
+   for (i=0; i<NUMLEVELS; i++)
+   {
+      if (entropydata->Hist[i])
+      {
+         p = (entropydata->Hist[i])/num;
+         entropy += p * (log(p+0.00001)/log(2.0));
+      }
+   }
    return(-entropy);
 } /* EntropyAttribute */
 
@@ -874,7 +1090,7 @@ void *NewLambdamaxData(ulong x, ulong y, int numneighbors, ulong *neighbors, Ima
 {
    LambdamaxData *lambdadata;
 
-   lambdadata = malloc(sizeof(LambdamaxData));
+   lambdadata = AuxDataAlloc(sizeof(LambdamaxData));
    lambdadata->MinLevel = img->Pixmap[y*(img->Width)+x];
    lambdadata->MaxLevel = img->Pixmap[y*(img->Width)+x];
    return(lambdadata);
@@ -882,7 +1098,7 @@ void *NewLambdamaxData(ulong x, ulong y, int numneighbors, ulong *neighbors, Ima
 
 void DeleteLambdamaxData(void *lambdaattr)
 {
-   free(lambdaattr);
+   AuxDataFree(lambdaattr);
 } /* DeleteLambdamaxData */
 
 void AddToLambdamaxData(void *lambdaattr, ulong x, ulong y, int numneighbors, ulong *neighbors, ImageGray *img)
@@ -919,14 +1135,14 @@ void *NewLevelData(ulong x, ulong y, int numneighbors, ulong *neighbors, ImageGr
 {
    LevelData *leveldata;
 
-   leveldata = malloc(sizeof(LevelData));
+   leveldata = AuxDataAlloc(sizeof(LevelData));
    leveldata->level = img->Pixmap[y*(img->Width)+x];
    return(leveldata);
 } /* NewLevelData */
 
 void DeleteLevelData(void *levelattr)
 {
-   free(levelattr);
+   AuxDataFree(levelattr);
 } /* DeleteLevelData */
 
 void AddToLevelData(void *levelattr, ulong x, ulong y, int numneighbors, ulong *neighbors, ImageGray *img)
@@ -948,6 +1164,450 @@ double LevelAttribute(void *levelattr)
 
 
 
+/****** Typedefs and functions for several attributes at once ******************************/
+
+/* A combined record holds the data of every selected attribute family one
+ * after the other, so a single tree build serves all of them. The neighbor
+ * scans and coordinate moments that several families need are computed once
+ * per pixel. Every record starts with the set of families it holds, so the
+ * records of a tree are read with the layout they were built with, whatever
+ * is selected later. */
+
+#define MULTI_AREA        0
+#define MULTI_ENCLRECT    1
+#define MULTI_PERICB      2
+#define MULTI_PERILARGE   3
+#define MULTI_PERISMALL   4
+#define MULTI_INERTIA     5
+#define MULTI_JAGGED      6
+#define MULTI_ENTROPY     7
+#define MULTI_LAMBDAMAX   8
+#define MULTI_LEVEL       9
+#define MULTI_NUMFAMILIES 10
+
+typedef struct MultiFamily
+{
+   void *(*NewAuxData)(ulong, ulong, int, ulong *, ImageGray *);
+   void (*MergeAuxData)(void *, void *);
+   size_t Size;
+} MultiFamily;
+
+MultiFamily MultiFamilies[MULTI_NUMFAMILIES] =
+{
+   {NewAreaData, MergeAreaData, sizeof(AreaData)},
+   {NewEnclRectData, MergeEnclRectData, sizeof(EnclRectData)},
+   {NewPeriCBData, MergePeriCBData, sizeof(PeriCBData)},
+   {NewPeriLargeData, MergePeriLargeData, sizeof(PeriLargeData)},
+   {NewPeriSmallData, MergePeriSmallData, sizeof(PeriSmallData)},
+   {NewInertiaData, MergeInertiaData, sizeof(InertiaData)},
+   {NewJaggedData, MergeJaggedData, sizeof(JaggedData)},
+   {NewEntropyData, MergeEntropyData, sizeof(EntropyData)},
+   {NewLambdamaxData, MergeLambdamaxData, sizeof(LambdamaxData)},
+   {NewLevelData, MergeLevelData, sizeof(LevelData)}
+};
+
+typedef struct MultiHeader
+{
+   ulong Families;  /* bit f set for every family f held */
+} MultiHeader;
+
+#define MULTI_ALIGN(size)  (((size)+7) & ~((size_t)7))
+
+/* Families new records are built with, their offsets and size */
+ulong MultiFamiliesSelected = 1UL << MULTI_AREA;
+long MultiSelectedOffsets[MULTI_NUMFAMILIES] = {MULTI_ALIGN(sizeof(MultiHeader)), -1, -1, -1, -1, -1, -1, -1, -1, -1};
+size_t MultiSize = MULTI_ALIGN(sizeof(MultiHeader)) + MULTI_ALIGN(sizeof(AreaData));
+
+#define MultiFamiliesOf(multiattr)  (((MultiHeader *)(multiattr))->Families)
+#define MultiPart(multiattr, offsets, f)  ((void *)(((char *)(multiattr)) + (offsets)[f]))
+
+const long *MultiLayoutOf(ulong families, long *offsets)
+/* Offset of every family in a record holding families, -1 for the others.
+ * The records of a build hold the selected families, whose offsets are
+ * returned as they are; offsets is filled for any other. */
+{
+   size_t offset = MULTI_ALIGN(sizeof(MultiHeader));
+   int f;
+
+   if (families==MultiFamiliesSelected)  return(MultiSelectedOffsets);
+   for (f=0; f<MULTI_NUMFAMILIES; f++)
+   {
+      if ((families>>f) & 1)
+      {
+         offsets[f] = offset;
+         offset += MULTI_ALIGN(MultiFamilies[f].Size);
+      } else  offsets[f] = -1;
+   }
+   return(offsets);
+} /* MultiLayoutOf */
+
+long MultiOffsetOf(ulong families, int f)
+/* Offset of family f in a record holding families, -1 if it is not held */
+{
+   size_t offset = MULTI_ALIGN(sizeof(MultiHeader));
+   int g;
+
+   if (((families>>f) & 1)==0)  return(-1);
+   for (g=0; g<f; g++)
+   {
+      if ((families>>g) & 1)  offset += MULTI_ALIGN(MultiFamilies[g].Size);
+   }
+   return(offset);
+} /* MultiOffsetOf */
+
+int MultiFamilyOf(AttribStruct *attrib)
+{
+   int f;
+
+   for (f=0; f<MULTI_NUMFAMILIES; f++)
+   {
+      if (attrib->NewAuxData==MultiFamilies[f].NewAuxData)  return(f);
+   }
+   return(-1);
+} /* MultiFamilyOf */
+
+bool MultiAttribSelect(AttribStruct *attribs, ulong mask)
+/* Selects the families of every attribs[i] with bit i set in mask, i below
+ * NUMATTR, for the trees built from now on. Fails if mask has other bits
+ * or one of them is not in MultiFamilies. */
+{
+   ulong families = 0;
+   int i, f;
+
+   if ((NUMATTR<(int)(8*sizeof(ulong))) && (mask>>NUMATTR))  return(false);
+   for (i=0; i<NUMATTR; i++)
+   {
+      if ((mask>>i) & 1)
+      {
+         f = MultiFamilyOf(&(attribs[i]));
+         if (f<0)  return(false);
+         families |= 1UL << f;
+      }
+   }
+   MultiFamiliesSelected = families;
+   MultiSize = MULTI_ALIGN(sizeof(MultiHeader));
+   for (f=0; f<MULTI_NUMFAMILIES; f++)
+   {
+      if ((families>>f) & 1)
+      {
+         MultiSelectedOffsets[f] = MultiSize;
+         MultiSize += MULTI_ALIGN(MultiFamilies[f].Size);
+      } else  MultiSelectedOffsets[f] = -1;
+   }
+   return(true);
+} /* MultiAttribSelect */
+
+void *MultiAttribData(void *multiattr, AttribStruct *attrib)
+{
+   long offset;
+   int f;
+
+   f = MultiFamilyOf(attrib);
+   if (f<0)  return(NULL);
+   offset = MultiOffsetOf(MultiFamiliesOf(multiattr), f);
+   if (offset<0)  return(NULL);
+   return(((char *)multiattr) + offset);
+} /* MultiAttribData */
+
+void *NewMultiData(ulong x, ulong y, int numneighbors, ulong *neighbors, ImageGray *img)
+{
+   EnclRectData *rectdata;
+   LambdamaxData *lambdadata;
+   LevelData *leveldata;
+   void *multidata;
+   const long *offsets = MultiSelectedOffsets;
+
+   multidata = AuxDataAlloc(MultiSize);
+   if (multidata==NULL)  return(NULL);
+   bzero(multidata, MultiSize);
+   MultiFamiliesOf(multidata) = MultiFamiliesSelected;
+   /* Families whose AddTo leaves a field alone get it from the first pixel */
+   if (offsets[MULTI_ENCLRECT]>=0)
+   {
+      rectdata = MultiPart(multidata, offsets, MULTI_ENCLRECT);
+      rectdata->MinX = rectdata->MaxX = x;
+      rectdata->MinY = rectdata->MaxY = y;
+   }
+   if (offsets[MULTI_LAMBDAMAX]>=0)
+   {
+      lambdadata = MultiPart(multidata, offsets, MULTI_LAMBDAMAX);
+      lambdadata->MinLevel = lambdadata->MaxLevel = img->Pixmap[y*(img->Width)+x];
+   }
+   if (offsets[MULTI_LEVEL]>=0)
+   {
+      leveldata = MultiPart(multidata, offsets, MULTI_LEVEL);
+      leveldata->level = img->Pixmap[y*(img->Width)+x];
+   }
+   AddToMultiData(multidata, x, y, numneighbors, neighbors, img);
+   return(multidata);
+} /* NewMultiData */
+
+void DeleteMultiData(void *multiattr)
+{
+   AuxDataFree(multiattr);
+} /* DeleteMultiData */
+
+void AddToMultiData(void *multiattr, ulong x, ulong y, int numneighbors, ulong *neighbors, ImageGray *img)
+{
+   PeriCBData *cbdata;
+   PeriLargeData *largedata;
+   PeriSmallData *smalldata;
+   InertiaData *inertiadata;
+   JaggedData *jaggeddata;
+   EntropyData *entropydata;
+   ulong p, peri=0, q, x2=x*x, y2=y*y;
+   ulong neigh8[8];
+   double peri8;
+   long layout[MULTI_NUMFAMILIES];
+   const long *offsets;
+   int i;
+   ubyte h;
+
+   offsets = MultiLayoutOf(MultiFamiliesOf(multiattr), layout);
+   p = y*(img->Width) + x;
+   if ((offsets[MULTI_PERICB]>=0) || (offsets[MULTI_JAGGED]>=0))
+   {
+      h = img->Pixmap[p];
+      peri += CONNECTIVITY-numneighbors;
+      for (i=0; i<numneighbors; i++)
+      {
+         q = neighbors[i];
+         if (img->Pixmap[q]<h)  peri++;
+         if (img->Pixmap[q]>h)  peri--;
+      }
+   }
+   if (offsets[MULTI_AREA]>=0)  ((AreaData *)MultiPart(multiattr, offsets, MULTI_AREA))->Area ++;
+   if (offsets[MULTI_ENCLRECT]>=0)  AddToEnclRectData(MultiPart(multiattr, offsets, MULTI_ENCLRECT), x, y, numneighbors, neighbors, img);
+   if (offsets[MULTI_PERICB]>=0)
+   {
+      cbdata = MultiPart(multiattr, offsets, MULTI_PERICB);
+      cbdata->Area ++;
+      cbdata->Perimeter += peri;
+   }
+   if ((offsets[MULTI_PERILARGE]>=0) || (offsets[MULTI_PERISMALL]>=0))
+   {
+      h = Get8NeighValues(img, neigh8, x, y);
+      if (offsets[MULTI_PERILARGE]>=0)
+      {
+         peri8 = 0.5*PeriLargeCalcSide(h, neigh8[0], neigh8[1], neigh8[2], neigh8[7], neigh8[3]);
+         peri8 += 0.5*PeriLargeCalcSide(h, neigh8[2], neigh8[3], neigh8[4], neigh8[1], neigh8[5]);
+         peri8 += 0.5*PeriLargeCalcSide(h, neigh8[4], neigh8[5], neigh8[6], neigh8[3], neigh8[7]);
+         peri8 += 0.5*PeriLargeCalcSide(h, neigh8[6], neigh8[7], neigh8[0], neigh8[5], neigh8[1]);
+         largedata = MultiPart(multiattr, offsets, MULTI_PERILARGE);
+         largedata->Area ++;
+         largedata->Perimeter += peri8;
+      }
+      if (offsets[MULTI_PERISMALL]>=0)
+      {
+         peri8 = PeriSmallCalcSide(h, neigh8[7], neigh8[0], neigh8[1]);
+         peri8 += PeriSmallCalcSide(h, neigh8[1], neigh8[2], neigh8[3]);
+         peri8 += PeriSmallCalcSide(h, neigh8[3], neigh8[4], neigh8[5]);
+         peri8 += PeriSmallCalcSide(h, neigh8[5], neigh8[6], neigh8[7]);
+         smalldata = MultiPart(multiattr, offsets, MULTI_PERISMALL);
+         smalldata->Area ++;
+         smalldata->Perimeter += peri8;
+      }
+   }
+   if (offsets[MULTI_INERTIA]>=0)
+   {
+      inertiadata = MultiPart(multiattr, offsets, MULTI_INERTIA);
+      inertiadata->Area ++;
+      inertiadata->SumX += x;
+      inertiadata->SumY += y;
+      inertiadata->SumX2 += x2;
+      inertiadata->SumY2 += y2;
+   }
+   if (offsets[MULTI_JAGGED]>=0)
+   {
+      jaggeddata = MultiPart(multiattr, offsets, MULTI_JAGGED);
+      jaggeddata->Area ++;
+      jaggeddata->Perimeter += peri;
+      jaggeddata->SumX += x;
+      jaggeddata->SumY += y;
+      jaggeddata->SumX2 += x2;
+      jaggeddata->SumY2 += y2;
+   }
+   if (offsets[MULTI_ENTROPY]>=0)
+   {
+      entropydata = MultiPart(multiattr, offsets, MULTI_ENTROPY);
+      entropydata->Hist[img->Pixmap[p]] ++;
+   }
+} /* AddToMultiData */
+
+void MergeMultiData(void *multiattr, void *childattr)
+/* Both records come from the same tree, so they hold the same families */
+{
+   ulong families = MultiFamiliesOf(multiattr);
+   size_t offset = MULTI_ALIGN(sizeof(MultiHeader));
+   int f;
+
+   for (f=0; f<MULTI_NUMFAMILIES; f++)
+   {
+      if ((families>>f) & 1)
+      {
+         MultiFamilies[f].MergeAuxData(((char *)multiattr) + offset, ((char *)childattr) + offset);
+         offset += MULTI_ALIGN(MultiFamilies[f].Size);
+      }
+   }
+} /* MergeMultiData */
+
+/* One accessor per attribute of the Attribs table, evaluating it on the
+ * data of its family, NaN for a record built without that family */
+#define MULTI_ACCESSOR(name, family, attribute) \
+double name(void *multiattr) \
+{ \
+   long offset; \
+\
+   offset = MultiOffsetOf(MultiFamiliesOf(multiattr), family); \
+   if (offset<0)  return(NAN); \
+   return(attribute(((char *)multiattr) + offset)); \
+}
+
+MULTI_ACCESSOR(MultiAreaAttribute, MULTI_AREA, AreaAttribute)
+MULTI_ACCESSOR(MultiEnclRectAreaAttribute, MULTI_ENCLRECT, EnclRectAreaAttribute)
+MULTI_ACCESSOR(MultiEnclRectDiagAttribute, MULTI_ENCLRECT, EnclRectDiagAttribute)
+MULTI_ACCESSOR(MultiPeriCBPerimeterAttribute, MULTI_PERICB, PeriCBPerimeterAttribute)
+MULTI_ACCESSOR(MultiPeriCBComplexityAttribute, MULTI_PERICB, PeriCBComplexityAttribute)
+MULTI_ACCESSOR(MultiPeriCBSimplicityAttribute, MULTI_PERICB, PeriCBSimplicityAttribute)
+MULTI_ACCESSOR(MultiPeriCBCompactnessAttribute, MULTI_PERICB, PeriCBCompactnessAttribute)
+MULTI_ACCESSOR(MultiPeriLargePerimeterAttribute, MULTI_PERILARGE, PeriLargePerimeterAttribute)
+MULTI_ACCESSOR(MultiPeriLargeCompactnessAttribute, MULTI_PERILARGE, PeriLargeCompactnessAttribute)
+MULTI_ACCESSOR(MultiPeriSmallPerimeterAttribute, MULTI_PERISMALL, PeriSmallPerimeterAttribute)
+MULTI_ACCESSOR(MultiPeriSmallCompactnessAttribute, MULTI_PERISMALL, PeriSmallCompactnessAttribute)
+MULTI_ACCESSOR(MultiInertiaAttribute, MULTI_INERTIA, InertiaAttribute)
+MULTI_ACCESSOR(MultiInertiaDivA2Attribute, MULTI_INERTIA, InertiaDivA2Attribute)
+MULTI_ACCESSOR(MultiMeanXAttribute, MULTI_INERTIA, MeanXAttribute)
+MULTI_ACCESSOR(MultiMeanYAttribute, MULTI_INERTIA, MeanYAttribute)
+MULTI_ACCESSOR(MultiJaggednessAttribute, MULTI_JAGGED, JaggednessAttribute)
+MULTI_ACCESSOR(MultiEntropyAttribute, MULTI_ENTROPY, EntropyAttribute)
+MULTI_ACCESSOR(MultiLambdamaxAttribute, MULTI_LAMBDAMAX, LambdamaxAttribute)
+MULTI_ACCESSOR(MultiLevelAttribute, MULTI_LEVEL, LevelAttribute)
+
+typedef struct MultiAccessor
+{
+   double (*Attribute)(void *);
+   double (*Multi)(void *);
+} MultiAccessor;
+
+MultiAccessor MultiAccessors[NUMATTR] =
+{
+   {AreaAttribute, MultiAreaAttribute},
+   {EnclRectAreaAttribute, MultiEnclRectAreaAttribute},
+   {EnclRectDiagAttribute, MultiEnclRectDiagAttribute},
+   {PeriCBPerimeterAttribute, MultiPeriCBPerimeterAttribute},
+   {PeriCBComplexityAttribute, MultiPeriCBComplexityAttribute},
+   {PeriCBSimplicityAttribute, MultiPeriCBSimplicityAttribute},
+   {PeriCBCompactnessAttribute, MultiPeriCBCompactnessAttribute},
+   {PeriLargePerimeterAttribute, MultiPeriLargePerimeterAttribute},
+   {PeriLargeCompactnessAttribute, MultiPeriLargeCompactnessAttribute},
+   {PeriSmallPerimeterAttribute, MultiPeriSmallPerimeterAttribute},
+   {PeriSmallCompactnessAttribute, MultiPeriSmallCompactnessAttribute},
+   {InertiaAttribute, MultiInertiaAttribute},
+   {InertiaDivA2Attribute, MultiInertiaDivA2Attribute},
+   {MeanXAttribute, MultiMeanXAttribute},
+   {MeanYAttribute, MultiMeanYAttribute},
+   {JaggednessAttribute, MultiJaggednessAttribute},
+   {EntropyAttribute, MultiEntropyAttribute},
+   {LambdamaxAttribute, MultiLambdamaxAttribute},
+   {LevelAttribute, MultiLevelAttribute}
+};
+
+double (*MultiAttribFor(AttribStruct *attrib))(void *)
+/* Accessor of attrib on the combined records, NULL if it has none */
+{
+   int i;
+
+   for (i=0; i<NUMATTR; i++)
+   {
+      if (attrib->Attribute==MultiAccessors[i].Attribute)  return(MultiAccessors[i].Multi);
+   }
+   return(NULL);
+} /* MultiAttribFor */
+
+
+
+/****** Attribute values of all nodes ******************************/
+
+bool MaxTreeUseSpecialized = true;
+
+/* One loop per attribute function, so the function is inlined instead of
+ * called through a pointer for every node */
+#define ATTRIB_VALUES(attribute) \
+   void attribute##Values(const MaxTree *mt, double *values) \
+   { \
+      void **attributes = mt->Attributes; \
+      ulong i; \
+      for (i=0; i<mt->NumNodes; i++)  values[i] = attribute(attributes[i]); \
+   }
+
+ATTRIB_VALUES(AreaAttribute)
+ATTRIB_VALUES(EnclRectAreaAttribute)
+ATTRIB_VALUES(EnclRectDiagAttribute)
+ATTRIB_VALUES(PeriCBPerimeterAttribute)
+ATTRIB_VALUES(PeriCBComplexityAttribute)
+ATTRIB_VALUES(PeriCBSimplicityAttribute)
+ATTRIB_VALUES(PeriCBCompactnessAttribute)
+ATTRIB_VALUES(PeriLargePerimeterAttribute)
+ATTRIB_VALUES(PeriLargeCompactnessAttribute)
+ATTRIB_VALUES(PeriSmallPerimeterAttribute)
+ATTRIB_VALUES(PeriSmallCompactnessAttribute)
+ATTRIB_VALUES(InertiaAttribute)
+ATTRIB_VALUES(InertiaDivA2Attribute)
+ATTRIB_VALUES(MeanXAttribute)
+ATTRIB_VALUES(MeanYAttribute)
+ATTRIB_VALUES(JaggednessAttribute)
+ATTRIB_VALUES(EntropyAttribute)
+ATTRIB_VALUES(LambdamaxAttribute)
+ATTRIB_VALUES(LevelAttribute)
+
+typedef struct AttribValuesEngine
+{
+   double (*Attribute)(void *);
+   void (*Values)(const MaxTree *, double *);
+} AttribValuesEngine;
+
+AttribValuesEngine AttribValuesEngines[] =
+{
+   {AreaAttribute, AreaAttributeValues},
+   {EnclRectAreaAttribute, EnclRectAreaAttributeValues},
+   {EnclRectDiagAttribute, EnclRectDiagAttributeValues},
+   {PeriCBPerimeterAttribute, PeriCBPerimeterAttributeValues},
+   {PeriCBComplexityAttribute, PeriCBComplexityAttributeValues},
+   {PeriCBSimplicityAttribute, PeriCBSimplicityAttributeValues},
+   {PeriCBCompactnessAttribute, PeriCBCompactnessAttributeValues},
+   {PeriLargePerimeterAttribute, PeriLargePerimeterAttributeValues},
+   {PeriLargeCompactnessAttribute, PeriLargeCompactnessAttributeValues},
+   {PeriSmallPerimeterAttribute, PeriSmallPerimeterAttributeValues},
+   {PeriSmallCompactnessAttribute, PeriSmallCompactnessAttributeValues},
+   {InertiaAttribute, InertiaAttributeValues},
+   {InertiaDivA2Attribute, InertiaDivA2AttributeValues},
+   {MeanXAttribute, MeanXAttributeValues},
+   {MeanYAttribute, MeanYAttributeValues},
+   {JaggednessAttribute, JaggednessAttributeValues},
+   {EntropyAttribute, EntropyAttributeValues},
+   {LambdamaxAttribute, LambdamaxAttributeValues},
+   {LevelAttribute, LevelAttributeValues}
+};
+#define NUMATTRIBVALUESENGINES  (sizeof(AttribValuesEngines)/sizeof(AttribValuesEngines[0]))
+
+void MaxTreeAttribValues(const MaxTree *mt, double (*attribute)(void *), double *values)
+/* Stores the attribute of every node in values, indexed like Nodes */
+{
+   ulong i;
+
+   for (i=0; MaxTreeUseSpecialized && (i<NUMATTRIBVALUESENGINES); i++)
+   {
+      if (AttribValuesEngines[i].Attribute==attribute)
+      {
+         AttribValuesEngines[i].Values(mt, values);
+         return;
+      }
+   }
+   for (i=0; i<mt->NumNodes; i++)  values[i] = (*attribute)(mt->Attributes[i]);
+} /* MaxTreeAttribValues */
+
+
+
 /****** Image create/read/write functions ******************************/
 
 ImageGray *ImageGrayCreate(ulong width, ulong height)
@@ -1183,161 +1843,466 @@ int GetNeighbors(ubyte *shape, ulong imgwidth, ulong imgsize, ulong p,
 
 
 
-int MaxTreeFlood(MaxTree *mt, HQueue *hq, ulong *numpixelsperlevel,
-                 bool *nodeatlevel, ImageGray *img, ubyte *shape, int h,
-                 ulong *thisarea,
-                 void **thisattr)
-/* Returns value >=NUMLEVELS if error */
+typedef struct FloodFrame
+/* State of one level of the flooding, kept on an explicit stack instead of
+ * the call stack. Levels strictly increase towards the top of the stack, so
+ * it never holds more than NUMLEVELS frames. */
 {
-   ulong neighbors[CONNECTIVITY];
-   ubyte *pixmap;
-   void *attr = NULL, *childattr;
-   ulong imgwidth, imgsize, p, q, idx, x, y;
-   ulong area = *thisarea, childarea;
-   MaxNode *node;
-   int numneighbors, i;
-   int m;
+   ulong Area;
+   void *Attr;
+   void *ChildAttr;  /* attribute of a finished child, merged once Attr exists */
+   ulong Neighbors[CONNECTIVITY];  /* neighbors of the last pixel taken from the queue */
+   int NumNeighbors;
+   int NextNeighbor;
+   int Level;
+} FloodFrame;
+
+
+
+void FloodFrameInit(FloodFrame *frame, int h, ulong area, void *childattr)
+{
+   frame->Area = area;
+   frame->Attr = NULL;
+   frame->ChildAttr = childattr;
+   frame->NumNeighbors = frame->NextNeighbor = 0;
+   frame->Level = h;
+} /* FloodFrameInit */
+
+
+
+/* Flooding with the callbacks of every attribute family named, and a
+ * generic version that calls the pointers stored in the tree */
+
+#define FLOOD_FUNC    MaxTreeFlood
+#define FLOOD_NEW     mt->NewAuxData
+#define FLOOD_ADD     mt->AddToAuxData
+#define FLOOD_MERGE   mt->MergeAuxData
+#define FLOOD_DELETE  mt->DeleteAuxData
+#include "maxtreeflood.h"
+
+#define FLOOD_FUNC    MaxTreeFloodArea
+#define FLOOD_NEW     NewAreaData
+#define FLOOD_ADD     AddToAreaData
+#define FLOOD_MERGE   MergeAreaData
+#define FLOOD_DELETE  DeleteAreaData
+#include "maxtreeflood.h"
+
+#define FLOOD_FUNC    MaxTreeFloodEnclRect
+#define FLOOD_NEW     NewEnclRectData
+#define FLOOD_ADD     AddToEnclRectData
+#define FLOOD_MERGE   MergeEnclRectData
+#define FLOOD_DELETE  DeleteEnclRectData
+#include "maxtreeflood.h"
+
+#define FLOOD_FUNC    MaxTreeFloodPeriCB
+#define FLOOD_NEW     NewPeriCBData
+#define FLOOD_ADD     AddToPeriCBData
+#define FLOOD_MERGE   MergePeriCBData
+#define FLOOD_DELETE  DeletePeriCBData
+#include "maxtreeflood.h"
+
+#define FLOOD_FUNC    MaxTreeFloodPeriLarge
+#define FLOOD_NEW     NewPeriLargeData
+#define FLOOD_ADD     AddToPeriLargeData
+#define FLOOD_MERGE   MergePeriLargeData
+#define FLOOD_DELETE  DeletePeriLargeData
+#include "maxtreeflood.h"
+
+#define FLOOD_FUNC    MaxTreeFloodPeriSmall
+#define FLOOD_NEW     NewPeriSmallData
+#define FLOOD_ADD     AddToPeriSmallData
+#define FLOOD_MERGE   MergePeriSmallData
+#define FLOOD_DELETE  DeletePeriSmallData
+#include "maxtreeflood.h"
+
+#define FLOOD_FUNC    MaxTreeFloodInertia
+#define FLOOD_NEW     NewInertiaData
+#define FLOOD_ADD     AddToInertiaData
+#define FLOOD_MERGE   MergeInertiaData
+#define FLOOD_DELETE  DeleteInertiaData
+#include "maxtreeflood.h"
+
+#define FLOOD_FUNC    MaxTreeFloodJagged
+#define FLOOD_NEW     NewJaggedData
+#define FLOOD_ADD     AddToJaggedData
+#define FLOOD_MERGE   MergeJaggedData
+#define FLOOD_DELETE  DeleteJaggedData
+#include "maxtreeflood.h"
+
+#define FLOOD_FUNC    MaxTreeFloodEntropy
+#define FLOOD_NEW     NewEntropyData
+#define FLOOD_ADD     AddToEntropyData
+#define FLOOD_MERGE   MergeEntropyData
+#define FLOOD_DELETE  DeleteEntropyData
+#include "maxtreeflood.h"
+
+#define FLOOD_FUNC    MaxTreeFloodLambdamax
+#define FLOOD_NEW     NewLambdamaxData
+#define FLOOD_ADD     AddToLambdamaxData
+#define FLOOD_MERGE   MergeLambdamaxData
+#define FLOOD_DELETE  DeleteLambdamaxData
+#include "maxtreeflood.h"
+
+#define FLOOD_FUNC    MaxTreeFloodLevel
+#define FLOOD_NEW     NewLevelData
+#define FLOOD_ADD     AddToLevelData
+#define FLOOD_MERGE   MergeLevelData
+#define FLOOD_DELETE  DeleteLevelData
+#include "maxtreeflood.h"
+
+
+
+typedef struct FloodEngine
+{
+   void *(*NewAuxData)(ulong, ulong, int, ulong *, ImageGray *);
+   void (*AddToAuxData)(void *, ulong, ulong, int, ulong *, ImageGray *);
+   void (*MergeAuxData)(void *, void *);
+   void (*DeleteAuxData)(void *);
+   int (*Flood)(MaxTree *, HQueue *, bool *, ImageGray *, ubyte *, int, FloodFrame *);
+} FloodEngine;
+
+FloodEngine FloodEngines[] =
+{
+   {NewAreaData, AddToAreaData, MergeAreaData, DeleteAreaData, MaxTreeFloodArea},
+   {NewEnclRectData, AddToEnclRectData, MergeEnclRectData, DeleteEnclRectData, MaxTreeFloodEnclRect},
+   {NewPeriCBData, AddToPeriCBData, MergePeriCBData, DeletePeriCBData, MaxTreeFloodPeriCB},
+   {NewPeriLargeData, AddToPeriLargeData, MergePeriLargeData, DeletePeriLargeData, MaxTreeFloodPeriLarge},
+   {NewPeriSmallData, AddToPeriSmallData, MergePeriSmallData, DeletePeriSmallData, MaxTreeFloodPeriSmall},
+   {NewInertiaData, AddToInertiaData, MergeInertiaData, DeleteInertiaData, MaxTreeFloodInertia},
+   {NewJaggedData, AddToJaggedData, MergeJaggedData, DeleteJaggedData, MaxTreeFloodJagged},
+   {NewEntropyData, AddToEntropyData, MergeEntropyData, DeleteEntropyData, MaxTreeFloodEntropy},
+   {NewLambdamaxData, AddToLambdamaxData, MergeLambdamaxData, DeleteLambdamaxData, MaxTreeFloodLambdamax},
+   {NewLevelData, AddToLevelData, MergeLevelData, DeleteLevelData, MaxTreeFloodLevel}
+};
+#define NUMFLOODENGINES  (sizeof(FloodEngines)/sizeof(FloodEngines[0]))
+
+
+
+int (*MaxTreeFloodOf(MaxTree *mt))(MaxTree *, HQueue *, bool *, ImageGray *, ubyte *, int, FloodFrame *)
+/* The flooding specialized for the callbacks of mt, the generic one if
+ * they are not those of a single family */
+{
+   ulong i;
 
-   imgwidth = img->Width;
-   imgsize = imgwidth * (img->Height);
-   pixmap = img->Pixmap;
-   while(HQueueNotEmpty(hq, h))
+   for (i=0; MaxTreeUseSpecialized && (i<NUMFLOODENGINES); i++)
    {
-      area++;
-      p = HQueueFirst(hq, h);
-      numneighbors = GetNeighbors(shape, imgwidth, imgsize, p, neighbors);
-      x = p % imgwidth;
-      y = p / imgwidth;
-      if (attr)  mt->AddToAuxData(attr, x, y, numneighbors, neighbors, img);
-      else
-      {
-         attr = mt->NewAuxData(x, y, numneighbors, neighbors, img);
-         if (attr==NULL)  return(NUMLEVELS);
-         if (*thisattr)  mt->MergeAuxData(attr, *thisattr);
-      }
-      mt->Status[p] = mt->NumNodesAtLevel[h];
-      for (i=0; i<numneighbors; i++)
+      if ((FloodEngines[i].NewAuxData==mt->NewAuxData) && (FloodEngines[i].AddToAuxData==mt->AddToAuxData) &&
+          (FloodEngines[i].MergeAuxData==mt->MergeAuxData) && (FloodEngines[i].DeleteAuxData==mt->DeleteAuxData))
       {
-         q = neighbors[i];
-         if (mt->Status[q]==ST_NotAnalyzed)
-         {
-            HQueueAdd(hq, pixmap[q], q);
-            mt->Status[q] = ST_InTheQueue;
-            nodeatlevel[pixmap[q]] = true;
-            if (pixmap[q] > pixmap[p])
-            {
-               m = pixmap[q];
-               childarea = 0;
-               childattr = NULL;
-               do
-               {
-                  m = MaxTreeFlood(mt,hq,numpixelsperlevel,nodeatlevel,img,shape,m, &childarea, &childattr);
-                  if (m>=NUMLEVELS)
-                  {
-                     mt->DeleteAuxData(attr);
-                     return(m);
-                  }
-               } while (m!=h);
-               area += childarea;
-               mt->MergeAuxData(attr, childattr);
-            }
-         }
+         return(FloodEngines[i].Flood);
       }
    }
-   mt->NumNodesAtLevel[h] = mt->NumNodesAtLevel[h]+1;
-   m = h-1;
-   while ((m>=0) && (nodeatlevel[m]==false))  m--;
-   if (m>=0)
-   {
-      node = mt->Nodes + (mt->NumPixelsBelowLevel[h] + mt->NumNodesAtLevel[h]-1);
-      node->Parent = mt->NumPixelsBelowLevel[m] + mt->NumNodesAtLevel[m];
-   } else {
-      idx = mt->NumPixelsBelowLevel[h];
-      node = mt->Nodes + idx;
-      node->Parent = idx;
-   }
-   node->Area = area;
-   node->Attribute = attr;
-   node->Level = h;
-   nodeatlevel[h] = false;
-   *thisarea = area;
-   *thisattr = attr;
-   return(m);
-} /* MaxTreeFlood */
+   return(MaxTreeFlood);
+} /* MaxTreeFloodOf */
 
 
 
-MaxTree *MaxTreeCreate(ImageGray *img, ImageGray *template,
-                       void *(*newauxdata)(ulong, ulong, int, ulong *, ImageGray *),
-                       void (*addtoauxdata)(void *, ulong, ulong, int, ulong *, ImageGray *),
-                       void (*mergeauxdata)(void *, void *),
-                       void (*deleteauxdata)(void *))
+void MaxTreeFree(MaxTree *mt)
+/* Releases the arrays of a tree whose nodes hold no attributes yet */
+{
+   free(mt->Attributes);
+   free(mt->Nodes);
+   free(mt->NumNodesAtLevel);
+   free(mt->NumNodesBelowLevel);
+   free(mt->NumPixelsBelowLevel);
+   free(mt->NodeMap);
+   if (mt->Runs)  MaxTreeRunsDelete(mt->Runs);
+   free(mt->Status);
+   free(mt);
+} /* MaxTreeFree */
+
+
+
+MaxTree *MaxTreeAlloc(ulong imgsize)
+/* Nodes and Attributes get room for a node per pixel while building,
+ * MaxTreeCompact shrinks them to the real number of nodes */
 {
-   ulong numpixelsperlevel[NUMLEVELS];
-   bool nodeatlevel[NUMLEVELS];
-   HQueue *hq;
    MaxTree *mt;
-   ubyte *pixmap = img->Pixmap;
-   void *attr = NULL;
-   ulong imgsize, p, m=0, area=0;
-   int l;
 
-   /* Allocate structures */
-   mt = malloc(sizeof(MaxTree));
+   /* Node indices and areas are 32-bit */
+   if (imgsize>UINT_MAX)  return(NULL);
+   mt = calloc(1, sizeof(MaxTree));
    if (mt==NULL)  return(NULL);
-   imgsize = (img->Width)*(img->Height);
    mt->Status = calloc((size_t)imgsize, sizeof(long));
-   if (mt->Status==NULL)
-   {
-      free(mt);
-      return(NULL);
-   }
    mt->NumPixelsBelowLevel = calloc(NUMLEVELS, sizeof(ulong));
-   if (mt->NumPixelsBelowLevel==NULL)
-   {
-      free(mt->Status);
-      free(mt);
-      return(NULL);
-   }
+   mt->NumNodesBelowLevel = calloc(NUMLEVELS, sizeof(ulong));
    mt->NumNodesAtLevel = calloc(NUMLEVELS, sizeof(ulong));
-   if (mt->NumNodesAtLevel==NULL)
+   mt->Nodes = calloc((size_t)(imgsize ? imgsize : 1), sizeof(MaxNode));
+   mt->Attributes = calloc((size_t)(imgsize ? imgsize : 1), sizeof(void *));
+   if ((mt->Status==NULL) || (mt->NumPixelsBelowLevel==NULL) || (mt->NumNodesBelowLevel==NULL) ||
+       (mt->NumNodesAtLevel==NULL) || (mt->Nodes==NULL) || (mt->Attributes==NULL))
    {
-      free(mt->NumPixelsBelowLevel);
-      free(mt->Status);
-      free(mt);
+      MaxTreeFree(mt);
       return(NULL);
    }
-   mt->Nodes = calloc((size_t)imgsize, sizeof(MaxNode));
-   if (mt->Nodes==NULL)
+   mt->NumNodes = imgsize;
+   return(mt);
+} /* MaxTreeAlloc */
+
+
+
+void MaxTreeCompact(MaxTree *mt)
+/* Moves the nodes of every level right after those of the level below, so
+ * a node is found at NumNodesBelowLevel[h] + Status[p], and shrinks Nodes
+ * and Attributes to the number of nodes. NumPixelsBelowLevel is only used
+ * while building and is released. */
+{
+   MaxNode *nodes;
+   void **attributes;
+   ulong i, idx, n=0;
+   uint parent;
+   int h;
+
+   for (h=0; h<NUMLEVELS; h++)
    {
-      free(mt->NumNodesAtLevel);
-      free(mt->NumPixelsBelowLevel);
-      free(mt->Status);
-      free(mt);
-      return(NULL);
+      mt->NumNodesBelowLevel[h] = n;
+      n += mt->NumNodesAtLevel[h];
    }
-
-   /* Initialize structures */
-   for (p=0; p<imgsize; p++)  mt->Status[p] = ST_NotAnalyzed;
-   bzero(nodeatlevel, NUMLEVELS*sizeof(bool));
-   bzero(numpixelsperlevel, NUMLEVELS*sizeof(ulong));
-   /* Following bzero is redundant, array is initialized by calloc */
-   /* bzero(mt->NumNodesAtLevel, NUMLEVELS*sizeof(ulong)); */
-   for (p=0; p<imgsize; p++)  numpixelsperlevel[pixmap[p]]++;
-   mt->NumPixelsBelowLevel[0] = 0;
-   for (l=1; l<NUMLEVELS; l++)
+   for (h=0; h<NUMLEVELS; h++)
    {
-      mt->NumPixelsBelowLevel[l] = mt->NumPixelsBelowLevel[l-1] + numpixelsperlevel[l-1];
+      for (i=0; i<mt->NumNodesAtLevel[h]; i++)
+      {
+         idx = mt->NumPixelsBelowLevel[h] + i;
+         parent = mt->Nodes[idx].Parent;
+         mt->Nodes[idx].Parent = parent - mt->NumPixelsBelowLevel[mt->Nodes[parent].Level]
+                                 + mt->NumNodesBelowLevel[mt->Nodes[parent].Level];
+      }
    }
-   hq = HQueueCreate(imgsize, numpixelsperlevel);
-   if (hq==NULL)
+   for (h=0; h<NUMLEVELS; h++)
    {
-      free(mt->Nodes);
-      free(mt->NumNodesAtLevel);
-      free(mt->NumPixelsBelowLevel);
-      free(mt->Status);
-      free(mt);
-      return(NULL);
+      memmove(mt->Nodes + mt->NumNodesBelowLevel[h], mt->Nodes + mt->NumPixelsBelowLevel[h],
+              mt->NumNodesAtLevel[h]*sizeof(MaxNode));
+      memmove(mt->Attributes + mt->NumNodesBelowLevel[h], mt->Attributes + mt->NumPixelsBelowLevel[h],
+              mt->NumNodesAtLevel[h]*sizeof(void *));
+   }
+   nodes = realloc(mt->Nodes, (n ? n : 1)*sizeof(MaxNode));
+   if (nodes)  mt->Nodes = nodes;
+   attributes = realloc(mt->Attributes, (n ? n : 1)*sizeof(void *));
+   if (attributes)  mt->Attributes = attributes;
+   mt->NumNodes = n;
+   free(mt->NumPixelsBelowLevel);
+   mt->NumPixelsBelowLevel = NULL;
+} /* MaxTreeCompact */
+
+
+
+bool MaxTreeUseNodeMap = true;
+
+void MaxTreeBuildNodeMap(MaxTree *mt, ImageGray *img, ubyte *shape)
+/* Stores the node index of every pixel of the compacted tree in NodeMap,
+ * so consumers need one load instead of reading Status and the image.
+ * The map is written over the Status array, which is released. */
+{
+   uint *nodemap = (uint *)(mt->Status), *shrunk;
+   ulong imgsize, p;
+
+   imgsize = (img->Width)*(img->Height);
+   /* Entry p of the map ends before Status[p] begins, so every Status
+    * entry is read before it is overwritten */
+   for (p=0; p<imgsize; p++)
+   {
+      if (shape[p])  nodemap[p] = mt->NumNodesBelowLevel[img->Pixmap[p]] + mt->Status[p];
+      else  nodemap[p] = MAXTREE_NoNode;
+   }
+   shrunk = realloc(nodemap, (imgsize ? imgsize : 1)*sizeof(uint));
+   mt->NodeMap = shrunk ? shrunk : nodemap;
+   mt->Status = NULL;
+} /* MaxTreeBuildNodeMap */
+
+
+
+MaxTreeRuns *MaxTreeRunsCreate(const MaxTree *mt, const ImageGray *img)
+/* Splits every row into maximal runs of pixels of one node. A first pass
+ * counts the runs so the array is allocated once at its final size. */
+{
+   MaxTreeRuns *runs;
+   MaxTreeRun *run;
+   ulong width = img->Width, height = img->Height;
+   ulong x, y, p, n, node, prev = 0;
+
+   runs = calloc(1, sizeof(MaxTreeRuns));
+   if (runs==NULL)  return(NULL);
+   runs->Width = width;
+   runs->Height = height;
+   runs->RowStart = malloc((height+1)*sizeof(ulong));
+   if (runs->RowStart==NULL)
+   {
+      free(runs);
+      return(NULL);
+   }
+   for (n=0, y=0, p=0; y<height; y++)
+   {
+      runs->RowStart[y] = n;
+      for (x=0; x<width; x++, p++)
+      {
+         node = MaxTreeNodeOf(mt, img, p);
+         if ((x==0) || (node!=prev))  n++;
+         prev = node;
+      }
+   }
+   runs->RowStart[height] = n;
+   runs->NumRuns = n;
+   runs->Runs = malloc((n ? n : 1)*sizeof(MaxTreeRun));
+   if (runs->Runs==NULL)
+   {
+      MaxTreeRunsDelete(runs);
+      return(NULL);
+   }
+   run = runs->Runs - 1;
+   for (y=0, p=0; y<height; y++)
+   {
+      for (x=0; x<width; x++, p++)
+      {
+         node = MaxTreeNodeOf(mt, img, p);
+         if ((x==0) || (node!=run->Node))
+         {
+            run++;
+            run->Start = x;
+            run->Length = 0;
+            run->Node = node;
+         }
+         run->Length++;
+      }
+   }
+   return(runs);
+} /* MaxTreeRunsCreate */
+
+
+
+void MaxTreeRunsDelete(MaxTreeRuns *runs)
+{
+   free(runs->Runs);
+   free(runs->RowStart);
+   free(runs);
+} /* MaxTreeRunsDelete */
+
+
+
+MaxTreeRuns *MaxTreeRunsPrune(const MaxTreeRuns *runs, const MaxTree *mt, const bool *keep)
+/* Copy of runs in which every node is replaced by its nearest ancestor with
+ * keep set, itself if it is set, and neighbouring runs that end up with the
+ * same node are joined. Roots (their own parent) always stay. Parents come
+ * before their children in Nodes, so the replacements are found in one pass. */
+{
+   MaxTreeRuns *pruned;
+   MaxTreeRun *run, *out;
+   uint *target;
+   ulong y, n, numnodes = mt->NumNodes;
+
+   target = malloc((numnodes ? numnodes : 1)*sizeof(uint));
+   if (target==NULL)  return(NULL);
+   for (n=0; n<numnodes; n++)
+   {
+      target[n] = ((mt->Nodes[n].Parent==n) || keep[n]) ? (uint) n : target[mt->Nodes[n].Parent];
+   }
+   pruned = calloc(1, sizeof(MaxTreeRuns));
+   if (pruned==NULL)
+   {
+      free(target);
+      return(NULL);
+   }
+   pruned->Width = runs->Width;
+   pruned->Height = runs->Height;
+   pruned->RowStart = malloc((runs->Height+1)*sizeof(ulong));
+   /* Joining only shrinks the runs, the array is trimmed afterwards */
+   pruned->Runs = malloc((runs->NumRuns ? runs->NumRuns : 1)*sizeof(MaxTreeRun));
+   if ((pruned->RowStart==NULL) || (pruned->Runs==NULL))
+   {
+      free(target);
+      MaxTreeRunsDelete(pruned);
+      return(NULL);
+   }
+   out = pruned->Runs;
+   for (y=0; y<runs->Height; y++)
+   {
+      pruned->RowStart[y] = out - pruned->Runs;
+      for (run = runs->Runs + runs->RowStart[y]; run < runs->Runs + runs->RowStart[y+1]; run++)
+      {
+         n = (run->Node==MAXTREE_NoNode) ? MAXTREE_NoNode : target[run->Node];
+         if ((out > pruned->Runs + pruned->RowStart[y]) && (out[-1].Node==n))
+            out[-1].Length += run->Length;
+         else
+         {
+            out->Start = run->Start;
+            out->Length = run->Length;
+            out->Node = (uint) n;
+            out++;
+         }
+      }
+   }
+   pruned->NumRuns = pruned->RowStart[runs->Height] = out - pruned->Runs;
+   run = realloc(pruned->Runs, (pruned->NumRuns ? pruned->NumRuns : 1)*sizeof(MaxTreeRun));
+   if (run)  pruned->Runs = run;
+   free(target);
+   return(pruned);
+} /* MaxTreeRunsPrune */
+
+
+
+MaxTreeRuns *MaxTreeBuildRuns(MaxTree *mt, ImageGray *img)
+{
+   if (mt->Runs==NULL)  mt->Runs = MaxTreeRunsCreate(mt, img);
+   return(mt->Runs);
+} /* MaxTreeBuildRuns */
+
+
+
+void MaxTreeInit(MaxTree *mt, ImageGray *img, ulong *numpixelsperlevel)
+{
+   ubyte *pixmap = img->Pixmap;
+   ulong imgsize, p;
+   int l;
+
+   imgsize = (img->Width)*(img->Height);
+   for (p=0; p<imgsize; p++)  mt->Status[p] = ST_NotAnalyzed;
+   bzero(numpixelsperlevel, NUMLEVELS*sizeof(ulong));
+   /* Following bzero is redundant, array is initialized by calloc */
+   /* bzero(mt->NumNodesAtLevel, NUMLEVELS*sizeof(ulong)); */
+   for (p=0; p<imgsize; p++)  numpixelsperlevel[pixmap[p]]++;
+   mt->NumPixelsBelowLevel[0] = 0;
+   for (l=1; l<NUMLEVELS; l++)
+   {
+      mt->NumPixelsBelowLevel[l] = mt->NumPixelsBelowLevel[l-1] + numpixelsperlevel[l-1];
+   }
+} /* MaxTreeInit */
+
+
+
+MaxTree *MaxTreeCreate(ImageGray *img, ImageGray *template,
+                       void *(*newauxdata)(ulong, ulong, int, ulong *, ImageGray *),
+                       void (*addtoauxdata)(void *, ulong, ulong, int, ulong *, ImageGray *),
+                       void (*mergeauxdata)(void *, void *),
+                       void (*deleteauxdata)(void *))
+{
+   ulong numpixelsperlevel[NUMLEVELS];
+   bool nodeatlevel[NUMLEVELS];
+   FloodFrame *stack;
+   HQueue *hq;
+   MaxTree *mt;
+   ubyte *pixmap = img->Pixmap;
+   ulong imgsize, p, m=0;
+   int l;
+
+   /* Allocate structures */
+   imgsize = (img->Width)*(img->Height);
+   mt = MaxTreeAlloc(imgsize);
+   if (mt==NULL)  return(NULL);
+
+   /* Initialize structures */
+   MaxTreeInit(mt, img, numpixelsperlevel);
+   bzero(nodeatlevel, NUMLEVELS*sizeof(bool));
+   hq = HQueueCreate(imgsize, numpixelsperlevel);
+   if (hq==NULL)
+   {
+      MaxTreeFree(mt);
+      return(NULL);
+   }
+   stack = malloc(NUMLEVELS*sizeof(FloodFrame));
+   if (stack==NULL)
+   {
+      HQueueDelete(hq);
+      MaxTreeFree(mt);
+      return(NULL);
    }
 
    /* Find pixel m which has the lowest intensity l in the image */
@@ -1357,72 +2322,803 @@ MaxTree *MaxTreeCreate(ImageGray *img, ImageGray *template,
    mt->AddToAuxData = addtoauxdata;
    mt->MergeAuxData = mergeauxdata;
    mt->DeleteAuxData = deleteauxdata;
-   l = MaxTreeFlood(mt, hq, numpixelsperlevel, nodeatlevel, img,
-                    template->Pixmap, l, &area, &attr);
-   if (l>=NUMLEVELS)  MaxTreeDelete(mt);
+   AuxArenaBegin(&(mt->Arena), imgsize);
+   l = MaxTreeFloodOf(mt)(mt, hq, nodeatlevel, img, template->Pixmap, l, stack);
+   AuxArenaEnd();
+   free(stack);
    HQueueDelete(hq);
+   if (l>=NUMLEVELS)
+   {
+      MaxTreeDelete(mt);
+      return(NULL);
+   }
+   MaxTreeCompact(mt);
+   if (MaxTreeUseNodeMap)  MaxTreeBuildNodeMap(mt, img, template->Pixmap);
    return(mt);
 } /* MaxTreeCreate */
 
 
 
-void MaxTreeDelete(MaxTree *mt)
+/****** Union-find Max-tree construction [5,6] ******************************/
+
+ulong UFFindRoot(ulong *zpar, ulong p)
 {
-   void *attr;
-   ulong i;
+   ulong r=p, q;
+
+   while (zpar[r]!=r)  r = zpar[r];
+   /* Path compression */
+   while (zpar[p]!=r)
+   {
+      q = zpar[p];
+      zpar[p] = r;
+      p = q;
+   }
+   return(r);
+} /* UFFindRoot */
+
+
+
+void UFSortPixels(ImageGray *img, ubyte *shape, ulong *sorted, ulong *numsorted)
+/* Counting sort of the pixels inside shape on increasing gray level */
+{
+   ulong first[NUMLEVELS];
+   ubyte *pixmap = img->Pixmap;
+   ulong imgsize, p, n=0, count;
+   int l;
+
+   imgsize = (img->Width)*(img->Height);
+   bzero(first, NUMLEVELS*sizeof(ulong));
+   for (p=0; p<imgsize; p++)
+   {
+      if (shape[p])  first[pixmap[p]]++;
+   }
+   for (l=0; l<NUMLEVELS; l++)
+   {
+      count = first[l];
+      first[l] = n;
+      n += count;
+   }
+   for (p=0; p<imgsize; p++)
+   {
+      if (shape[p])  sorted[first[pixmap[p]]++] = p;
+   }
+   *numsorted = n;
+} /* UFSortPixels */
+
+
+
+void UFBuildParents(ImageGray *img, ubyte *shape, ulong *sorted, ulong numsorted,
+                    ulong *parent, ulong *zpar, ulong *repr, ubyte *rank)
+/* Processes the pixels from bright to dark, attaching the components of
+ * already processed neighbors to the current pixel, then makes every parent
+ * point to the canonical pixel of its node. The union-find forest zpar uses
+ * union by rank; repr holds the pixel of the tree that a zpar root stands
+ * for. */
+{
+   ulong neighbors[CONNECTIVITY];
+   ubyte *pixmap = img->Pixmap;
+   ulong imgwidth, imgsize, i, p, q, zp, zq;
+   int numneighbors, j;
+
+   imgwidth = img->Width;
+   imgsize = imgwidth * (img->Height);
+   for (p=0; p<imgsize; p++)  zpar[p] = UF_Unprocessed;
+   for (i=numsorted; i-->0; )
+   {
+      p = sorted[i];
+      parent[p] = zpar[p] = repr[p] = zp = p;
+      rank[p] = 0;
+      numneighbors = GetNeighbors(shape, imgwidth, imgsize, p, neighbors);
+      for (j=0; j<numneighbors; j++)
+      {
+         q = neighbors[j];
+         if (zpar[q]!=UF_Unprocessed)
+         {
+            zq = UFFindRoot(zpar, q);
+            if (zq!=zp)
+            {
+               parent[repr[zq]] = p;
+               if (rank[zp]<rank[zq])
+               {
+                  zpar[zp] = zq;
+                  zp = zq;
+               }
+               else
+               {
+                  zpar[zq] = zp;
+                  if (rank[zp]==rank[zq])  rank[zp]++;
+               }
+               repr[zp] = p;
+            }
+         }
+      }
+   }
+   for (i=0; i<numsorted; i++)
+   {
+      p = sorted[i];
+      q = parent[p];
+      if (pixmap[parent[q]]==pixmap[q])  parent[p] = parent[q];
+   }
+} /* UFBuildParents */
+
+
+
+void MaxTreeMergeSubtrees(MaxTree *mt)
+/* Adds the area and attribute of every node to its parent, from the highest
+ * level down, for builders that first gather the pixels of each node */
+{
+   MaxNode *node;
+   ulong i, idx;
    int h;
 
-   for (h=0; h<NUMLEVELS; h++)
+   for (h=NUMLEVELS-1; h>=0; h--)
    {
       for (i=0; i<mt->NumNodesAtLevel[h]; i++)
       {
-         attr = mt->Nodes[mt->NumPixelsBelowLevel[h]+i].Attribute;
-         if (attr)  mt->DeleteAuxData(attr);
+         idx = mt->NumPixelsBelowLevel[h] + i;
+         node = mt->Nodes + idx;
+         if (node->Parent!=idx)
+         {
+            mt->Nodes[node->Parent].Area += node->Area;
+            mt->MergeAuxData(mt->Attributes[node->Parent], mt->Attributes[idx]);
+         }
       }
    }
-   free(mt->Nodes);
-   free(mt->NumNodesAtLevel);
-   free(mt->NumPixelsBelowLevel);
-   free(mt->Status);
-   free(mt);
+} /* MaxTreeMergeSubtrees */
+
+
+
+int MaxTreeFromParents(MaxTree *mt, ImageGray *img, ubyte *shape,
+                       ulong *sorted, ulong numsorted, ulong *parent)
+/* Numbers the nodes level by level in the order of sorted, fills Status and
+ * Nodes, then computes the attributes: first from the pixels of each node
+ * in raster order, then by merging every node into its parent from the
+ * highest level down. Returns -1 if an attribute could not be allocated. */
+{
+   ulong neighbors[CONNECTIVITY];
+   ubyte *pixmap = img->Pixmap;
+   MaxNode *node;
+   ulong imgwidth, imgsize, i, p, q, idx;
+   int numneighbors, h;
+
+   imgwidth = img->Width;
+   imgsize = imgwidth * (img->Height);
+   for (i=0; i<numsorted; i++)
+   {
+      p = sorted[i];
+      q = parent[p];
+      h = pixmap[p];
+      if ((q==p) || (pixmap[q]!=h))
+      {
+         mt->Status[p] = mt->NumNodesAtLevel[h]++;
+         idx = mt->NumPixelsBelowLevel[h] + mt->Status[p];
+         node = mt->Nodes + idx;
+         if (q==p)  node->Parent = idx;
+         else  node->Parent = mt->NumPixelsBelowLevel[pixmap[q]] + mt->Status[q];
+         node->Level = h;
+      }
+      else  mt->Status[p] = mt->Status[q];
+   }
+   for (p=0; p<imgsize; p++)
+   {
+      if (shape[p])
+      {
+         idx = mt->NumPixelsBelowLevel[pixmap[p]] + mt->Status[p];
+         numneighbors = GetNeighbors(shape, imgwidth, imgsize, p, neighbors);
+         mt->Nodes[idx].Area++;
+         if (mt->Attributes[idx])  mt->AddToAuxData(mt->Attributes[idx], p%imgwidth, p/imgwidth, numneighbors, neighbors, img);
+         else
+         {
+            mt->Attributes[idx] = mt->NewAuxData(p%imgwidth, p/imgwidth, numneighbors, neighbors, img);
+            if (mt->Attributes[idx]==NULL)  return(-1);
+         }
+      }
+   }
+   MaxTreeMergeSubtrees(mt);
+   return(0);
+} /* MaxTreeFromParents */
+
+
+
+MaxTree *MaxTreeCreateUnionFind(ImageGray *img, ImageGray *template,
+                                void *(*newauxdata)(ulong, ulong, int, ulong *, ImageGray *),
+                                void (*addtoauxdata)(void *, ulong, ulong, int, ulong *, ImageGray *),
+                                void (*mergeauxdata)(void *, void *),
+                                void (*deleteauxdata)(void *))
+/* Builds the same Max-tree as MaxTreeCreate from pixels sorted by a counting
+ * sort and a union-find with path compression. Nodes within a level may be
+ * numbered differently. Unlike the flooding, every connected component of
+ * the template gets its own root. */
+{
+   ulong numpixelsperlevel[NUMLEVELS];
+   MaxTree *mt;
+   ulong *sorted, *parent, *zpar;
+   ubyte *rank;
+   ulong imgsize, numsorted;
+   int r;
+
+   imgsize = (img->Width)*(img->Height);
+   mt = MaxTreeAlloc(imgsize);
+   if (mt==NULL)  return(NULL);
+   MaxTreeInit(mt, img, numpixelsperlevel);
+   mt->NewAuxData = newauxdata;
+   mt->AddToAuxData = addtoauxdata;
+   mt->MergeAuxData = mergeauxdata;
+   mt->DeleteAuxData = deleteauxdata;
+   sorted = malloc(imgsize*sizeof(ulong));
+   parent = malloc(imgsize*sizeof(ulong));
+   zpar = malloc(imgsize*sizeof(ulong));
+   rank = malloc(imgsize*sizeof(ubyte));
+   if ((sorted==NULL) || (parent==NULL) || (zpar==NULL) || (rank==NULL))
+   {
+      free(rank);
+      free(zpar);
+      free(parent);
+      free(sorted);
+      MaxTreeFree(mt);
+      return(NULL);
+   }
+   UFSortPixels(img, template->Pixmap, sorted, &numsorted);
+   /* Status is not filled before MaxTreeFromParents, lend it as repr */
+   UFBuildParents(img, template->Pixmap, sorted, numsorted, parent, zpar,
+                  (ulong *)(mt->Status), rank);
+   free(rank);
+   free(zpar);
+   AuxArenaBegin(&(mt->Arena), imgsize);
+   r = MaxTreeFromParents(mt, img, template->Pixmap, sorted, numsorted, parent);
+   AuxArenaEnd();
+   free(parent);
+   free(sorted);
+   if (r)
+   {
+      MaxTreeDelete(mt);
+      return(NULL);
+   }
+   MaxTreeCompact(mt);
+   if (MaxTreeUseNodeMap)  MaxTreeBuildNodeMap(mt, img, template->Pixmap);
+   return(mt);
+} /* MaxTreeCreateUnionFind */
+
+
+
+/****** Concurrent Max-tree construction on image strips [7] ******************************/
+
+int MaxTreeNumThreads = 0;
+
+typedef struct StripBuilder StripBuilder;
+
+typedef struct StripJob
+{
+   StripBuilder *sb;
+   ulong Begin, End;  /* pixels [Begin,End) of this strip */
+   ulong NodeOffset[NUMLEVELS];  /* canonical pixels per level, then index of the first one */
+   ulong *Foreign;  /* canonical pixels of the strip tree merged into a node of another strip */
+   ulong NumForeign;
+   AuxArena *Arena;  /* attribute data allocated by this thread */
+   int Index;
+   int Error;
+} StripJob;
+
+struct StripBuilder
+{
+   MaxTree *mt;
+   ImageGray *img;
+   ubyte *shape;
+   ulong *sorted;  /* pixels of each strip sorted on level, later the canonical pixel of each pixel */
+   ulong *parent;
+   ulong *zpar;    /* union-find forest, later the canonical pixel in the strip tree */
+   ubyte *rank;
+   void **partialattr;  /* attributes of the foreign canonical pixels */
+   ulong *partialarea;
+   StripJob *jobs;
+   int NumStrips;
+   pthread_barrier_t Barrier;
+   /* The strips wait at the gate until every one has a thread, as the
+    * barriers need all of them */
+   pthread_mutex_t GateLock;
+   pthread_cond_t GateCond;
+   int Gate;
+};
+
+#define STRIP_GATE_CLOSED  0
+#define STRIP_GATE_OPEN    1
+#define STRIP_GATE_ABORT   2
+
+void StripGateSet(StripBuilder *sb, int gate)
+{
+   pthread_mutex_lock(&(sb->GateLock));
+   sb->Gate = gate;
+   pthread_cond_broadcast(&(sb->GateCond));
+   pthread_mutex_unlock(&(sb->GateLock));
+} /* StripGateSet */
+
+int StripGateWait(StripBuilder *sb)
+/* Returns STRIP_GATE_OPEN or STRIP_GATE_ABORT once set */
+{
+   int gate;
+
+   pthread_mutex_lock(&(sb->GateLock));
+   while (sb->Gate==STRIP_GATE_CLOSED)  pthread_cond_wait(&(sb->GateCond), &(sb->GateLock));
+   gate = sb->Gate;
+   pthread_mutex_unlock(&(sb->GateLock));
+   return(gate);
+} /* StripGateWait */
+
+
+
+ulong UFLevelRoot(ubyte *pixmap, ulong *parent, ulong p)
+/* Canonical pixel of the node of p */
+{
+   while ((parent[p]!=p) && (pixmap[parent[p]]==pixmap[p]))  p = parent[p];
+   return(p);
+} /* UFLevelRoot */
+
+
+
+ulong UFLevelRootCompress(ubyte *pixmap, ulong *parent, ulong p)
+{
+   ulong r, q;
+
+   r = UFLevelRoot(pixmap, parent, p);
+   while (p!=r)
+   {
+      q = parent[p];
+      parent[p] = r;
+      p = q;
+   }
+   return(r);
+} /* UFLevelRootCompress */
+
+
+
+void UFConnect(ubyte *pixmap, ulong *parent, ulong x, ulong y)
+/* Merges the trees of the adjacent pixels x and y: their ancestor chains
+ * are interleaved by level, nodes at equal levels become one node [7] */
+{
+   ulong z, t;
+   bool bottom=false;
+
+   x = UFLevelRootCompress(pixmap, parent, x);
+   y = UFLevelRootCompress(pixmap, parent, y);
+   if (pixmap[y]>pixmap[x])
+   {
+      t = x;
+      x = y;
+      y = t;
+   }
+   while ((x!=y) && !bottom)
+   {
+      if (parent[x]!=x)  z = UFLevelRootCompress(pixmap, parent, parent[x]);
+      else  z = x;
+      if ((z!=x) && (pixmap[z]>=pixmap[y]))  x = z;
+      else
+      {
+         parent[x] = y;
+         bottom = (z==x);
+         x = y;
+         y = z;
+      }
+   }
+} /* UFConnect */
+
+
+
+void *MaxTreeStripWorker(void *arg)
+{
+   StripJob *job = arg, *other;
+   StripBuilder *sb = job->sb;
+   MaxTree *mt = sb->mt;
+   ImageGray strip, *img = sb->img;
+   ubyte *pixmap = img->Pixmap, *shape = sb->shape;
+   ulong *canon = sb->sorted, *stripcanon = sb->zpar, *parent = sb->parent;
+   ulong neighbors[CONNECTIVITY];
+   ulong imgwidth, imgsize, offset, numsorted, p, q, c, idx, x, *foreign;
+   void **attr;
+   int numneighbors, step, s, h;
+
+   if (StripGateWait(sb)!=STRIP_GATE_OPEN)  return(NULL);
+   /* Build the tree of the strip on its own */
+   imgwidth = img->Width;
+   imgsize = imgwidth * (img->Height);
+   offset = job->Begin;
+   strip.Width = imgwidth;
+   strip.Height = (job->End - job->Begin)/imgwidth;
+   strip.Pixmap = pixmap + offset;
+   UFSortPixels(&strip, shape+offset, sb->sorted+offset, &numsorted);
+   /* Status is not filled yet, lend it as repr */
+   UFBuildParents(&strip, shape+offset, sb->sorted+offset, numsorted, parent+offset,
+                  sb->zpar+offset, ((ulong *)(mt->Status))+offset, sb->rank+offset);
+   for (p=job->Begin; p<job->End; p++)
+   {
+      if (shape[p])
+      {
+         parent[p] += offset;
+         if ((parent[p]!=p) && (pixmap[parent[p]]==pixmap[p]))  stripcanon[p] = parent[p];
+         else  stripcanon[p] = p;
+      }
+   }
+   pthread_barrier_wait(&(sb->Barrier));
+
+   /* Merge neighboring strips pairwise along their boundary rows */
+   for (step=1; step<sb->NumStrips; step*=2)
+   {
+      if ((job->Index%(2*step)==0) && (job->Index+step<sb->NumStrips))
+      {
+         other = sb->jobs + (job->Index+step);
+         for (x=0; x<imgwidth; x++)
+         {
+            q = other->Begin + x;
+            if (shape[q] && shape[q-imgwidth])  UFConnect(pixmap, parent, q-imgwidth, q);
+         }
+      }
+      pthread_barrier_wait(&(sb->Barrier));
+   }
+
+   /* Number the canonical pixels of the strip, level by level after those
+    * of the strips above */
+   bzero(job->NodeOffset, NUMLEVELS*sizeof(ulong));
+   for (p=job->Begin; p<job->End; p++)
+   {
+      if (shape[p])
+      {
+         canon[p] = UFLevelRoot(pixmap, parent, p);
+         if (canon[p]==p)  job->NodeOffset[pixmap[p]]++;
+      }
+   }
+   pthread_barrier_wait(&(sb->Barrier));
+   if (job->Index==0)
+   {
+      for (h=0; h<NUMLEVELS; h++)
+      {
+         for (s=0; s<sb->NumStrips; s++)
+         {
+            c = sb->jobs[s].NodeOffset[h];
+            sb->jobs[s].NodeOffset[h] = mt->NumNodesAtLevel[h];
+            mt->NumNodesAtLevel[h] += c;
+         }
+      }
+   }
+   pthread_barrier_wait(&(sb->Barrier));
+   for (p=job->Begin; p<job->End; p++)
+   {
+      if (shape[p] && (canon[p]==p))  mt->Status[p] = job->NodeOffset[pixmap[p]]++;
+   }
+   pthread_barrier_wait(&(sb->Barrier));
+   for (p=job->Begin; p<job->End; p++)
+   {
+      if (shape[p])
+      {
+         if (canon[p]==p)
+         {
+            idx = mt->NumPixelsBelowLevel[pixmap[p]] + mt->Status[p];
+            q = canon[parent[p]];
+            if (q==p)  mt->Nodes[idx].Parent = idx;
+            else  mt->Nodes[idx].Parent = mt->NumPixelsBelowLevel[pixmap[q]] + mt->Status[q];
+            mt->Nodes[idx].Level = pixmap[p];
+         }
+         else  mt->Status[p] = mt->Status[canon[p]];
+      }
+   }
+
+   /* Gather the attributes of the strip. Nodes whose canonical pixel lies
+    * in this strip are filled directly, the others through partial
+    * attributes kept at the canonical pixel of the strip tree. */
+   AuxArenaBegin(&(job->Arena), job->End - job->Begin);
+   for (p=job->Begin; p<job->End; p++)
+   {
+      if (shape[p])
+      {
+         c = stripcanon[p];
+         idx = mt->NumPixelsBelowLevel[pixmap[p]] + mt->Status[p];
+         if (canon[c]==c)
+         {
+            mt->Nodes[idx].Area++;
+            attr = mt->Attributes + idx;
+         }
+         else
+         {
+            sb->partialarea[c]++;
+            attr = sb->partialattr + c;
+         }
+         numneighbors = GetNeighbors(shape, imgwidth, imgsize, p, neighbors);
+         if (*attr)  mt->AddToAuxData(*attr, p%imgwidth, p/imgwidth, numneighbors, neighbors, img);
+         else
+         {
+            *attr = mt->NewAuxData(p%imgwidth, p/imgwidth, numneighbors, neighbors, img);
+            if (*attr==NULL)
+            {
+               AuxArenaEnd();
+               job->Error = 1;
+               return(NULL);
+            }
+            if (canon[c]!=c)
+            {
+               if ((job->NumForeign & (job->NumForeign+1))==0)
+               {
+                  foreign = realloc(job->Foreign, 2*(job->NumForeign+1)*sizeof(ulong));
+                  if (foreign==NULL)
+                  {
+                     AuxArenaEnd();
+                     job->Error = 1;
+                     return(NULL);
+                  }
+                  job->Foreign = foreign;
+               }
+               job->Foreign[job->NumForeign++] = c;
+            }
+         }
+      }
+   }
+   AuxArenaEnd();
+   return(NULL);
+} /* MaxTreeStripWorker */
+
+
+
+MaxTree *MaxTreeCreateParallel(ImageGray *img, ImageGray *template,
+                               void *(*newauxdata)(ulong, ulong, int, ulong *, ImageGray *),
+                               void (*addtoauxdata)(void *, ulong, ulong, int, ulong *, ImageGray *),
+                               void (*mergeauxdata)(void *, void *),
+                               void (*deleteauxdata)(void *),
+                               int numthreads)
+/* Builds the Max-tree with numthreads threads. Every thread builds the
+ * union-find tree of a horizontal strip, the strip trees are merged along
+ * the boundary rows in a binary reduction as in [7], after which the
+ * threads number the nodes and gather the attributes of their strips.
+ * Attributes of nodes spanning several strips are combined with the
+ * MergeAuxData callback. The tree equals the one of MaxTreeCreateUnionFind
+ * up to the numbering of nodes within a level. If not every thread can be
+ * started, the tree is built again with as many strips as threads were. */
+{
+   ulong numpixelsperlevel[NUMLEVELS];
+   StripBuilder sb;
+   pthread_t *threads;
+   MaxTree *mt;
+   StripJob *job;
+   ulong imgsize, rows, i, c, idx;
+   int s, started, error=0;
+
+   imgsize = (img->Width)*(img->Height);
+   if (numthreads<1)  numthreads = 1;
+   if ((ulong)numthreads>img->Height)  numthreads = (img->Height) ? img->Height : 1;
+   mt = MaxTreeAlloc(imgsize);
+   if (mt==NULL)  return(NULL);
+   MaxTreeInit(mt, img, numpixelsperlevel);
+   mt->NewAuxData = newauxdata;
+   mt->AddToAuxData = addtoauxdata;
+   mt->MergeAuxData = mergeauxdata;
+   mt->DeleteAuxData = deleteauxdata;
+   sb.mt = mt;
+   sb.img = img;
+   sb.shape = template->Pixmap;
+   sb.NumStrips = numthreads;
+   sb.sorted = malloc(imgsize*sizeof(ulong));
+   sb.parent = malloc(imgsize*sizeof(ulong));
+   sb.zpar = malloc(imgsize*sizeof(ulong));
+   sb.rank = malloc(imgsize*sizeof(ubyte));
+   sb.partialattr = calloc((size_t)imgsize, sizeof(void *));
+   sb.partialarea = calloc((size_t)imgsize, sizeof(ulong));
+   sb.jobs = calloc((size_t)numthreads, sizeof(StripJob));
+   threads = calloc((size_t)numthreads, sizeof(pthread_t));
+   if ((sb.sorted==NULL) || (sb.parent==NULL) || (sb.zpar==NULL) || (sb.rank==NULL) ||
+       (sb.partialattr==NULL) || (sb.partialarea==NULL) || (sb.jobs==NULL) || (threads==NULL))
+   {
+      error = 1;
+      numthreads = 0;
+   }
+   else
+   {
+      pthread_barrier_init(&(sb.Barrier), NULL, numthreads);
+      pthread_mutex_init(&(sb.GateLock), NULL);
+      pthread_cond_init(&(sb.GateCond), NULL);
+      sb.Gate = STRIP_GATE_CLOSED;
+   }
+
+   /* Strips of whole rows, the first ones get the remainder */
+   rows = 0;
+   for (s=0; s<numthreads; s++)
+   {
+      job = sb.jobs + s;
+      job->sb = &sb;
+      job->Index = s;
+      job->Begin = rows*(img->Width);
+      rows += (img->Height)/numthreads + (((ulong)s<(img->Height)%numthreads) ? 1 : 0);
+      job->End = rows*(img->Width);
+   }
+   started = numthreads;
+   for (s=1; s<numthreads; s++)
+   {
+      if (pthread_create(threads+s, NULL, MaxTreeStripWorker, sb.jobs+s))
+      {
+         started = s;
+         break;
+      }
+   }
+   if (numthreads)
+   {
+      /* Without all threads the barriers would never open, so the started
+       * ones return at once */
+      StripGateSet(&sb, (started==numthreads) ? STRIP_GATE_OPEN : STRIP_GATE_ABORT);
+      if (started==numthreads)  MaxTreeStripWorker(sb.jobs);
+      else  error = 1;
+   }
+   for (s=1; s<started; s++)  pthread_join(threads[s], NULL);
+   if (numthreads)
+   {
+      pthread_barrier_destroy(&(sb.Barrier));
+      pthread_cond_destroy(&(sb.GateCond));
+      pthread_mutex_destroy(&(sb.GateLock));
+   }
+
+   /* Add the partial attributes to their nodes */
+   AuxArenaBegin(&(mt->Arena), imgsize);
+   for (s=0; s<numthreads; s++)
+   {
+      job = sb.jobs + s;
+      AuxArenaAppend(&(mt->Arena), job->Arena);
+      error |= job->Error;
+      for (i=0; i<job->NumForeign; i++)
+      {
+         c = job->Foreign[i];
+         if (!error)
+         {
+            idx = mt->NumPixelsBelowLevel[img->Pixmap[c]] + mt->Status[c];
+            mt->Nodes[idx].Area += sb.partialarea[c];
+            mt->MergeAuxData(mt->Attributes[idx], sb.partialattr[c]);
+         }
+         mt->DeleteAuxData(sb.partialattr[c]);
+      }
+      free(job->Foreign);
+   }
+   AuxArenaEnd();
+   if (!error)  MaxTreeMergeSubtrees(mt);
+   free(threads);
+   free(sb.jobs);
+   free(sb.partialarea);
+   free(sb.partialattr);
+   free(sb.rank);
+   free(sb.zpar);
+   free(sb.parent);
+   free(sb.sorted);
+   if (error)
+   {
+      MaxTreeDelete(mt);
+      if (started<numthreads)
+         return(MaxTreeCreateParallel(img, template, newauxdata, addtoauxdata, mergeauxdata,
+                                      deleteauxdata, started));
+      return(NULL);
+   }
+   MaxTreeCompact(mt);
+   if (MaxTreeUseNodeMap)  MaxTreeBuildNodeMap(mt, img, template->Pixmap);
+   return(mt);
+} /* MaxTreeCreateParallel */
+
+
+
+MaxTree *MaxTreeCreateStrips(ImageGray *img, ImageGray *template,
+                             void *(*newauxdata)(ulong, ulong, int, ulong *, ImageGray *),
+                             void (*addtoauxdata)(void *, ulong, ulong, int, ulong *, ImageGray *),
+                             void (*mergeauxdata)(void *, void *),
+                             void (*deleteauxdata)(void *))
+/* MaxTreeCreateParallel with MaxTreeNumThreads threads, or one per
+ * processor if that is 0 */
+{
+   int numthreads = MaxTreeNumThreads;
+
+   if (numthreads<1)  numthreads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+   return(MaxTreeCreateParallel(img, template, newauxdata, addtoauxdata, mergeauxdata,
+                                deleteauxdata, numthreads));
+} /* MaxTreeCreateStrips */
+
+
+
+void MaxTreeDelete(MaxTree *mt)
+{
+   ulong i;
+
+   if (mt->Arena)  AuxArenaDelete(mt->Arena);
+   else
+   {
+      /* Entries without a node are NULL, also before MaxTreeCompact */
+      for (i=0; i<mt->NumNodes; i++)
+      {
+         if (mt->Attributes[i])  mt->DeleteAuxData(mt->Attributes[i]);
+      }
+   }
+   MaxTreeFree(mt);
 } /* MaxTreeDelete */
 
 
 
+double *MaxTreeAttribValuesCreate(MaxTree *mt, double (*attribute)(void *))
+/* Attribute values of all nodes for the filters, NULL if there is no memory
+ * for them, in which case the filters evaluate attribute node by node */
+{
+   double *values;
+
+   values = malloc((mt->NumNodes ? mt->NumNodes : 1)*sizeof(double));
+   if (values)  MaxTreeAttribValues(mt, attribute, values);
+   return(values);
+} /* MaxTreeAttribValuesCreate */
+
+#define FilterAttribute(idx)  (values ? values[idx] : (*attribute)(mt->Attributes[idx]))
+
+
+
+/* Mean run length from which filling runs beats the per-pixel loop; the
+ * max-trees of textured images have mostly single pixel runs */
+#define RUNS_MinLength  4
+
+void MaxTreeWriteLevels(MaxTree *mt, ImageGray *img, ImageGray *template,
+                        ImageGray *out)
+/* Writes the filtered level of the node of every pixel of the template */
+{
+   MaxNode *nodes = mt->Nodes;
+   uint *nodemap = mt->NodeMap;
+   ubyte *shape = template->Pixmap;
+   MaxTreeRun *run, *end;
+   ulong i, imgsize;
+
+   imgsize = (img->Width)*(img->Height);
+   if (mt->Runs && (mt->Runs->NumRuns*RUNS_MinLength<=imgsize))
+   {
+      /* A run lies in one row, outside the template its node is NoNode */
+      for (i=0; i<mt->Runs->Height; i++)
+      {
+         run = mt->Runs->Runs + mt->Runs->RowStart[i];
+         end = mt->Runs->Runs + mt->Runs->RowStart[i+1];
+         for (; run<end; run++)
+         {
+            if (run->Node!=MAXTREE_NoNode)
+               memset(out->Pixmap + i*(img->Width) + run->Start, nodes[run->Node].NewLevel, run->Length);
+         }
+      }
+   } else if (nodemap)
+   {
+      for (i=0; i<imgsize; i++)
+      {
+         if (shape[i])  out->Pixmap[i] = nodes[nodemap[i]].NewLevel;
+      }
+   } else {
+      for (i=0; i<imgsize; i++)
+      {
+         if (shape[i])  out->Pixmap[i] = nodes[mt->NumNodesBelowLevel[img->Pixmap[i]] + mt->Status[i]].NewLevel;
+      }
+   }
+} /* MaxTreeWriteLevels */
+
+
+
 void MaxTreeFilterMin(MaxTree *mt, ImageGray *img, ImageGray *template,
                       ImageGray *out, double (*attribute)(void *),
                       double lambda)
 {
    MaxNode *node, *parnode;
-   ubyte *shape = template->Pixmap;
+   double *values;
    ulong i, idx, parent;
    int l;
 
+   values = MaxTreeAttribValuesCreate(mt, attribute);
+
    for (l=0; l<NUMLEVELS; l++)
    {
       for (i=0; i<mt->NumNodesAtLevel[l]; i++)
       {
-         idx = mt->NumPixelsBelowLevel[l] + i;
+         idx = mt->NumNodesBelowLevel[l] + i;
          node = &(mt->Nodes[idx]);
          parent = node->Parent;
          if (idx!=parent)
          {
             parnode = &(mt->Nodes[parent]);
-            if (((*attribute)(node->Attribute) < lambda) || (parnode->Level!=parnode->NewLevel))
+            if ((FilterAttribute(idx) < lambda) || (parnode->Level!=parnode->NewLevel))
             {
                node->NewLevel = parnode->NewLevel;
             } else  node->NewLevel = node->Level;
          }
       }
    }
-   for (i=0; i<(img->Width)*(img->Height); i++)
-   {
-      if (shape[i])
-      {
-         idx = mt->NumPixelsBelowLevel[img->Pixmap[i]] + mt->Status[i];
-         out->Pixmap[i] = mt->Nodes[idx].NewLevel;
-      }
-   }
+   MaxTreeWriteLevels(mt, img, template, out);
+   free(values);
 } /* MaxTreeFilterMin */
 
 
@@ -1432,32 +3128,28 @@ void MaxTreeFilterDirect(MaxTree *mt, ImageGray *img, ImageGray *template,
                          double lambda)
 {
    MaxNode *node;
-   ubyte *shape = template->Pixmap;
+   double *values;
    ulong i, idx, parent;
    int l;
 
+   values = MaxTreeAttribValuesCreate(mt, attribute);
+
    for (l=0; l<NUMLEVELS; l++)
    {
       for (i=0; i<mt->NumNodesAtLevel[l]; i++)
       {
-         idx = mt->NumPixelsBelowLevel[l] + i;
+         idx = mt->NumNodesBelowLevel[l] + i;
          node = &(mt->Nodes[idx]);
          parent = node->Parent;
          if (idx!=parent)
          {
-            if ((*attribute)(node->Attribute) < lambda)  node->NewLevel = mt->Nodes[parent].NewLevel;
+            if (FilterAttribute(idx) < lambda)  node->NewLevel = mt->Nodes[parent].NewLevel;
             else  node->NewLevel = node->Level;
          }
       }
    }
-   for (i=0; i<(img->Width)*(img->Height); i++)
-   {
-      if (shape[i])
-      {
-         idx = mt->NumPixelsBelowLevel[img->Pixmap[i]] + mt->Status[i];
-         out->Pixmap[i] = mt->Nodes[idx].NewLevel;
-      }
-   }
+   MaxTreeWriteLevels(mt, img, template, out);
+   free(values);
 } /* MaxTreeFilterDirect */
 
 
@@ -1467,20 +3159,22 @@ void MaxTreeFilterMax(MaxTree *mt, ImageGray *img, ImageGray *template,
                       double lambda)
 {
    MaxNode *node;
-   ubyte *shape = template->Pixmap;
+   double *values;
    ulong i, idx, parent;
    int l;
 
+   values = MaxTreeAttribValuesCreate(mt, attribute);
+
    for (l=0; l<NUMLEVELS; l++)
    {
       for (i=0; i<mt->NumNodesAtLevel[l]; i++)
       {
-         idx = mt->NumPixelsBelowLevel[l] + i;
+         idx = mt->NumNodesBelowLevel[l] + i;
          node = &(mt->Nodes[idx]);
          parent = node->Parent;
          if (idx!=parent)
          {
-            if ((*attribute)(node->Attribute) < lambda)  node->NewLevel = mt->Nodes[parent].NewLevel;
+            if (FilterAttribute(idx) < lambda)  node->NewLevel = mt->Nodes[parent].NewLevel;
             else  node->NewLevel = node->Level;
          }
       }
@@ -1489,7 +3183,7 @@ void MaxTreeFilterMax(MaxTree *mt, ImageGray *img, ImageGray *template,
    {
       for (i=0; i<mt->NumNodesAtLevel[l]; i++)
       {
-         idx = mt->NumPixelsBelowLevel[l] + i;
+         idx = mt->NumNodesBelowLevel[l] + i;
          node = &(mt->Nodes[idx]);
          parent = node->Parent;
          if ((idx!=parent) && (node->NewLevel==node->Level))
@@ -1498,14 +3192,8 @@ void MaxTreeFilterMax(MaxTree *mt, ImageGray *img, ImageGray *template,
          }
       }
    }
-   for (i=0; i<(img->Width)*(img->Height); i++)
-   {
-      if (shape[i])
-      {
-         idx = mt->NumPixelsBelowLevel[img->Pixmap[i]] + mt->Status[i];
-         out->Pixmap[i] = mt->Nodes[idx].NewLevel;
-      }
-   }
+   MaxTreeWriteLevels(mt, img, template, out);
+   free(values);
 } /* MaxTreeFilterMax */
 
 
@@ -1515,33 +3203,29 @@ void MaxTreeFilterSubtractive(MaxTree *mt, ImageGray *img, ImageGray *template,
                               double lambda)
 {
    MaxNode *node, *parnode;
-   ubyte *shape = template->Pixmap;
+   double *values;
    ulong i, idx, parent;
    int l;
 
+   values = MaxTreeAttribValuesCreate(mt, attribute);
+
    for (l=0; l<NUMLEVELS; l++)
    {
       for (i=0; i<mt->NumNodesAtLevel[l]; i++)
       {
-         idx = mt->NumPixelsBelowLevel[l] + i;
+         idx = mt->NumNodesBelowLevel[l] + i;
          node = &(mt->Nodes[idx]);
          parent = node->Parent;
          if (idx!=parent)
          {
             parnode = &(mt->Nodes[parent]);
-            if ((*attribute)(node->Attribute) < lambda)  node->NewLevel = parnode->NewLevel;
+            if (FilterAttribute(idx) < lambda)  node->NewLevel = parnode->NewLevel;
             else  node->NewLevel = ((int)(node->Level)) + ((int)(parnode->NewLevel)) - ((int)(parnode->Level));
          }
       }
    }
-   for (i=0; i<(img->Width)*(img->Height); i++)
-   {
-      if (shape[i])
-      {
-         idx = mt->NumPixelsBelowLevel[img->Pixmap[i]] + mt->Status[i];
-         out->Pixmap[i] = mt->Nodes[idx].NewLevel;
-      }
-   }
+   MaxTreeWriteLevels(mt, img, template, out);
+   free(values);
 } /* MaxTreeFilterSubtractive */
 
 
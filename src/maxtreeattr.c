@@ -0,0 +1,412 @@
+/* maxtreeattr.c
+ * Attributes of a finished Max-tree, computed after the build.
+ *
+ * The attribute callbacks run while the tree is built, so a new attribute
+ * means a new build. Here the pixels of a finished tree add their
+ * contribution to the arrays of their node, and the nodes are then walked
+ * from the last to the first. The nodes are stored level by level, so every
+ * parent comes before its children and a single backward pass adds each
+ * node to its parent after all its children were added to it. Every
+ * quantity has its own array, so the attribute kernels are plain loops
+ * over contiguous data.
+ */
+
+#include "maxtreeattr.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define PI 3.14159265358979323846
+
+
+
+AttribArrays *AttribArraysAlloc(ulong numnodes, int families)
+{
+   AttribArrays *aa;
+   size_t n = numnodes ? numnodes : 1;
+   bool failed = false;
+
+   aa = calloc(1, sizeof(AttribArrays));
+   if (aa==NULL)  return(NULL);
+   aa->NumNodes = numnodes;
+   aa->Families = families;
+   aa->Level = malloc(n*sizeof(ubyte));
+   failed |= (aa->Level==NULL);
+   if (families & ATTRFAM_AREA)
+   {
+      aa->Area = calloc(n, sizeof(uint));
+      failed |= (aa->Area==NULL);
+   }
+   if (families & ATTRFAM_ENCLRECT)
+   {
+      aa->MinX = malloc(n*sizeof(uint));
+      aa->MinY = malloc(n*sizeof(uint));
+      aa->MaxX = calloc(n, sizeof(uint));
+      aa->MaxY = calloc(n, sizeof(uint));
+      failed |= (aa->MinX==NULL) || (aa->MinY==NULL) || (aa->MaxX==NULL) || (aa->MaxY==NULL);
+   }
+   if (families & ATTRFAM_MOMENTS)
+   {
+      aa->SumX = calloc(n, sizeof(double));
+      aa->SumY = calloc(n, sizeof(double));
+      aa->SumX2 = calloc(n, sizeof(double));
+      aa->SumY2 = calloc(n, sizeof(double));
+      failed |= (aa->SumX==NULL) || (aa->SumY==NULL) || (aa->SumX2==NULL) || (aa->SumY2==NULL);
+   }
+   if (families & ATTRFAM_PERICB)
+   {
+      aa->Perimeter = calloc(n, sizeof(long));
+      failed |= (aa->Perimeter==NULL);
+   }
+   if (families & ATTRFAM_LAMBDAMAX)
+   {
+      aa->MaxLevel = malloc(n*sizeof(ubyte));
+      failed |= (aa->MaxLevel==NULL);
+   }
+   if (failed)
+   {
+      AttribArraysDelete(aa);
+      return(NULL);
+   }
+   return(aa);
+} /* AttribArraysAlloc */
+
+
+
+void AttribArraysDelete(AttribArrays *aa)
+{
+   free(aa->Level);
+   free(aa->Area);
+   free(aa->MinX);
+   free(aa->MinY);
+   free(aa->MaxX);
+   free(aa->MaxY);
+   free(aa->SumX);
+   free(aa->SumY);
+   free(aa->SumX2);
+   free(aa->SumY2);
+   free(aa->Perimeter);
+   free(aa->MaxLevel);
+   free(aa);
+} /* AttribArraysDelete */
+
+
+
+void AttribArraysAddPixels(AttribArrays *aa, MaxTree *mt, ImageGray *img, ubyte *shape)
+/* Adds every pixel of the template to the arrays of its own node */
+{
+   ubyte *pixmap = img->Pixmap;
+   ulong imgwidth, imgsize, p, n, x, y;
+   long peri;
+   ubyte h;
+
+   imgwidth = img->Width;
+   imgsize = imgwidth*(img->Height);
+   for (y=0, p=0; y<img->Height; y++)
+   {
+      for (x=0; x<imgwidth; x++, p++)
+      {
+         if (!shape[p])  continue;
+         n = MaxTreeNodeOf(mt, img, p);
+         if (aa->Area)  aa->Area[n] ++;
+         if (aa->MinX)
+         {
+            if (x<aa->MinX[n])  aa->MinX[n] = x;
+            if (y<aa->MinY[n])  aa->MinY[n] = y;
+            if (x>aa->MaxX[n])  aa->MaxX[n] = x;
+            if (y>aa->MaxY[n])  aa->MaxY[n] = y;
+         }
+         if (aa->SumX)
+         {
+            aa->SumX[n] += x;
+            aa->SumY[n] += y;
+            aa->SumX2[n] += x*x;
+            aa->SumY2[n] += y*y;
+         }
+         if (aa->Perimeter)
+         {
+            /* Same count as the PeriCB callbacks over the 4-neighbors of
+             * GetNeighbors: an edge to a missing or lower neighbor adds
+             * one, one to a higher neighbor subtracts one */
+            h = pixmap[p];
+            peri = 0;
+            peri += ((x+1<imgwidth) && shape[p+1]) ? (pixmap[p+1]<h) - (pixmap[p+1]>h) : 1;
+            peri += ((y>0) && shape[p-imgwidth]) ? (pixmap[p-imgwidth]<h) - (pixmap[p-imgwidth]>h) : 1;
+            peri += ((x>0) && shape[p-1]) ? (pixmap[p-1]<h) - (pixmap[p-1]>h) : 1;
+            peri += ((p+imgwidth<imgsize) && shape[p+imgwidth]) ? (pixmap[p+imgwidth]<h) - (pixmap[p+imgwidth]>h) : 1;
+            aa->Perimeter[n] += peri;
+         }
+      }
+   }
+} /* AttribArraysAddPixels */
+
+
+
+AttribArrays *AttribArraysCreate(MaxTree *mt, ImageGray *img, ImageGray *template, int families)
+/* Accumulates the requested families for every node of mt, a tree of img
+ * built with template */
+{
+   AttribArrays *aa;
+   MaxNode *nodes = mt->Nodes;
+   ulong i, parent;
+
+   aa = AttribArraysAlloc(mt->NumNodes, families);
+   if (aa==NULL)  return(NULL);
+   for (i=0; i<mt->NumNodes; i++)  aa->Level[i] = nodes[i].Level;
+   if (aa->MinX)
+   {
+      for (i=0; i<mt->NumNodes; i++)  aa->MinX[i] = aa->MinY[i] = UINT_MAX;
+   }
+   if (aa->MaxLevel)  memcpy(aa->MaxLevel, aa->Level, mt->NumNodes*sizeof(ubyte));
+   AttribArraysAddPixels(aa, mt, img, template->Pixmap);
+
+   /* Children come after their parents, so one backward pass per family
+    * adds every subtree. Roots are their own parents: node 0, and with a
+    * template of several components or the union-find and strip builders
+    * others too, so they are skipped */
+   if (aa->Area)
+   {
+      for (i=mt->NumNodes; i-->1; )
+      {
+         parent = nodes[i].Parent;
+         if (parent!=i)  aa->Area[parent] += aa->Area[i];
+      }
+   }
+   if (aa->MinX)
+   {
+      for (i=mt->NumNodes; i-->1; )
+      {
+         parent = nodes[i].Parent;
+         if (parent==i)  continue;
+         if (aa->MinX[i]<aa->MinX[parent])  aa->MinX[parent] = aa->MinX[i];
+         if (aa->MinY[i]<aa->MinY[parent])  aa->MinY[parent] = aa->MinY[i];
+         if (aa->MaxX[i]>aa->MaxX[parent])  aa->MaxX[parent] = aa->MaxX[i];
+         if (aa->MaxY[i]>aa->MaxY[parent])  aa->MaxY[parent] = aa->MaxY[i];
+      }
+   }
+   if (aa->SumX)
+   {
+      for (i=mt->NumNodes; i-->1; )
+      {
+         parent = nodes[i].Parent;
+         if (parent==i)  continue;
+         aa->SumX[parent] += aa->SumX[i];
+         aa->SumY[parent] += aa->SumY[i];
+         aa->SumX2[parent] += aa->SumX2[i];
+         aa->SumY2[parent] += aa->SumY2[i];
+      }
+   }
+   if (aa->Perimeter)
+   {
+      for (i=mt->NumNodes; i-->1; )
+      {
+         parent = nodes[i].Parent;
+         if (parent!=i)  aa->Perimeter[parent] += aa->Perimeter[i];
+      }
+   }
+   if (aa->MaxLevel)
+   {
+      for (i=mt->NumNodes; i-->1; )
+      {
+         parent = nodes[i].Parent;
+         if (parent==i)  continue;
+         if (aa->MaxLevel[i]>aa->MaxLevel[parent])  aa->MaxLevel[parent] = aa->MaxLevel[i];
+      }
+   }
+   return(aa);
+} /* AttribArraysCreate */
+
+
+
+/****** Attribute kernels ******************************/
+
+void AreaKernel(AttribArrays *aa, double *out)
+{
+   ulong i;
+
+   for (i=0; i<aa->NumNodes; i++)  out[i] = aa->Area[i];
+} /* AreaKernel */
+
+void EnclRectAreaKernel(AttribArrays *aa, double *out)
+{
+   ulong i;
+
+   for (i=0; i<aa->NumNodes; i++)
+   {
+      out[i] = (double)((ulong)(aa->MaxX[i] - aa->MinX[i] + 1) * (ulong)(aa->MaxY[i] - aa->MinY[i] + 1));
+   }
+} /* EnclRectAreaKernel */
+
+void EnclRectDiagKernel(AttribArrays *aa, double *out)
+{
+   double dx, dy;
+   ulong i;
+
+   for (i=0; i<aa->NumNodes; i++)
+   {
+      dx = ((double)(aa->MaxX[i])) - ((double)(aa->MinX[i])) + 1;
+      dy = ((double)(aa->MaxY[i])) - ((double)(aa->MinY[i])) + 1;
+      out[i] = dx*dx + dy*dy;
+   }
+} /* EnclRectDiagKernel */
+
+void PeriCBPerimeterKernel(AttribArrays *aa, double *out)
+{
+   ulong i;
+
+   for (i=0; i<aa->NumNodes; i++)  out[i] = aa->Perimeter[i];
+} /* PeriCBPerimeterKernel */
+
+void PeriCBComplexityKernel(AttribArrays *aa, double *out)
+{
+   ulong i;
+
+   for (i=0; i<aa->NumNodes; i++)  out[i] = ((double)(aa->Perimeter[i])) / aa->Area[i];
+} /* PeriCBComplexityKernel */
+
+void PeriCBSimplicityKernel(AttribArrays *aa, double *out)
+{
+   ulong i;
+
+   for (i=0; i<aa->NumNodes; i++)  out[i] = ((double)(aa->Area[i])) / aa->Perimeter[i];
+} /* PeriCBSimplicityKernel */
+
+void PeriCBCompactnessKernel(AttribArrays *aa, double *out)
+{
+   double peri;
+   ulong i;
+
+   for (i=0; i<aa->NumNodes; i++)
+   {
+      peri = aa->Perimeter[i];
+      out[i] = (peri*peri)/(4.0*PI*aa->Area[i]);
+   }
+} /* PeriCBCompactnessKernel */
+
+void InertiaKernel(AttribArrays *aa, double *out)
+{
+   double area;
+   ulong i;
+
+   for (i=0; i<aa->NumNodes; i++)
+   {
+      area = aa->Area[i];
+      out[i] = aa->SumX2[i] + aa->SumY2[i] - (aa->SumX[i]*aa->SumX[i] + aa->SumY[i]*aa->SumY[i]) / area
+               + area / 6.0;
+   }
+} /* InertiaKernel */
+
+void InertiaDivA2Kernel(AttribArrays *aa, double *out)
+{
+   double area, inertia;
+   ulong i;
+
+   for (i=0; i<aa->NumNodes; i++)
+   {
+      area = aa->Area[i];
+      inertia = aa->SumX2[i] + aa->SumY2[i] - (aa->SumX[i]*aa->SumX[i] + aa->SumY[i]*aa->SumY[i]) / area
+                + area / 6.0;
+      out[i] = inertia*2.0*PI/(area*area);
+   }
+} /* InertiaDivA2Kernel */
+
+void MeanXKernel(AttribArrays *aa, double *out)
+{
+   ulong i;
+
+   for (i=0; i<aa->NumNodes; i++)  out[i] = aa->SumX[i] / aa->Area[i];
+} /* MeanXKernel */
+
+void MeanYKernel(AttribArrays *aa, double *out)
+{
+   ulong i;
+
+   for (i=0; i<aa->NumNodes; i++)  out[i] = aa->SumY[i] / aa->Area[i];
+} /* MeanYKernel */
+
+void JaggednessKernel(AttribArrays *aa, double *out)
+{
+   double area, peri, inertia;
+   ulong i;
+
+   for (i=0; i<aa->NumNodes; i++)
+   {
+      area = aa->Area[i];
+      peri = aa->Perimeter[i];
+      inertia = aa->SumX2[i] + aa->SumY2[i] - (aa->SumX[i]*aa->SumX[i] + aa->SumY[i]*aa->SumY[i]) / area
+                + area / 6.0;
+      out[i] = area*peri*peri/(8.0*PI*PI*inertia);
+   }
+} /* JaggednessKernel */
+
+void LambdamaxKernel(AttribArrays *aa, double *out)
+{
+   ulong i;
+
+   for (i=0; i<aa->NumNodes; i++)  out[i] = ((double)(aa->MaxLevel[i])) - ((double)(aa->Level[i]));
+} /* LambdamaxKernel */
+
+void LevelKernel(AttribArrays *aa, double *out)
+{
+   ulong i;
+
+   for (i=0; i<aa->NumNodes; i++)  out[i] = aa->Level[i];
+} /* LevelKernel */
+
+
+
+typedef struct AttribKernel
+{
+   double (*Attribute)(void *);
+   int Families;
+   void (*Compute)(AttribArrays *, double *);
+} AttribKernel;
+
+AttribKernel AttribKernels[] =
+{
+   {AreaAttribute, ATTRFAM_AREA, AreaKernel},
+   {EnclRectAreaAttribute, ATTRFAM_ENCLRECT, EnclRectAreaKernel},
+   {EnclRectDiagAttribute, ATTRFAM_ENCLRECT, EnclRectDiagKernel},
+   {PeriCBPerimeterAttribute, ATTRFAM_PERICB, PeriCBPerimeterKernel},
+   {PeriCBComplexityAttribute, ATTRFAM_AREA | ATTRFAM_PERICB, PeriCBComplexityKernel},
+   {PeriCBSimplicityAttribute, ATTRFAM_AREA | ATTRFAM_PERICB, PeriCBSimplicityKernel},
+   {PeriCBCompactnessAttribute, ATTRFAM_AREA | ATTRFAM_PERICB, PeriCBCompactnessKernel},
+   {InertiaAttribute, ATTRFAM_AREA | ATTRFAM_MOMENTS, InertiaKernel},
+   {InertiaDivA2Attribute, ATTRFAM_AREA | ATTRFAM_MOMENTS, InertiaDivA2Kernel},
+   {MeanXAttribute, ATTRFAM_AREA | ATTRFAM_MOMENTS, MeanXKernel},
+   {MeanYAttribute, ATTRFAM_AREA | ATTRFAM_MOMENTS, MeanYKernel},
+   {JaggednessAttribute, ATTRFAM_AREA | ATTRFAM_MOMENTS | ATTRFAM_PERICB, JaggednessKernel},
+   {LambdamaxAttribute, ATTRFAM_LAMBDAMAX, LambdamaxKernel},
+   {LevelAttribute, 0, LevelKernel}
+};
+#define NUMKERNELS  (sizeof(AttribKernels)/sizeof(AttribKernels[0]))
+
+
+
+int AttribArraysFamiliesOf(double (*attribute)(void *))
+{
+   ulong k;
+
+   for (k=0; k<NUMKERNELS; k++)
+   {
+      if (AttribKernels[k].Attribute==attribute)  return(AttribKernels[k].Families);
+   }
+   return(-1);
+} /* AttribArraysFamiliesOf */
+
+
+
+int AttribArraysCompute(AttribArrays *aa, double (*attribute)(void *), double *out)
+{
+   ulong k;
+
+   for (k=0; k<NUMKERNELS; k++)
+   {
+      if (AttribKernels[k].Attribute==attribute)
+      {
+         if ((aa->Families & AttribKernels[k].Families) != AttribKernels[k].Families)  return(-1);
+         AttribKernels[k].Compute(aa, out);
+         return(0);
+      }
+   }
+   return(-1);
+} /* AttribArraysCompute */
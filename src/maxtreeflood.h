@@ -0,0 +1,112 @@
+/* maxtreeflood.h
+ * Body of the flooding of maxtree3b.c, included once per attribute family.
+ * Before every inclusion define
+ *   FLOOD_FUNC    name of the generated function
+ *   FLOOD_NEW     NewAuxData of the family
+ *   FLOOD_ADD     AddToAuxData of the family
+ *   FLOOD_MERGE   MergeAuxData of the family
+ *   FLOOD_DELETE  DeleteAuxData of the family
+ * Naming the functions of a family lets the compiler inline them into the
+ * per-pixel loop; the generic flooding calls the pointers of the tree.
+ * The macros are undefined at the end.
+ */
+
+int FLOOD_FUNC(MaxTree *mt, HQueue *hq, bool *nodeatlevel, ImageGray *img,
+               ubyte *shape, int h, FloodFrame *stack)
+/* Non-recursive version of the flooding of [2]: descending into a brighter
+ * level pushes a frame on the stack, finishing a node pops it again.
+ * Returns value >=NUMLEVELS if error */
+{
+   FloodFrame *frame = stack;
+   ubyte *pixmap;
+   ulong imgwidth, imgsize, p, q, idx, x, y;
+   MaxNode *node;
+   int top=0;
+   int m;
+
+   imgwidth = img->Width;
+   imgsize = imgwidth * (img->Height);
+   pixmap = img->Pixmap;
+   FloodFrameInit(frame, h, 0, NULL);
+   for (;;)
+   {
+      /* Continue with the neighbors of the current pixel */
+      m = h;
+      while (frame->NextNeighbor < frame->NumNeighbors)
+      {
+         q = frame->Neighbors[frame->NextNeighbor++];
+         if (mt->Status[q]==ST_NotAnalyzed)
+         {
+            HQueueAdd(hq, pixmap[q], q);
+            mt->Status[q] = ST_InTheQueue;
+            nodeatlevel[pixmap[q]] = true;
+            if (pixmap[q] > h)
+            {
+               m = pixmap[q];
+               break;
+            }
+         }
+      }
+      if (m > h)
+      {
+         frame = stack + (++top);
+         FloodFrameInit(frame, m, 0, NULL);
+         h = m;
+         continue;
+      }
+      if (HQueueNotEmpty(hq, h))
+      {
+         frame->Area++;
+         p = HQueueFirst(hq, h);
+         frame->NumNeighbors = GetNeighbors(shape, imgwidth, imgsize, p, frame->Neighbors);
+         frame->NextNeighbor = 0;
+         x = p % imgwidth;
+         y = p / imgwidth;
+         if (frame->Attr)  FLOOD_ADD(frame->Attr, x, y, frame->NumNeighbors, frame->Neighbors, img);
+         else
+         {
+            frame->Attr = FLOOD_NEW(x, y, frame->NumNeighbors, frame->Neighbors, img);
+            if (frame->Attr==NULL)
+            {
+               while (top--)  FLOOD_DELETE(stack[top].Attr);
+               return(NUMLEVELS);
+            }
+            if (frame->ChildAttr)  FLOOD_MERGE(frame->Attr, frame->ChildAttr);
+         }
+         mt->Status[p] = mt->NumNodesAtLevel[h];
+         continue;
+      }
+
+      /* Level h is exhausted: store the node */
+      mt->NumNodesAtLevel[h] = mt->NumNodesAtLevel[h]+1;
+      m = h-1;
+      while ((m>=0) && (nodeatlevel[m]==false))  m--;
+      idx = mt->NumPixelsBelowLevel[h] + mt->NumNodesAtLevel[h]-1;
+      node = mt->Nodes + idx;
+      if (m>=0)  node->Parent = mt->NumPixelsBelowLevel[m] + mt->NumNodesAtLevel[m];
+      else  node->Parent = idx;
+      node->Area = frame->Area;
+      mt->Attributes[idx] = frame->Attr;
+      node->Level = h;
+      nodeatlevel[h] = false;
+      if (top==0)  return(m);
+      if (m==stack[top-1].Level)
+      {
+         /* Back in the parent: add the finished child to it */
+         top--;
+         stack[top].Area += frame->Area;
+         FLOOD_MERGE(stack[top].Attr, frame->Attr);
+         frame = stack + top;
+      }
+      else  FloodFrameInit(frame, m, frame->Area, frame->Attr);
+      h = frame->Level;
+   }
+} /* FLOOD_FUNC */
+
+
+
+#undef FLOOD_FUNC
+#undef FLOOD_NEW
+#undef FLOOD_ADD
+#undef FLOOD_MERGE
+#undef FLOOD_DELETE
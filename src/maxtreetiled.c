@@ -0,0 +1,674 @@
+/* maxtreetiled.c
+ * Out-of-core Max-tree filtering of large raw (P5) PGM 8-bit images.
+ *
+ * The image is streamed from disk in bands of rows sized from a memory
+ * budget. Every band gets its own Max-tree. Nodes that touch the first or
+ * last row of a band, and all their ancestors, are boundary nodes: only
+ * they can continue in the neighboring bands. They are kept in a global
+ * boundary forest, in which the bands are merged along their common rows
+ * with the connect procedure of [1]. All other nodes lie entirely inside
+ * their band and are final there.
+ *
+ * A first pass over the bands builds the boundary forest. Every boundary
+ * node carries the attribute of its own pixels and its non-boundary
+ * children, so that merging the forest bottom-up gives the attributes of
+ * the whole image. The decision rule is then applied to the forest, and a
+ * second pass rebuilds each band and filters its pixels, taking the gray
+ * levels of the boundary nodes from the forest. The output equals that of
+ * MaxTreeFilter* on a tree of the whole image without template.
+ *
+ * [1] M. H. F. Wilkinson and H. Gao and W. H. Hesselink and J. E. Jonker
+ *     and A. Meijster.
+ *     Concurrent Computation of Attribute Filters on Shared Memory
+ *     Parallel Machines.
+ *     IEEE Transactions on Pattern Analysis and Machine Intelligence,
+ *     Vol.30, No.10, Pages 1800-1813, 2008.
+ */
+
+#include "maxtreetiled.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define TILED_None  ((ulong)-1)
+#define TILED_OVERBUDGET  1
+
+
+
+/****** Streaming PGM access ******************************/
+
+typedef struct PGMStream
+{
+   FILE *File;
+   long DataOffset;
+   ulong Width;
+   ulong Height;
+} PGMStream;
+
+int PGMStreamOpen(PGMStream *ps, char *fname)
+{
+   int c, maxval=0;
+
+   ps->File = fopen(fname, "rb");
+   if (ps->File==NULL)  return(-1);
+   if ((fgetc(ps->File)!='P') || (fgetc(ps->File)!='5'))
+   {
+      fclose(ps->File);
+      return(-1);
+   }
+   do c = fgetc(ps->File); while ((c==' ') || (c=='\n') || (c=='\r') || (c=='\t'));
+   while (c=='#')
+   {
+      while ((c=fgetc(ps->File)) != '\n');
+      c = fgetc(ps->File);
+   }
+   ungetc(c, ps->File);
+   if ((fscanf(ps->File, "%lu %lu %d", &(ps->Width), &(ps->Height), &maxval)!=3) || (maxval!=255))
+   {
+      fclose(ps->File);
+      return(-1);
+   }
+   fgetc(ps->File);
+   ps->DataOffset = ftell(ps->File);
+   return(0);
+} /* PGMStreamOpen */
+
+int PGMStreamReadRows(PGMStream *ps, ubyte *buf, ulong row, ulong numrows)
+{
+   if (fseek(ps->File, ps->DataOffset + (long)(row*(ps->Width)), SEEK_SET))  return(-1);
+   if (fread(buf, 1, numrows*(ps->Width), ps->File) != numrows*(ps->Width))  return(-1);
+   return(0);
+} /* PGMStreamReadRows */
+
+
+
+/****** Boundary forest ******************************/
+
+typedef struct BoundaryForest
+{
+   ubyte *Level;
+   ulong *Parent;
+   void **Attr;      /* own pixels and non-boundary children of the node */
+   bool *KeptBelow;  /* a non-boundary descendant survives the Max rule */
+   ubyte *NewLevel;  /* after the top-down pass of the decision */
+   ubyte *OutLevel;  /* gray level written to the pixels */
+   ulong Size;
+   ulong Capacity;
+} BoundaryForest;
+
+/* Bytes per node of the arrays of the boundary forest */
+#define TILED_FOREST_BYTES_PER_NODE  (3*sizeof(ubyte) + sizeof(ulong) + sizeof(void *) + sizeof(bool))
+
+int ForestGrow(BoundaryForest *bf, ulong size, ulong maxcapacity)
+/* Makes room for size nodes, doubling the capacity but not beyond
+ * maxcapacity unless size needs it */
+{
+   ulong capacity = bf->Capacity;
+   void *p;
+
+   if (size<=capacity)  return(0);
+   while (capacity<size)  capacity = capacity ? 2*capacity : 1024;
+   if (capacity>maxcapacity)  capacity = (size>maxcapacity) ? size : maxcapacity;
+   if ((p = realloc(bf->Level, capacity*sizeof(ubyte)))==NULL)  return(-1);
+   bf->Level = p;
+   if ((p = realloc(bf->Parent, capacity*sizeof(ulong)))==NULL)  return(-1);
+   bf->Parent = p;
+   if ((p = realloc(bf->Attr, capacity*sizeof(void *)))==NULL)  return(-1);
+   bf->Attr = p;
+   if ((p = realloc(bf->KeptBelow, capacity*sizeof(bool)))==NULL)  return(-1);
+   bf->KeptBelow = p;
+   if ((p = realloc(bf->NewLevel, capacity*sizeof(ubyte)))==NULL)  return(-1);
+   bf->NewLevel = p;
+   if ((p = realloc(bf->OutLevel, capacity*sizeof(ubyte)))==NULL)  return(-1);
+   bf->OutLevel = p;
+   bf->Capacity = capacity;
+   return(0);
+} /* ForestGrow */
+
+void ForestDelete(BoundaryForest *bf, void (*deleteauxdata)(void *))
+{
+   ulong i;
+
+   for (i=0; i<bf->Size; i++)
+   {
+      if (bf->Attr[i])  deleteauxdata(bf->Attr[i]);
+   }
+   free(bf->OutLevel);
+   free(bf->NewLevel);
+   free(bf->KeptBelow);
+   free(bf->Attr);
+   free(bf->Parent);
+   free(bf->Level);
+} /* ForestDelete */
+
+
+
+/****** Bands ******************************/
+
+typedef struct Band
+{
+   ubyte *Buffer;    /* rows FirstRow..Row1 (exclusive), one row of halo on each inner side */
+   ImageGray Core;   /* rows Row0..Row1 of the band itself */
+   ImageGray View;   /* frame of the whole image around Buffer, for the attribute callbacks */
+   ulong FirstRow, Row0, Row1;
+   MaxTree *mt;
+   ulong *Gid;       /* forest node of each boundary node, TILED_None for the others */
+   ulong NumBoundary;
+   ubyte *NewLevel;  /* per node, only used when filtering */
+   bool *Kept;
+} Band;
+
+/* The band trees are built without attributes first; the attributes are
+ * gathered afterwards in the coordinates of the whole image */
+void *NewNoData(ulong x, ulong y, int numneighbors, ulong *neighbors, ImageGray *img)
+{
+   static char nodata;
+
+   return(&nodata);
+} /* NewNoData */
+
+void AddToNoData(void *attr, ulong x, ulong y, int numneighbors, ulong *neighbors, ImageGray *img)
+{
+} /* AddToNoData */
+
+void MergeNoData(void *attr, void *childattr)
+{
+} /* MergeNoData */
+
+void DeleteNoData(void *attr)
+{
+} /* DeleteNoData */
+
+int TiledNeighbors(ulong width, ulong height, ulong p, ulong *neighbors)
+/* Same neighbors, in the same order, as GetNeighbors without template */
+{
+   ulong x;
+   int n=0;
+
+   x = p % width;
+   if (x<(width-1))        neighbors[n++] = p+1;
+   if (p>=width)           neighbors[n++] = p-width;
+   if (x>0)                neighbors[n++] = p-1;
+   if (p+width<width*height)  neighbors[n++] = p+width;
+   return(n);
+} /* TiledNeighbors */
+
+#define BandNode(band, lp)  MaxTreeNodeOf((band)->mt, &((band)->Core), lp)
+
+void BandDelete(Band *band)
+{
+   if (band->mt)  MaxTreeDelete(band->mt);
+   free(band->Kept);
+   free(band->NewLevel);
+   free(band->Gid);
+   free(band->Buffer);
+   band->mt = NULL;
+   band->Kept = NULL;
+   band->NewLevel = NULL;
+   band->Gid = NULL;
+   band->Buffer = NULL;
+} /* BandDelete */
+
+int BandBuild(Band *band, PGMStream *ps, ulong row0, ulong row1, AttribStruct *attrib,
+              double lambda, ulong gidbase, ulong **boundarynodes)
+/* Reads rows row0..row1 (exclusive), builds their Max-tree, numbers the
+ * boundary nodes from gidbase on in a fixed order and gathers the
+ * attributes: complete for non-boundary nodes, own pixels plus
+ * non-boundary children for boundary nodes. Kept marks nodes that survive
+ * the Max rule through a non-boundary node. */
+{
+   ulong neighbors[CONNECTIVITY];
+   ImageGray *template;
+   MaxNode *node;
+   ulong width = ps->Width, height = ps->Height;
+   ulong lastrow, numrows, lp, p, n, i, offset, *list;
+   void **attr;
+   int numneighbors, h, side;
+
+   memset(band, 0, sizeof(Band));
+   band->Row0 = row0;
+   band->Row1 = row1;
+   band->FirstRow = (row0>0) ? row0-1 : row0;
+   lastrow = (row1<height) ? row1+1 : row1;
+   numrows = lastrow - band->FirstRow;
+   band->Buffer = malloc(numrows*width);
+   if (band->Buffer==NULL)  return(-1);
+   if (PGMStreamReadRows(ps, band->Buffer, band->FirstRow, numrows))
+   {
+      BandDelete(band);
+      return(-1);
+   }
+   band->Core.Width = width;
+   band->Core.Height = row1-row0;
+   band->Core.Pixmap = band->Buffer + (row0-band->FirstRow)*width;
+   band->View.Width = width;
+   band->View.Height = height;
+   /* The callbacks only read the pixels of the buffer and their neighbors */
+   band->View.Pixmap = band->Buffer - band->FirstRow*width;
+
+   template = GetTemplate(NULL, &(band->Core));
+   if (template==NULL)
+   {
+      BandDelete(band);
+      return(-1);
+   }
+   band->mt = MaxTreeCreate(&(band->Core), template, NewNoData, AddToNoData, MergeNoData, DeleteNoData);
+   ImageGrayDelete(template);
+   if (band->mt==NULL)
+   {
+      BandDelete(band);
+      return(-1);
+   }
+   band->Gid = malloc((row1-row0)*width*sizeof(ulong));
+   band->Kept = calloc((size_t)((row1-row0)*width), sizeof(bool));
+   list = malloc((row1-row0)*width*sizeof(ulong));
+   if ((band->Gid==NULL) || (band->Kept==NULL) || (list==NULL))
+   {
+      free(list);
+      BandDelete(band);
+      return(-1);
+   }
+
+   /* Boundary nodes: nodes of the first and last row and their ancestors,
+    * numbered in the order they are found */
+   for (h=0; h<NUMLEVELS; h++)
+   {
+      for (i=0; i<band->mt->NumNodesAtLevel[h]; i++)
+      {
+         n = band->mt->NumNodesBelowLevel[h] + i;
+         band->Gid[n] = TILED_None;
+         band->mt->Attributes[n] = NULL;
+      }
+   }
+   for (side=0; side<2; side++)
+   {
+      if ((side==0) && (row0==0))  continue;
+      if ((side==1) && (row1==height))  continue;
+      offset = side ? (row1-row0-1)*width : 0;
+      for (lp=offset; lp<offset+width; lp++)
+      {
+         n = BandNode(band, lp);
+         while (band->Gid[n]==TILED_None)
+         {
+            list[band->NumBoundary] = n;
+            band->Gid[n] = gidbase + band->NumBoundary++;
+            if (band->mt->Nodes[n].Parent==n)  break;
+            n = band->mt->Nodes[n].Parent;
+         }
+      }
+   }
+   *boundarynodes = list;
+
+   /* Attributes in the coordinates of the whole image */
+   band->mt->DeleteAuxData = attrib->DeleteAuxData;
+   for (lp=0; lp<(row1-row0)*width; lp++)
+   {
+      p = lp + row0*width;
+      attr = band->mt->Attributes + BandNode(band, lp);
+      numneighbors = TiledNeighbors(width, height, p, neighbors);
+      if (*attr)  attrib->AddToAuxData(*attr, p%width, p/width, numneighbors, neighbors, &(band->View));
+      else
+      {
+         *attr = attrib->NewAuxData(p%width, p/width, numneighbors, neighbors, &(band->View));
+         if (*attr==NULL)
+         {
+            BandDelete(band);
+            return(-1);
+         }
+      }
+   }
+   for (h=NUMLEVELS-1; h>=0; h--)
+   {
+      for (i=0; i<band->mt->NumNodesAtLevel[h]; i++)
+      {
+         n = band->mt->NumNodesBelowLevel[h] + i;
+         node = band->mt->Nodes + n;
+         if ((node->Parent==n) || (band->Gid[n]!=TILED_None))  continue;
+         attr = band->mt->Attributes + n;
+         attrib->MergeAuxData(band->mt->Attributes[node->Parent], *attr);
+         if (!((*(attrib->Attribute))(*attr) < lambda))  band->Kept[n] = true;
+         if (band->Kept[n])  band->Kept[node->Parent] = true;
+      }
+   }
+   return(0);
+} /* BandBuild */
+
+
+
+/****** Memory budget ******************************/
+
+typedef struct TiledBudget
+{
+   ulong Limit;
+   ulong Fixed;        /* forest nodes of the last row of the previous band */
+   ulong RecordBytes;  /* one attribute record and its malloc header */
+   ulong MaxBand;      /* largest band of the last pass 1 */
+   ulong Peak;
+} TiledBudget;
+
+ulong BandBytes(Band *band, TiledBudget *tb)
+/* Working memory of a band and the attribute records of its nodes */
+{
+   return((band->Core.Width)*(band->Core.Height)*TILED_BYTES_PER_PIXEL + (band->mt->NumNodes)*(tb->RecordBytes));
+} /* BandBytes */
+
+ulong ForestBytes(BoundaryForest *bf, TiledBudget *tb)
+{
+   return(tb->Fixed + (bf->Capacity)*TILED_FOREST_BYTES_PER_NODE + (bf->Size)*(tb->RecordBytes));
+} /* ForestBytes */
+
+bool TiledUse(TiledBudget *tb, ulong bytes)
+/* Records that bytes are in use at once; false if they exceed the budget */
+{
+   if (bytes>tb->Limit)  return(false);
+   if (bytes>tb->Peak)  tb->Peak = bytes;
+   return(true);
+} /* TiledUse */
+
+
+
+/****** Decision rules ******************************/
+
+ubyte TiledDecide(int decision, double value, double lambda, ubyte level,
+                  ubyte parlevel, ubyte parnewlevel)
+/* Gray level of a non-root node after the top-down pass of MaxTreeFilter*,
+ * for Max the pass before the survivors are propagated down */
+{
+   switch (decision)
+   {
+      case DECISION_MIN:
+         if ((value < lambda) || (parlevel!=parnewlevel))  return(parnewlevel);
+         return(level);
+      case DECISION_SUBTRACTIVE:
+         if (value < lambda)  return(parnewlevel);
+         return((ubyte)(((int)level) + ((int)parnewlevel) - ((int)parlevel)));
+      default:
+         if (value < lambda)  return(parnewlevel);
+         return(level);
+   }
+} /* TiledDecide */
+
+int ForestResolve(BoundaryForest *bf, AttribStruct *attrib, int decision, double lambda)
+/* Merges the attributes of the forest bottom-up and applies the decision
+ * rule to its canonical nodes */
+{
+   ulong first[NUMLEVELS+1];
+   ulong *canon, *order;
+   ulong g, c, par, i;
+   bool root;
+   int h;
+
+   canon = malloc(bf->Size*sizeof(ulong));
+   order = malloc(bf->Size*sizeof(ulong));
+   if ((canon==NULL) || (order==NULL))
+   {
+      free(order);
+      free(canon);
+      return(-1);
+   }
+   for (g=0; g<bf->Size; g++)  canon[g] = UFLevelRootCompress(bf->Level, bf->Parent, g);
+   bzero(first, (NUMLEVELS+1)*sizeof(ulong));
+   for (g=0; g<bf->Size; g++)
+   {
+      c = canon[g];
+      if (c!=g)
+      {
+         attrib->MergeAuxData(bf->Attr[c], bf->Attr[g]);
+         attrib->DeleteAuxData(bf->Attr[g]);
+         bf->Attr[g] = NULL;
+         bf->KeptBelow[c] |= bf->KeptBelow[g];
+      }
+      else  first[bf->Level[g]+1]++;
+   }
+   for (h=0; h<NUMLEVELS; h++)  first[h+1] += first[h];
+   for (g=0; g<bf->Size; g++)
+   {
+      if (canon[g]==g)  order[first[bf->Level[g]]++] = g;
+   }
+   /* first[NUMLEVELS-1] is now the number of canonical nodes */
+   for (i=first[NUMLEVELS-1]; i-->0; )
+   {
+      g = order[i];
+      if (bf->Parent[g]==g)  continue;
+      par = canon[bf->Parent[g]];
+      attrib->MergeAuxData(bf->Attr[par], bf->Attr[g]);
+   }
+   for (i=0; i<first[NUMLEVELS-1]; i++)
+   {
+      g = order[i];
+      if (bf->Parent[g]==g)  bf->NewLevel[g] = 0;
+      else
+      {
+         par = canon[bf->Parent[g]];
+         bf->NewLevel[g] = TiledDecide(decision, (*(attrib->Attribute))(bf->Attr[g]), lambda,
+                                       bf->Level[g], bf->Level[par], bf->NewLevel[par]);
+      }
+      bf->OutLevel[g] = bf->NewLevel[g];
+   }
+   if (decision==DECISION_MAX)
+   {
+      for (i=first[NUMLEVELS-1]; i-->0; )
+      {
+         g = order[i];
+         root = (bf->Parent[g]==g);
+         if (!root && !((*(attrib->Attribute))(bf->Attr[g]) < lambda))  bf->KeptBelow[g] = true;
+         if (bf->KeptBelow[g])
+         {
+            bf->OutLevel[g] = bf->Level[g];
+            if (!root)  bf->KeptBelow[canon[bf->Parent[g]]] = true;
+         }
+      }
+   }
+   /* Let the merged nodes point straight at their canonical node */
+   for (g=0; g<bf->Size; g++)  bf->Parent[g] = canon[g];
+   free(order);
+   free(canon);
+   return(0);
+} /* ForestResolve */
+
+void BandFilter(Band *band, BoundaryForest *bf, AttribStruct *attrib, int decision,
+                double lambda, ubyte *out)
+/* Filters the pixels of a band with the gray levels of its boundary nodes
+ * taken from the resolved forest */
+{
+   MaxTree *mt = band->mt;
+   MaxNode *node;
+   ulong i, n, c, lp;
+   int h;
+
+   for (h=0; h<NUMLEVELS; h++)
+   {
+      for (i=0; i<mt->NumNodesAtLevel[h]; i++)
+      {
+         n = mt->NumNodesBelowLevel[h] + i;
+         node = mt->Nodes + n;
+         if (band->Gid[n]!=TILED_None)
+         {
+            c = bf->Parent[band->Gid[n]];
+            band->NewLevel[n] = bf->NewLevel[c];
+         }
+         else if (node->Parent==n)  band->NewLevel[n] = 0;
+         else  band->NewLevel[n] = TiledDecide(decision, (*(attrib->Attribute))(mt->Attributes[n]), lambda,
+                                              node->Level, mt->Nodes[node->Parent].Level,
+                                              band->NewLevel[node->Parent]);
+      }
+   }
+   for (h=0; h<NUMLEVELS; h++)
+   {
+      for (i=0; i<mt->NumNodesAtLevel[h]; i++)
+      {
+         n = mt->NumNodesBelowLevel[h] + i;
+         if (band->Gid[n]!=TILED_None)  band->NewLevel[n] = bf->OutLevel[bf->Parent[band->Gid[n]]];
+         else if ((decision==DECISION_MAX) && band->Kept[n])  band->NewLevel[n] = mt->Nodes[n].Level;
+      }
+   }
+   for (lp=0; lp<(band->Core.Width)*(band->Core.Height); lp++)  out[lp] = band->NewLevel[BandNode(band, lp)];
+} /* BandFilter */
+
+
+
+/****** Tiled filter ******************************/
+
+int ForestBuild(BoundaryForest *bf, PGMStream *ps, AttribStruct *attrib, double lambda,
+                ulong bandrows, TiledBudget *tb, ulong *prevgid, ulong *numbands)
+/* Pass 1: builds the boundary forest from bands of bandrows rows. Returns
+ * TILED_OVERBUDGET as soon as a band and the forest do not fit in the
+ * budget together. */
+{
+   Band band;
+   ulong *boundary;
+   ulong row0, row1, x, k, n, g, size, bytes, maxcapacity;
+
+   *numbands = 0;
+   tb->MaxBand = 0;
+   for (row0=0; row0<ps->Height; row0=row1)
+   {
+      row1 = (row0+bandrows<ps->Height) ? row0+bandrows : ps->Height;
+      if (BandBuild(&band, ps, row0, row1, attrib, lambda, bf->Size, &boundary))  return(-1);
+      size = bf->Size + band.NumBoundary;
+      bytes = BandBytes(&band, tb);
+      if (bytes>tb->MaxBand)  tb->MaxBand = bytes;
+      bytes += ForestBytes(bf, tb);
+      if (size>bf->Capacity)  bytes += (size-bf->Capacity)*TILED_FOREST_BYTES_PER_NODE;
+      if (!TiledUse(tb, bytes))
+      {
+         free(boundary);
+         BandDelete(&band);
+         return(TILED_OVERBUDGET);
+      }
+      maxcapacity = bf->Capacity + (tb->Limit-bytes)/TILED_FOREST_BYTES_PER_NODE;
+      if (ForestGrow(bf, size, maxcapacity))
+      {
+         free(boundary);
+         BandDelete(&band);
+         return(-1);
+      }
+      for (k=0; k<band.NumBoundary; k++)
+      {
+         n = boundary[k];
+         g = bf->Size + k;
+         bf->Level[g] = band.mt->Nodes[n].Level;
+         bf->Parent[g] = band.Gid[band.mt->Nodes[n].Parent];
+         bf->Attr[g] = band.mt->Attributes[n];
+         bf->KeptBelow[g] = band.Kept[n];
+         band.mt->Attributes[n] = NULL;
+      }
+      bf->Size = size;
+      for (x=0; x<ps->Width; x++)
+      {
+         if (row0>0)  UFConnect(bf->Level, bf->Parent, prevgid[x], band.Gid[BandNode(&band, x)]);
+         if (row1<ps->Height)  prevgid[x] = band.Gid[BandNode(&band, (row1-row0-1)*ps->Width + x)];
+      }
+      free(boundary);
+      BandDelete(&band);
+      (*numbands)++;
+   }
+   return(0);
+} /* ForestBuild */
+
+int MaxTreeTiledFilter(char *infname, char *outfname, AttribStruct *attrib,
+                       int decision, double lambda, ulong membudget,
+                       ulong *numbands, ulong *numboundarynodes, ulong *peakbytes)
+/* Filters the P5 PGM image infname into outfname with the given attribute
+ * and decision (DECISION_*). Bands start as high as half of membudget
+ * allows at TILED_BYTES_PER_PIXEL and are halved until every band with the
+ * attribute records of its nodes fits in membudget next to the boundary
+ * forest; the build fails if bands of one row do not. *peakbytes gets the
+ * largest of these estimates in use at once. Returns 0 on success. */
+{
+   PGMStream ps;
+   BoundaryForest bf;
+   TiledBudget tb;
+   Band band;
+   FILE *outfile;
+   ulong *prevgid, *boundary;
+   ulong bandrows, row0, row1, g, bytes;
+   int r;
+
+   if (PGMStreamOpen(&ps, infname))
+   {
+      fprintf(stderr, "Can't read binary PGM image '%s'\n", infname);
+      return(-1);
+   }
+   bandrows = membudget / 2 / ((ps.Width ? ps.Width : 1)*TILED_BYTES_PER_PIXEL);
+   if (bandrows<1)
+   {
+      fprintf(stderr, "Memory budget of %lu bytes is too small for rows of %lu pixels\n", membudget, ps.Width);
+      fclose(ps.File);
+      return(-1);
+   }
+   if (bandrows>ps.Height)  bandrows = ps.Height;
+   prevgid = malloc(ps.Width*sizeof(ulong));
+   if (prevgid==NULL)
+   {
+      fclose(ps.File);
+      return(-1);
+   }
+   tb.Limit = membudget;
+   tb.Fixed = ps.Width*sizeof(ulong);
+   tb.RecordBytes = AuxDataRecordSize(attrib->NewAuxData);
+   if (tb.RecordBytes)  tb.RecordBytes += 2*sizeof(void *);
+
+   /* Pass 1: build the boundary forest band by band, with lower bands
+    * while it does not fit */
+   for (;;)
+   {
+      memset(&bf, 0, sizeof(BoundaryForest));
+      tb.Peak = 0;
+      r = ForestBuild(&bf, &ps, attrib, lambda, bandrows, &tb, prevgid, numbands);
+      if (r==0)
+      {
+         /* ForestResolve needs two more ulongs per node, pass 2 the bands
+          * again next to the whole forest */
+         bytes = ForestBytes(&bf, &tb);
+         if (!TiledUse(&tb, bytes + 2*bf.Size*sizeof(ulong)) || !TiledUse(&tb, bytes + tb.MaxBand))
+            r = TILED_OVERBUDGET;
+      }
+      if ((r!=TILED_OVERBUDGET) || (bandrows==1))  break;
+      ForestDelete(&bf, attrib->DeleteAuxData);
+      bandrows /= 2;
+   }
+   if (r==TILED_OVERBUDGET)
+   {
+      fprintf(stderr, "Memory budget of %lu bytes is too small for '%s': bands of one row and the boundary "
+              "forest need more\n", membudget, infname);
+      r = -1;
+   }
+   *numboundarynodes = bf.Size;
+   *peakbytes = tb.Peak;
+   if ((r==0) && bf.Size)  r = ForestResolve(&bf, attrib, decision, lambda);
+
+   /* Pass 2: rebuild every band and filter it */
+   outfile = NULL;
+   if (r==0)
+   {
+      outfile = fopen(outfname, "wb");
+      if (outfile==NULL)  r = -1;
+      else  fprintf(outfile, "P5\n%ld %ld\n255\n", ps.Width, ps.Height);
+   }
+   for (row0=0, g=0; (row0<ps.Height) && (r==0); row0=row1)
+   {
+      row1 = (row0+bandrows<ps.Height) ? row0+bandrows : ps.Height;
+      if (BandBuild(&band, &ps, row0, row1, attrib, lambda, g, &boundary))
+      {
+         r = -1;
+         break;
+      }
+      free(boundary);
+      g += band.NumBoundary;
+      band.NewLevel = malloc((row1-row0)*ps.Width);
+      if (band.NewLevel==NULL)  r = -1;
+      else
+      {
+         /* The filtered rows overwrite the rows read */
+         BandFilter(&band, &bf, attrib, decision, lambda, band.Core.Pixmap);
+         if (fwrite(band.Core.Pixmap, 1, (row1-row0)*ps.Width, outfile) != (row1-row0)*ps.Width)  r = -1;
+      }
+      BandDelete(&band);
+   }
+   if (outfile)  fclose(outfile);
+   ForestDelete(&bf, attrib->DeleteAuxData);
+   free(prevgid);
+   fclose(ps.File);
+   return(r);
+} /* MaxTreeTiledFilter */
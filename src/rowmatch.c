@@ -0,0 +1,402 @@
+//
+// Kernels for the best attribute match among the candidates of a row.
+// The vector kernels keep a best difference and index per lane, each lane taking a candidate only with a strictly
+// smaller difference, so it keeps its first best. The lanes are then reduced to the smallest difference with the
+// smallest index, which is the candidate the scalar loop finds, and the tail is scanned like the scalar loop.
+//
+
+#include "rowmatch.h"
+#include <math.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define ROWMATCH_X86
+#endif
+
+// Shorter rows are left to the scalar loop, the lane setup and reduction cost more than they save
+#define ROWMATCH_MIN_VECTOR 16
+
+long RowMatchBestScalar(const double *values, const double *centroids, ulong num, double value, double centroid,
+                        double d_min, double d_max, double *best_diff) {
+    double best = *best_diff;
+    long best_idx = -1;
+    for (ulong j = 0; j < num; ++j) {
+        double disparity = centroid - centroids[j];
+        double diff_value = fabs(value-values[j]);
+        if (disparity >= d_min && disparity <= d_max && diff_value < best) {
+            best = diff_value;
+            best_idx = (long) j;
+        }
+    }
+    *best_diff = best;
+    return (best_idx);
+}
+
+long RowMatchBestFloatScalar(const float *values, const float *centroids, ulong num, float value, float centroid,
+                             float d_min, float d_max, float *best_diff) {
+    float best = *best_diff;
+    long best_idx = -1;
+    for (ulong j = 0; j < num; ++j) {
+        float disparity = centroid - centroids[j];
+        float diff_value = fabsf(value-values[j]);
+        if (disparity >= d_min && disparity <= d_max && diff_value < best) {
+            best = diff_value;
+            best_idx = (long) j;
+        }
+    }
+    *best_diff = best;
+    return (best_idx);
+}
+
+double RowMatchCost(const double *values, ulong stride, int num_attribs, const double *weights, bool squared, ulong j,
+                    const double *value) {
+    double cost = 0.0;
+    for (int k = 0; k < num_attribs; ++k) {
+        double d = value[k] - values[k*stride + j];
+        cost += weights[k] * (squared ? d*d : fabs(d));
+    }
+    return (cost);
+}
+
+long RowMatchCostScalar(const double *values, ulong stride, int num_attribs, const double *weights, bool squared,
+                        const double *centroids, ulong num, const double *value, double centroid, double d_min,
+                        double d_max, double *best_diff) {
+    double best = *best_diff;
+    long best_idx = -1;
+    for (ulong j = 0; j < num; ++j) {
+        double disparity = centroid - centroids[j];
+        if (disparity >= d_min && disparity <= d_max) {
+            double cost = RowMatchCost(values, stride, num_attribs, weights, squared, j, value);
+            if (cost < best) {
+                best = cost;
+                best_idx = (long) j;
+            }
+        }
+    }
+    *best_diff = best;
+    return (best_idx);
+}
+
+bool RowMatchScalarSupported(void) {
+    return (true);
+}
+
+#ifdef ROWMATCH_X86
+
+// Reduces num_lanes lanes of best differences and (double) indices, -1 where a lane took nothing, and scans the
+// candidates from j on with the scalar loop
+static long row_match_finish(const double *lane_best, const double *lane_idx, int num_lanes, const double *values,
+                             const double *centroids, ulong j, ulong num, double value, double centroid,
+                             double d_min, double d_max, double *best_diff) {
+    double best = *best_diff;
+    long best_idx = -1;
+    for (int k = 0; k < num_lanes; ++k) {
+        long idx = (long) lane_idx[k];
+        if (idx >= 0 && (lane_best[k] < best || (lane_best[k]==best && idx < best_idx))) {
+            best = lane_best[k];
+            best_idx = idx;
+        }
+    }
+    *best_diff = best;
+    long tail = RowMatchBestScalar(values + j, centroids + j, num - j, value, centroid, d_min, d_max, best_diff);
+    return ((tail >= 0) ? (long) j + tail : best_idx);
+}
+
+// row_match_finish for the single precision kernels, whose lanes count candidates in floats
+static long row_match_finish_float(const float *lane_best, const float *lane_idx, int num_lanes, const float *values,
+                                   const float *centroids, ulong j, ulong num, float value, float centroid,
+                                   float d_min, float d_max, float *best_diff) {
+    float best = *best_diff;
+    long best_idx = -1;
+    for (int k = 0; k < num_lanes; ++k) {
+        long idx = (long) lane_idx[k];
+        if (idx >= 0 && (lane_best[k] < best || (lane_best[k]==best && idx < best_idx))) {
+            best = lane_best[k];
+            best_idx = idx;
+        }
+    }
+    *best_diff = best;
+    long tail = RowMatchBestFloatScalar(values + j, centroids + j, num - j, value, centroid, d_min, d_max, best_diff);
+    return ((tail >= 0) ? (long) j + tail : best_idx);
+}
+
+// row_match_finish for the cost kernels
+static long row_cost_finish(const double *lane_best, const double *lane_idx, int num_lanes, const double *values,
+                            ulong stride, int num_attribs, const double *weights, bool squared,
+                            const double *centroids, ulong j, ulong num, const double *value, double centroid,
+                            double d_min, double d_max, double *best_diff) {
+    double best = *best_diff;
+    long best_idx = -1;
+    for (int k = 0; k < num_lanes; ++k) {
+        long idx = (long) lane_idx[k];
+        if (idx >= 0 && (lane_best[k] < best || (lane_best[k]==best && idx < best_idx))) {
+            best = lane_best[k];
+            best_idx = idx;
+        }
+    }
+    *best_diff = best;
+    long tail = -1;
+    for (; j < num; ++j) {
+        double disparity = centroid - centroids[j];
+        if (disparity >= d_min && disparity <= d_max) {
+            double cost = RowMatchCost(values, stride, num_attribs, weights, squared, j, value);
+            if (cost < *best_diff) {
+                *best_diff = cost;
+                tail = (long) j;
+            }
+        }
+    }
+    return ((tail >= 0) ? tail : best_idx);
+}
+
+__attribute__((target("sse4.1")))
+long RowMatchBestSSE4(const double *values, const double *centroids, ulong num, double value, double centroid,
+                      double d_min, double d_max, double *best_diff) {
+    __m128d sign = _mm_set1_pd(-0.0);
+    __m128d v = _mm_set1_pd(value), c = _mm_set1_pd(centroid);
+    __m128d lo = _mm_set1_pd(d_min), hi = _mm_set1_pd(d_max);
+    __m128d best = _mm_set1_pd(*best_diff), idx = _mm_set1_pd(-1.0);
+    __m128d jv = _mm_set_pd(1.0, 0.0), step = _mm_set1_pd(2.0);
+    double lane_best[2], lane_idx[2];
+    ulong j = 0;
+    if (num < ROWMATCH_MIN_VECTOR) {
+        return (RowMatchBestScalar(values, centroids, num, value, centroid, d_min, d_max, best_diff));
+    }
+    for (; j + 2 <= num; j += 2) {
+        __m128d disparity = _mm_sub_pd(c, _mm_loadu_pd(centroids + j));
+        __m128d diff = _mm_andnot_pd(sign, _mm_sub_pd(v, _mm_loadu_pd(values + j)));
+        __m128d take = _mm_and_pd(_mm_and_pd(_mm_cmpge_pd(disparity, lo), _mm_cmple_pd(disparity, hi)),
+                                  _mm_cmplt_pd(diff, best));
+        best = _mm_blendv_pd(best, diff, take);
+        idx = _mm_blendv_pd(idx, jv, take);
+        jv = _mm_add_pd(jv, step);
+    }
+    _mm_storeu_pd(lane_best, best);
+    _mm_storeu_pd(lane_idx, idx);
+    return (row_match_finish(lane_best, lane_idx, 2, values, centroids, j, num, value, centroid, d_min, d_max,
+                             best_diff));
+}
+
+__attribute__((target("sse4.1")))
+long RowMatchBestFloatSSE4(const float *values, const float *centroids, ulong num, float value, float centroid,
+                           float d_min, float d_max, float *best_diff) {
+    __m128 sign = _mm_set1_ps(-0.0f);
+    __m128 v = _mm_set1_ps(value), c = _mm_set1_ps(centroid);
+    __m128 lo = _mm_set1_ps(d_min), hi = _mm_set1_ps(d_max);
+    __m128 best = _mm_set1_ps(*best_diff), idx = _mm_set1_ps(-1.0f);
+    __m128 jv = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f), step = _mm_set1_ps(4.0f);
+    float lane_best[4], lane_idx[4];
+    ulong j = 0;
+    if (num < ROWMATCH_MIN_VECTOR) {
+        return (RowMatchBestFloatScalar(values, centroids, num, value, centroid, d_min, d_max, best_diff));
+    }
+    for (; j + 4 <= num; j += 4) {
+        __m128 disparity = _mm_sub_ps(c, _mm_loadu_ps(centroids + j));
+        __m128 diff = _mm_andnot_ps(sign, _mm_sub_ps(v, _mm_loadu_ps(values + j)));
+        __m128 take = _mm_and_ps(_mm_and_ps(_mm_cmpge_ps(disparity, lo), _mm_cmple_ps(disparity, hi)),
+                                 _mm_cmplt_ps(diff, best));
+        best = _mm_blendv_ps(best, diff, take);
+        idx = _mm_blendv_ps(idx, jv, take);
+        jv = _mm_add_ps(jv, step);
+    }
+    _mm_storeu_ps(lane_best, best);
+    _mm_storeu_ps(lane_idx, idx);
+    return (row_match_finish_float(lane_best, lane_idx, 4, values, centroids, j, num, value, centroid, d_min, d_max,
+                                   best_diff));
+}
+
+__attribute__((target("sse4.1")))
+long RowMatchCostSSE4(const double *values, ulong stride, int num_attribs, const double *weights, bool squared,
+                      const double *centroids, ulong num, const double *value, double centroid, double d_min,
+                      double d_max, double *best_diff) {
+    __m128d sign = _mm_set1_pd(-0.0);
+    __m128d c = _mm_set1_pd(centroid);
+    __m128d lo = _mm_set1_pd(d_min), hi = _mm_set1_pd(d_max);
+    __m128d best = _mm_set1_pd(*best_diff), idx = _mm_set1_pd(-1.0);
+    __m128d jv = _mm_set_pd(1.0, 0.0), step = _mm_set1_pd(2.0);
+    double lane_best[2], lane_idx[2];
+    ulong j = 0;
+    if (num < ROWMATCH_MIN_VECTOR) {
+        return (RowMatchCostScalar(values, stride, num_attribs, weights, squared, centroids, num, value, centroid,
+                                   d_min, d_max, best_diff));
+    }
+    for (; j + 2 <= num; j += 2) {
+        __m128d disparity = _mm_sub_pd(c, _mm_loadu_pd(centroids + j));
+        __m128d cost = _mm_setzero_pd();
+        for (int k = 0; k < num_attribs; ++k) {
+            __m128d d = _mm_sub_pd(_mm_set1_pd(value[k]), _mm_loadu_pd(values + k*stride + j));
+            d = squared ? _mm_mul_pd(d, d) : _mm_andnot_pd(sign, d);
+            cost = _mm_add_pd(cost, _mm_mul_pd(_mm_set1_pd(weights[k]), d));
+        }
+        __m128d take = _mm_and_pd(_mm_and_pd(_mm_cmpge_pd(disparity, lo), _mm_cmple_pd(disparity, hi)),
+                                  _mm_cmplt_pd(cost, best));
+        best = _mm_blendv_pd(best, cost, take);
+        idx = _mm_blendv_pd(idx, jv, take);
+        jv = _mm_add_pd(jv, step);
+    }
+    _mm_storeu_pd(lane_best, best);
+    _mm_storeu_pd(lane_idx, idx);
+    return (row_cost_finish(lane_best, lane_idx, 2, values, stride, num_attribs, weights, squared, centroids, j, num,
+                            value, centroid, d_min, d_max, best_diff));
+}
+
+bool RowMatchSSE4Supported(void) {
+    return (__builtin_cpu_supports("sse4.1"));
+}
+
+__attribute__((target("avx2")))
+long RowMatchBestAVX2(const double *values, const double *centroids, ulong num, double value, double centroid,
+                      double d_min, double d_max, double *best_diff) {
+    __m256d sign = _mm256_set1_pd(-0.0);
+    __m256d v = _mm256_set1_pd(value), c = _mm256_set1_pd(centroid);
+    __m256d lo = _mm256_set1_pd(d_min), hi = _mm256_set1_pd(d_max);
+    // Two sets of lanes for alternate blocks of four, so consecutive blocks don't wait on each other's blend
+    __m256d best[2], idx[2];
+    __m256d jv = _mm256_set_pd(3.0, 2.0, 1.0, 0.0), step = _mm256_set1_pd(4.0);
+    double lane_best[8], lane_idx[8];
+    ulong j = 0;
+    if (num < ROWMATCH_MIN_VECTOR) {
+        return (RowMatchBestScalar(values, centroids, num, value, centroid, d_min, d_max, best_diff));
+    }
+    best[0] = best[1] = _mm256_set1_pd(*best_diff);
+    idx[0] = idx[1] = _mm256_set1_pd(-1.0);
+    for (; j + 8 <= num; j += 8) {
+        for (int h = 0; h < 2; ++h) {
+            __m256d disparity = _mm256_sub_pd(c, _mm256_loadu_pd(centroids + j + 4*h));
+            __m256d diff = _mm256_andnot_pd(sign, _mm256_sub_pd(v, _mm256_loadu_pd(values + j + 4*h)));
+            __m256d take = _mm256_and_pd(_mm256_and_pd(_mm256_cmp_pd(disparity, lo, _CMP_GE_OQ),
+                                                       _mm256_cmp_pd(disparity, hi, _CMP_LE_OQ)),
+                                         _mm256_cmp_pd(diff, best[h], _CMP_LT_OQ));
+            best[h] = _mm256_blendv_pd(best[h], diff, take);
+            idx[h] = _mm256_blendv_pd(idx[h], jv, take);
+            jv = _mm256_add_pd(jv, step);
+        }
+    }
+    _mm256_storeu_pd(lane_best, best[0]);
+    _mm256_storeu_pd(lane_best + 4, best[1]);
+    _mm256_storeu_pd(lane_idx, idx[0]);
+    _mm256_storeu_pd(lane_idx + 4, idx[1]);
+    return (row_match_finish(lane_best, lane_idx, 8, values, centroids, j, num, value, centroid, d_min, d_max,
+                             best_diff));
+}
+
+__attribute__((target("avx2")))
+long RowMatchBestFloatAVX2(const float *values, const float *centroids, ulong num, float value, float centroid,
+                           float d_min, float d_max, float *best_diff) {
+    __m256 sign = _mm256_set1_ps(-0.0f);
+    __m256 v = _mm256_set1_ps(value), c = _mm256_set1_ps(centroid);
+    __m256 lo = _mm256_set1_ps(d_min), hi = _mm256_set1_ps(d_max);
+    __m256 best[2], idx[2];
+    __m256 jv = _mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f), step = _mm256_set1_ps(8.0f);
+    float lane_best[16], lane_idx[16];
+    ulong j = 0;
+    if (num < ROWMATCH_MIN_VECTOR) {
+        return (RowMatchBestFloatScalar(values, centroids, num, value, centroid, d_min, d_max, best_diff));
+    }
+    best[0] = best[1] = _mm256_set1_ps(*best_diff);
+    idx[0] = idx[1] = _mm256_set1_ps(-1.0f);
+    for (; j + 16 <= num; j += 16) {
+        for (int h = 0; h < 2; ++h) {
+            __m256 disparity = _mm256_sub_ps(c, _mm256_loadu_ps(centroids + j + 8*h));
+            __m256 diff = _mm256_andnot_ps(sign, _mm256_sub_ps(v, _mm256_loadu_ps(values + j + 8*h)));
+            __m256 take = _mm256_and_ps(_mm256_and_ps(_mm256_cmp_ps(disparity, lo, _CMP_GE_OQ),
+                                                      _mm256_cmp_ps(disparity, hi, _CMP_LE_OQ)),
+                                        _mm256_cmp_ps(diff, best[h], _CMP_LT_OQ));
+            best[h] = _mm256_blendv_ps(best[h], diff, take);
+            idx[h] = _mm256_blendv_ps(idx[h], jv, take);
+            jv = _mm256_add_ps(jv, step);
+        }
+    }
+    _mm256_storeu_ps(lane_best, best[0]);
+    _mm256_storeu_ps(lane_best + 8, best[1]);
+    _mm256_storeu_ps(lane_idx, idx[0]);
+    _mm256_storeu_ps(lane_idx + 8, idx[1]);
+    return (row_match_finish_float(lane_best, lane_idx, 16, values, centroids, j, num, value, centroid, d_min, d_max,
+                                   best_diff));
+}
+
+__attribute__((target("avx2")))
+long RowMatchCostAVX2(const double *values, ulong stride, int num_attribs, const double *weights, bool squared,
+                      const double *centroids, ulong num, const double *value, double centroid, double d_min,
+                      double d_max, double *best_diff) {
+    __m256d sign = _mm256_set1_pd(-0.0);
+    __m256d c = _mm256_set1_pd(centroid);
+    __m256d lo = _mm256_set1_pd(d_min), hi = _mm256_set1_pd(d_max);
+    __m256d best = _mm256_set1_pd(*best_diff), idx = _mm256_set1_pd(-1.0);
+    __m256d jv = _mm256_set_pd(3.0, 2.0, 1.0, 0.0), step = _mm256_set1_pd(4.0);
+    double lane_best[4], lane_idx[4];
+    ulong j = 0;
+    if (num < ROWMATCH_MIN_VECTOR) {
+        return (RowMatchCostScalar(values, stride, num_attribs, weights, squared, centroids, num, value, centroid,
+                                   d_min, d_max, best_diff));
+    }
+    // The attributes are summed in the same order as the scalar loop, and without fused multiply-adds, so the
+    // costs are the same to the bit
+    for (; j + 4 <= num; j += 4) {
+        __m256d disparity = _mm256_sub_pd(c, _mm256_loadu_pd(centroids + j));
+        __m256d cost = _mm256_setzero_pd();
+        for (int k = 0; k < num_attribs; ++k) {
+            __m256d d = _mm256_sub_pd(_mm256_set1_pd(value[k]), _mm256_loadu_pd(values + k*stride + j));
+            d = squared ? _mm256_mul_pd(d, d) : _mm256_andnot_pd(sign, d);
+            cost = _mm256_add_pd(cost, _mm256_mul_pd(_mm256_set1_pd(weights[k]), d));
+        }
+        __m256d take = _mm256_and_pd(_mm256_and_pd(_mm256_cmp_pd(disparity, lo, _CMP_GE_OQ),
+                                                   _mm256_cmp_pd(disparity, hi, _CMP_LE_OQ)),
+                                     _mm256_cmp_pd(cost, best, _CMP_LT_OQ));
+        best = _mm256_blendv_pd(best, cost, take);
+        idx = _mm256_blendv_pd(idx, jv, take);
+        jv = _mm256_add_pd(jv, step);
+    }
+    _mm256_storeu_pd(lane_best, best);
+    _mm256_storeu_pd(lane_idx, idx);
+    return (row_cost_finish(lane_best, lane_idx, 4, values, stride, num_attribs, weights, squared, centroids, j, num,
+                            value, centroid, d_min, d_max, best_diff));
+}
+
+bool RowMatchAVX2Supported(void) {
+    return (__builtin_cpu_supports("avx2"));
+}
+
+RowMatchStruct RowMatchKernels[NUMROWMATCH] = {
+                {"Scalar", RowMatchScalarSupported, RowMatchBestScalar, RowMatchBestFloatScalar, RowMatchCostScalar},
+                {"SSE4", RowMatchSSE4Supported, RowMatchBestSSE4, RowMatchBestFloatSSE4, RowMatchCostSSE4},
+                {"AVX2", RowMatchAVX2Supported, RowMatchBestAVX2, RowMatchBestFloatAVX2, RowMatchCostAVX2},
+        };
+
+#else
+
+// Other processors only have the scalar loop
+RowMatchStruct RowMatchKernels[NUMROWMATCH] = {
+                {"Scalar", RowMatchScalarSupported, RowMatchBestScalar, RowMatchBestFloatScalar, RowMatchCostScalar},
+                {"Scalar", RowMatchScalarSupported, RowMatchBestScalar, RowMatchBestFloatScalar, RowMatchCostScalar},
+                {"Scalar", RowMatchScalarSupported, RowMatchBestScalar, RowMatchBestFloatScalar, RowMatchCostScalar},
+        };
+
+#endif
+
+RowMatchFunc RowMatchSelect(void) {
+    for (int k = NUMROWMATCH-1; k > 0; --k) {
+        if (RowMatchKernels[k].Supported()) {
+            return (RowMatchKernels[k].Best);
+        }
+    }
+    return (RowMatchKernels[0].Best);
+}
+
+RowMatchFloatFunc RowMatchFloatSelect(void) {
+    for (int k = NUMROWMATCH-1; k > 0; --k) {
+        if (RowMatchKernels[k].Supported()) {
+            return (RowMatchKernels[k].BestFloat);
+        }
+    }
+    return (RowMatchKernels[0].BestFloat);
+}
+
+RowMatchCostFunc RowMatchCostSelect(void) {
+    for (int k = NUMROWMATCH-1; k > 0; --k) {
+        if (RowMatchKernels[k].Supported()) {
+            return (RowMatchKernels[k].Cost);
+        }
+    }
+    return (RowMatchKernels[0].Cost);
+}